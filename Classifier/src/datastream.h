@@ -0,0 +1,243 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include "cnn/dict.h"
+#include "input_sentence.h"
+#include "tokenizer.h"
+#include "train.h"
+
+using namespace cnn;
+using namespace std;
+
+// The three line-aligned files that make up one shard of a data set
+struct DataShard {
+  string sentence_filename;
+  string pos_filename;
+  string compound_filename;
+};
+
+// Hands out the sentences of a training set, in a new random order each epoch
+class DataSource {
+public:
+  virtual ~DataSource() {}
+  virtual void StartEpoch() = 0;
+  // Returns nullptr once every sentence of the epoch has been returned. The
+  // sentence stays valid until the next call to Next or StartEpoch.
+  virtual const InputSentence* Next() = 0;
+};
+
+// A training set that is already in memory
+class InMemoryData : public DataSource {
+public:
+  InMemoryData(const vector<InputSentence>& data, unsigned seed) : data(data), rng(seed), position(0) {
+    for (unsigned i = 0; i < data.size(); ++i) {
+      order.push_back(i);
+    }
+  }
+
+  void StartEpoch() override {
+    shuffle(order.begin(), order.end(), rng);
+    position = 0;
+  }
+
+  const InputSentence* Next() override {
+    return (position < order.size()) ? &data[order[position++]] : nullptr;
+  }
+
+private:
+  const vector<InputSentence>& data;
+  mt19937 rng;
+  vector<unsigned> order;
+  unsigned position;
+};
+
+// Streams a training set that is split over many shards, so that only a few
+// shards are ever in memory. Shards are read in a new random order each epoch,
+// and a background thread loads the next shard while the current one is being
+// trained on. Sentences are shuffled within a bounded buffer, which mixes
+// neighbouring shards.
+class DataStream : public DataSource {
+public:
+  // Every shard is mapped into the given (frozen) vocabularies
+  DataStream(const vector<DataShard>& shards, const Dict& vocab, const Dict& pos_vocab, unsigned buffer_size, unsigned seed, unsigned load_threads);
+  ~DataStream() override;
+  DataStream(const DataStream&) = delete;
+  DataStream& operator=(const DataStream&) = delete;
+
+  void StartEpoch() override;
+  const InputSentence* Next() override;
+
+private:
+  void LoadShards(vector<DataShard> shard_order);
+  bool NextFromShard(InputSentence& example);
+  void StopLoading();
+
+  vector<DataShard> shards;
+  Dict vocab;
+  Dict pos_vocab;
+  unsigned buffer_size;
+  mt19937 rng;
+  unsigned load_threads;
+
+  vector<InputSentence> buffer;
+  InputSentence current;
+  unique_ptr<vector<InputSentence>> shard; // The shard currently being read into the buffer
+  unsigned shard_position;
+
+  // Shared with the loader thread
+  thread loader;
+  deque<unique_ptr<vector<InputSentence>>> loaded_shards;
+  bool loading_done;
+  bool stop_loading;
+  mutex m;
+  condition_variable cv;
+};
+
+inline DataStream::DataStream(const vector<DataShard>& shards, const Dict& vocab, const Dict& pos_vocab, unsigned buffer_size, unsigned seed, unsigned load_threads) :
+    shards(shards), vocab(vocab), pos_vocab(pos_vocab), buffer_size(buffer_size), rng(seed), load_threads(load_threads),
+    shard_position(0), loading_done(true), stop_loading(false) {
+  assert (buffer_size > 0);
+  this->vocab.Freeze();
+  this->vocab.SetUnk("UNK");
+  this->pos_vocab.Freeze();
+}
+
+inline DataStream::~DataStream() {
+  StopLoading();
+}
+
+inline void DataStream::StopLoading() {
+  if (loader.joinable()) {
+    {
+      lock_guard<mutex> lock(m);
+      stop_loading = true;
+    }
+    cv.notify_all();
+    loader.join();
+  }
+  loaded_shards.clear();
+  stop_loading = false;
+}
+
+inline void DataStream::StartEpoch() {
+  StopLoading();
+  buffer.clear();
+  shard.reset();
+  shard_position = 0;
+
+  vector<DataShard> shard_order = shards;
+  shuffle(shard_order.begin(), shard_order.end(), rng);
+  loading_done = false;
+  loader = thread(&DataStream::LoadShards, this, shard_order);
+
+  InputSentence example;
+  while (buffer.size() < buffer_size && NextFromShard(example)) {
+    buffer.push_back(move(example));
+  }
+}
+
+inline void DataStream::LoadShards(vector<DataShard> shard_order) {
+  for (const DataShard& data_shard : shard_order) {
+    unique_ptr<vector<InputSentence>> data(ReadData(data_shard.sentence_filename, data_shard.pos_filename, data_shard.compound_filename, &vocab, &pos_vocab, load_threads));
+    if (data == nullptr) {
+      cerr << "WARNING: Unable to read shard " << data_shard.sentence_filename << endl;
+      continue;
+    }
+
+    // Stay at most one shard ahead of the trainer
+    unique_lock<mutex> lock(m);
+    cv.wait(lock, [this]() { return loaded_shards.empty() || stop_loading; });
+    if (stop_loading) {
+      break;
+    }
+    loaded_shards.push_back(move(data));
+    cv.notify_all();
+  }
+
+  lock_guard<mutex> lock(m);
+  loading_done = true;
+  cv.notify_all();
+}
+
+// Returns the next sentence in file order, waiting for the loader if need be
+inline bool DataStream::NextFromShard(InputSentence& example) {
+  while (shard == nullptr || shard_position >= shard->size()) {
+    unique_lock<mutex> lock(m);
+    cv.wait(lock, [this]() { return !loaded_shards.empty() || loading_done; });
+    if (loaded_shards.empty()) {
+      shard.reset();
+      return false;
+    }
+    shard = move(loaded_shards.front());
+    loaded_shards.pop_front();
+    shard_position = 0;
+    cv.notify_all();
+  }
+  example = move(shard->at(shard_position++));
+  return true;
+}
+
+inline const InputSentence* DataStream::Next() {
+  if (buffer.empty()) {
+    return nullptr;
+  }
+
+  // Emit a random element of the buffer and refill its slot from the stream
+  uniform_int_distribution<unsigned> pick(0, buffer.size() - 1);
+  unsigned i = pick(rng);
+  current = move(buffer[i]);
+  if (!NextFromShard(buffer[i])) {
+    swap(buffer[i], buffer.back());
+    buffer.pop_back();
+  }
+  return &current;
+}
+
+// Reads three files listing the sentence, POS and compound files of each
+// shard, one filename per line, with the lists in the same order
+inline vector<DataShard> ReadShardLists(const string& sentence_list, const string& pos_list, const string& compound_list) {
+  vector<string> filenames[3];
+  const string* lists[3] = {&sentence_list, &pos_list, &compound_list};
+  for (unsigned i = 0; i < 3; ++i) {
+    ifstream f(*lists[i]);
+    for (string line; getline(f, line);) {
+      StringPiece filename = Strip(line);
+      if (filename.size() > 0) {
+        filenames[i].push_back(string(filename.data(), filename.size()));
+      }
+    }
+  }
+
+  vector<DataShard> shards;
+  if (filenames[1].size() != filenames[0].size() || filenames[2].size() != filenames[0].size()) {
+    cerr << "The shard lists " << sentence_list << ", " << pos_list << " and " << compound_list << " name different numbers of files!" << endl;
+    return shards;
+  }
+  for (unsigned i = 0; i < filenames[0].size(); ++i) {
+    shards.push_back({filenames[0][i], filenames[1][i], filenames[2][i]});
+  }
+  return shards;
+}
+
+// Adds the words and tags of every shard to the vocabularies, keeping only one
+// shard in memory at a time. Returns the number of sentences.
+inline unsigned ReadShardVocabularies(const vector<DataShard>& shards, Dict* vocab, Dict* pos_vocab, unsigned load_threads) {
+  unsigned sentence_count = 0;
+  for (const DataShard& data_shard : shards) {
+    unique_ptr<vector<InputSentence>> data(ReadData(data_shard.sentence_filename, data_shard.pos_filename, data_shard.compound_filename, vocab, pos_vocab, load_threads));
+    if (data == nullptr) {
+      cerr << "ERROR: Unable to read shard " << data_shard.sentence_filename << endl;
+      exit(1);
+    }
+    sentence_count += data->size();
+  }
+  return sentence_count;
+}
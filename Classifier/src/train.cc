@@ -14,6 +14,8 @@
 
 #include "classifier.h"
 #include "train.h"
+#include "datastream.h"
+#include "hogwild.h"
 
 using namespace cnn;
 using namespace std;
@@ -35,6 +37,120 @@ pair<cnn::real, unsigned> ComputeLoss(const vector<InputSentence>& data, Compoun
   return make_pair(loss, span_count);
 }
 
+class ClassifierStats {
+public:
+  cnn::real loss;
+  cnn::real span_count;
+  cnn::real scale; // Corrects the perplexity for down-sampled negative examples
+
+  ClassifierStats() : loss(), span_count(), scale() {}
+  ClassifierStats(cnn::real loss, cnn::real span_count, cnn::real scale) : loss(loss), span_count(span_count), scale(scale) {}
+
+  ClassifierStats& operator+=(const ClassifierStats& rhs) {
+    loss += rhs.loss;
+    span_count += rhs.span_count;
+    scale = rhs.scale;
+    return *this;
+  }
+
+  bool operator<(const ClassifierStats& rhs) const {
+    return loss < rhs.loss;
+  }
+
+  friend std::ostream& operator<< (std::ostream& stream, const ClassifierStats& stats) {
+    return stream << exp(stats.loss / stats.span_count * stats.scale);
+  }
+};
+
+class ClassifierLearner : public cnn::mp::ILearner<InputSentence, ClassifierStats> {
+public:
+  ClassifierLearner(Dict& vocab, Dict& pos_vocab, CompoundClassifier& classifier, Model& model) :
+    vocab(vocab), pos_vocab(pos_vocab), classifier(classifier), model(model) {}
+  ClassifierStats LearnFromDatum(const InputSentence& example, bool learn) {
+    ComputationGraph cg;
+    classifier.BuildGraph(example, cg);
+    ClassifierStats stats(as_scalar(cg.forward()), example.NumSpans(), (classifier.down_sample_rate + 1) / 2.0);
+    if (learn) {
+      cg.backward();
+    }
+    return stats;
+  }
+
+  void SaveModel() {
+    Serialize(vocab, pos_vocab, classifier, model);
+  }
+private:
+  Dict& vocab;
+  Dict& pos_vocab;
+  CompoundClassifier& classifier;
+  Model& model;
+};
+
+// Trains on one sentence at a time, with an update every minibatch_size
+// sentences, whether the training set is in memory or streamed from disk
+void TrainSerially(DataSource& training_data, unsigned sentence_count, CompoundClassifier& classifier, Trainer* sgd, const vector<InputSentence>& dev_set,
+    Dict& vocab, Dict& pos_vocab, Model& cnn_model, unsigned num_iterations, unsigned minibatch_size, unsigned report_frequency) {
+  // Corrects the perplexity for down-sampled negative examples
+  const double scale = (classifier.down_sample_rate + 1) / 2.0;
+  unsigned minibatch_count = 0;
+  cnn::real best_dev_loss = numeric_limits<cnn::real>::max();
+  for (unsigned iteration = 0; iteration < num_iterations; iteration++) {
+    unsigned word_count = 0;
+    unsigned tword_count = 0;
+    training_data.StartEpoch();
+    double loss = 0.0;
+    double tloss = 0.0;
+    const InputSentence* example;
+    for (unsigned i = 0; (example = training_data.Next()) != nullptr; ++i) {
+      // These braces cause cg to go out of scope before we ever try to call
+      // ComputeLoss() on the dev set. Without them, ComputeLoss() tries to
+      // create a second ComputationGraph, which makes CNN quite unhappy.
+      {
+        ComputationGraph cg;
+        classifier.BuildGraph(*example, cg);
+        unsigned sent_word_count = example->NumSpans();
+        word_count += sent_word_count;
+        tword_count += sent_word_count;
+        double sent_loss = as_scalar(cg.forward());
+        loss += sent_loss;
+        tloss += sent_loss;
+        cg.backward();
+      }
+      if (i % report_frequency == report_frequency - 1) {
+        float fractional_iteration = (float)iteration + ((float)(i + 1) / sentence_count);
+        cerr << "--" << fractional_iteration << "     perp=" << exp(tloss / tword_count * scale) << endl;
+        cerr.flush();
+        tloss = 0;
+        tword_count = 0;
+      }
+      if (++minibatch_count == minibatch_size) {
+        sgd->update(1.0 / minibatch_size);
+        minibatch_count = 0;
+      }
+      if (ctrlc_pressed) {
+        break;
+      }
+    }
+    //sgd->update_epoch();
+    cerr << "##" << (float)(iteration + 1) << "     perp=" << exp(loss / word_count * scale) << endl;
+    if (!ctrlc_pressed) {
+      auto dev_loss = ComputeLoss(dev_set, classifier);
+      cnn::real dev_perp = exp(dev_loss.first / dev_loss.second * scale);
+      bool new_best = dev_loss.first <= best_dev_loss;
+      cerr << "**" << iteration + 1 << " dev perp: " << dev_perp << (new_best ? " (New best!)" : "") << endl;
+      cerr.flush();
+      if (new_best) {
+        Serialize(vocab, pos_vocab, classifier, cnn_model);
+        best_dev_loss = dev_loss.first;
+      }
+    }
+
+    if (ctrlc_pressed) {
+      break;
+    }
+  }
+}
+
 int main(int argc, char** argv) {
   signal (SIGINT, ctrlc_handler);
 
@@ -47,7 +163,12 @@ int main(int argc, char** argv) {
   ("dev_pos", po::value<string>()->required(), "Dev pos tags")
   ("dev_compounds", po::value<string>()->required(), "Dev compounds")
   ("num_iterations,i", po::value<unsigned>()->default_value(UINT_MAX), "Number of epochs to train for")
-  ("batch_size,b", po::value<unsigned>()->default_value(1), "Size of minibatches")
+  ("batch_size,b", po::value<unsigned>()->default_value(1), "Size of minibatches. Only supported with a single core.")
+  ("cores,j", po::value<unsigned>()->default_value(1), "Number of CPU cores to use for training. Above 1, asynchronous Hogwild workers share one model and update it after every sentence.")
+  ("load_threads", po::value<unsigned>()->default_value(0), "Number of threads used to parse the training and dev files. 0 uses one per core.")
+  ("stream", "Treat training_set, training_pos and training_compounds as lists of shard files, one filename per line and in the same order, and stream the shards from disk instead of loading the whole training set")
+  ("shuffle_buffer", po::value<unsigned>()->default_value(100000), "Number of sentences shuffled together when streaming")
+  ("pin_workers", "With --cores, pin each worker to its own core, spread across NUMA nodes, and interleave the parameters across the nodes")
   ("random_seed,r", po::value<unsigned>()->default_value(0), "Random seed. If this value is 0 a seed will be chosen randomly.")
   ("down_sample_rate,d", po::value<unsigned>()->default_value(1), "Take only every Nth negative training example")
   ("max_length,n", po::value<unsigned>()->default_value(4), "Max length source span that can compound")
@@ -67,6 +188,7 @@ int main(int argc, char** argv) {
   ("regularization", po::value<double>()->default_value(0.0), "L2 Regularization strength")
   ("eta_decay", po::value<double>()->default_value(0.05), "Learning rate decay rate (SGD only)")
   ("no_clipping", "Disable clipping of gradients")
+  ("lazy_sparse", "Only update the embedding rows that were used since the last update. Rows catch up on decay when next used. (Adagrad, RMSProp, and Adam only)")
   // End optimizer configuration
   ("help", "Display this help message");
 
@@ -95,11 +217,43 @@ int main(int argc, char** argv) {
   const string dev_pos_filename = vm["dev_pos"].as<string>();
   const string dev_comp_filename = vm["dev_compounds"].as<string>();
   const unsigned num_iterations = vm["num_iterations"].as<unsigned>();
-  const unsigned random_seed = vm["random_seed"].as<unsigned>();
+  // Resolved once, so that cnn, the shuffles and the Hogwild workers all use the same seed
+  unsigned random_seed = vm["random_seed"].as<unsigned>();
+  if (random_seed == 0) {
+    random_seed = random_device()();
+  }
   const unsigned minibatch_size = vm["batch_size"].as<unsigned>();
   const unsigned max_length = vm["max_length"].as<unsigned>();
+  const unsigned num_workers = vm["cores"].as<unsigned>();
+  const unsigned load_threads = vm["load_threads"].as<unsigned>();
+  if (num_workers > 1 && minibatch_size > 1) {
+    cerr << "Invalid parameters: Hogwild workers update after every sentence, so --batch_size cannot be combined with --cores." << endl;
+    exit(1);
+  }
+  if (num_workers <= 1 && vm.count("pin_workers")) {
+    cerr << "Invalid parameters: --pin_workers only applies to the Hogwild workers of --cores." << endl;
+    exit(1);
+  }
+  const bool streaming = vm.count("stream") > 0;
+  vector<DataShard> shards;
+  if (streaming) {
+    if (num_workers > 1) {
+      cerr << "Invalid parameters: --stream only supports training with a single core." << endl;
+      exit(1);
+    }
+    if (vm["shuffle_buffer"].as<unsigned>() == 0) {
+      cerr << "Invalid parameters: --shuffle_buffer must be positive." << endl;
+      exit(1);
+    }
+    shards = ReadShardLists(train_sent_filename, train_pos_filename, train_comp_filename);
+    if (shards.size() == 0) {
+      cerr << "ERROR: No shards listed in " << train_sent_filename << endl;
+      exit(1);
+    }
+  }
 
-  cnn::Initialize(argc, argv, random_seed);
+  // Hogwild workers can only share the model if its parameters live in shared memory
+  cnn::Initialize(argc, argv, random_seed, num_workers > 1);
   std::mt19937 rndeng(42);
   CompoundClassifier* classifier_model = new CompoundClassifier(max_length);
   classifier_model->down_sample_rate = vm["down_sample_rate"].as<unsigned>();
@@ -108,10 +262,18 @@ int main(int argc, char** argv) {
   Dict pos_vocab;
 
   vocab.Convert("UNK");
-  vector<InputSentence>* training_set = ReadData(train_sent_filename, train_pos_filename, train_comp_filename, &vocab, &pos_vocab);
-  assert (minibatch_size <= training_set->size());
+  vector<InputSentence>* training_set = nullptr;
+  unsigned training_size = 0;
+  if (streaming) {
+    training_size = ReadShardVocabularies(shards, &vocab, &pos_vocab, load_threads);
+    cerr << "Found " << training_size << " sentences in " << shards.size() << " shards" << endl;
+  }
+  else {
+    training_set = ReadData(train_sent_filename, train_pos_filename, train_comp_filename, &vocab, &pos_vocab, load_threads);
+    assert (minibatch_size <= training_set->size());
+  }
   //vocab.Freeze();
-  vector<InputSentence>* dev_set = ReadData(dev_sent_filename, dev_pos_filename, dev_comp_filename, &vocab, &pos_vocab);
+  vector<InputSentence>* dev_set = ReadData(dev_sent_filename, dev_pos_filename, dev_comp_filename, &vocab, &pos_vocab, load_threads);
   cerr << "Vocab size: " << vocab.size() << endl;
   cerr << "POS vocab size: " << pos_vocab.size() << endl;
 
@@ -119,63 +281,28 @@ int main(int argc, char** argv) {
   Trainer* sgd = CreateTrainer(*cnn_model, vm);
 
   cerr << "Training model...\n";
-  unsigned minibatch_count = 0;
   const unsigned report_frequency = 500;
-  cnn::real best_dev_loss = numeric_limits<cnn::real>::max();
-  for (unsigned iteration = 0; iteration < num_iterations; iteration++) {
-    unsigned word_count = 0;
-    unsigned tword_count = 0;
-    random_shuffle(training_set->begin(), training_set->end());
-    double loss = 0.0;
-    double tloss = 0.0;
-    for (unsigned i = 0; i < training_set->size(); ++i) { 
-      // These braces cause cg to go out of scope before we ever try to call
-      // ComputeLoss() on the dev set. Without them, ComputeLoss() tries to
-      // create a second ComputationGraph, which makes CNN quite unhappy.
-      {
-        ComputationGraph cg;
-        InputSentence& example = training_set->at(i);
-        classifier_model->BuildGraph(example, cg);
-        unsigned sent_word_count = example.NumSpans();
-        word_count += sent_word_count;
-        tword_count += sent_word_count;
-        double sent_loss = as_scalar(cg.forward());
-        loss += sent_loss;
-        tloss += sent_loss;
-        cg.backward();
-      }
-      if (i % report_frequency == report_frequency - 1) {
-        float fractional_iteration = (float)iteration + ((float)(i + 1) / training_set->size());
-        cerr << "--" << fractional_iteration << "     perp=" << exp(tloss/tword_count * (classifier_model->down_sample_rate + 1) / 2.0) << endl;
-        cerr.flush();
-        tloss = 0;
-        tword_count = 0;
-      }
-      if (++minibatch_count == minibatch_size) {
-        sgd->update(1.0 / minibatch_size);
-        minibatch_count = 0;
-      }
-      if (ctrlc_pressed) {
-        break;
-      }
-    }
-    //sgd->update_epoch();
-    cerr << "##" << (float)(iteration + 1) << "     perp=" << exp(loss / word_count * (classifier_model->down_sample_rate + 1) / 2.0) << endl;
-    if (!ctrlc_pressed) {
-      auto dev_loss = ComputeLoss(*dev_set, *classifier_model);
-      cnn::real dev_perp = exp(dev_loss.first / dev_loss.second * (classifier_model->down_sample_rate + 1) / 2.0);
-      bool new_best = dev_loss.first <= best_dev_loss;
-      cerr << "**" << iteration + 1 << " dev perp: " << dev_perp << (new_best ? " (New best!)" : "") << endl;
-      cerr.flush();
-      if (new_best) {
-        Serialize(vocab, pos_vocab, *classifier_model, *cnn_model);
-        best_dev_loss = dev_loss.first;
-      }
+  if (num_workers > 1) {
+    ClassifierLearner learner(vocab, pos_vocab, *classifier_model, *cnn_model);
+    HogwildOptions<InputSentence> options;
+    options.random_seed = random_seed;
+    // Every word is run through the LSTMs, and every span is scored
+    options.cost = [](const InputSentence& example) { return (float)(example.sentence.size() + example.NumSpans()); };
+    options.pin_workers = vm.count("pin_workers") > 0;
+    if (options.pin_workers && InterleaveParameters(*cnn_model)) {
+      cerr << "Interleaved the parameters across " << NumaNodeCount() << " NUMA nodes" << endl;
     }
+    RunHogwild<InputSentence, ClassifierStats>(num_workers, &learner, sgd, *training_set, *dev_set, num_iterations, training_set->size(), report_frequency, options);
+    return 0;
+  }
 
-    if (ctrlc_pressed) {
-      break;
-    }
+  if (streaming) {
+    DataStream stream(shards, vocab, pos_vocab, vm["shuffle_buffer"].as<unsigned>(), random_seed, load_threads);
+    TrainSerially(stream, training_size, *classifier_model, sgd, *dev_set, vocab, pos_vocab, *cnn_model, num_iterations, minibatch_size, report_frequency);
+  }
+  else {
+    InMemoryData training_data(*training_set, random_seed);
+    TrainSerially(training_data, training_set->size(), *classifier_model, sgd, *dev_set, vocab, pos_vocab, *cnn_model, num_iterations, minibatch_size, report_frequency);
   }
 
   return 0;
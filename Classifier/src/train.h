@@ -1,7 +1,19 @@
+#pragma once
 #include "cnn/mp.h"
 #include "cnn/dict.h"
 #include "input_sentence.h"
 #include "classifier.h"
+#include "tokenizer.h"
+#include "lazytrainer.h"
+#include "vocabmap.h"
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace cnn;
 using namespace std;
@@ -38,40 +50,18 @@ void Serialize(Dict& dict, Dict& pos_dict, CompoundClassifier& compound_model, M
   oa & cnn_model;
 }
 
-vector<string> tokenize(string input, string delimiter, unsigned max_times) {
-  vector<string> tokens;
-  //tokens.reserve(max_times);
-  size_t last = 0;
-  size_t next = 0;
-  while ((next = input.find(delimiter, last)) != string::npos && tokens.size() < max_times) {
-    tokens.push_back(input.substr(last, next-last));
-    last = next + delimiter.length();
-  }
-  tokens.push_back(input.substr(last));
-  return tokens;
-}
-
-vector<string> tokenize(string input, string delimiter) {
-  return tokenize(input, delimiter, input.length());
-}
-
-vector<string> tokenize(string input, char delimiter) {
-  return tokenize(input, string(1, delimiter));
-}
-
-
-bool ReadNextCompound(ifstream& f, unsigned* next_compound_line, Span* next_compound_span) {
+bool ReadNextCompound(ifstream& f, TokenBuffers& buffers, unsigned* next_compound_line, Span* next_compound_span) {
   string line;
   if (!getline(f, line)) {
     return false;
   }
-  vector<string> parts = tokenize(line, "\t");
-  *next_compound_line = (unsigned)atoi(parts[0].c_str());
-  vector<string> indices = tokenize(parts[2], " ");
+  Split(line, "\t", buffers.fields);
+  *next_compound_line = (unsigned)ParseInt(buffers.fields[0], buffers);
+  Split(buffers.fields[2], " ", buffers.words);
   unsigned m = -1;
   unsigned M = 0;
-  for (string index : indices) {
-    unsigned i = (unsigned)atoi(index.c_str());
+  for (StringPiece index : buffers.words) {
+    unsigned i = (unsigned)ParseInt(index, buffers);
     m = (i < m) ? i : m;
     M = (i > M) ? i : M;
   }
@@ -79,66 +69,197 @@ bool ReadNextCompound(ifstream& f, unsigned* next_compound_line, Span* next_comp
   return true;
 }
 
-vector<InputSentence>* ReadData(const string& sentence_filename, const string& pos_filename, const string& compound_filename, Dict* vocab, Dict* pos_vocab) {
+// A read-only mapping of a whole file, so that reading a corpus does not
+// hold a second copy of it in memory
+class MappedText {
+public:
+  explicit MappedText(const string& filename) : data(nullptr), size(0), ok(false) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      size = st.st_size;
+      data = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+      ok = (data != MAP_FAILED);
+      if (ok && size > 0) {
+        madvise(data, size, MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+  }
+  ~MappedText() {
+    if (ok && size > 0) {
+      munmap(data, size);
+    }
+  }
+  MappedText(const MappedText&) = delete;
+  MappedText& operator=(const MappedText&) = delete;
+
+  bool is_open() const { return ok; }
+  StringPiece text() const { return ok ? StringPiece(static_cast<const char*>(data), size) : StringPiece(); }
+
+private:
+  void* data;
+  size_t size;
+  bool ok;
+};
+
+// Counts lines the way getline would: a final newline does not start another line
+unsigned CountLines(StringPiece text) {
+  unsigned lines = count(text.begin(), text.end(), '\n');
+  if (text.size() > 0 && text.back() != '\n') {
+    ++lines;
+  }
+  return lines;
+}
+
+// The byte offsets at which each of the (increasing) line numbers in first_lines begins
+vector<size_t> LineOffsets(StringPiece text, const vector<unsigned>& first_lines) {
+  vector<size_t> offsets;
+  size_t offset = 0;
+  unsigned line = 0;
+  for (unsigned first_line : first_lines) {
+    for (; line < first_line; ++line) {
+      const void* newline = memchr(text.data() + offset, '\n', text.size() - offset);
+      offset = (newline == nullptr) ? text.size() : static_cast<const char*>(newline) - text.data() + 1;
+    }
+    offsets.push_back(offset);
+  }
+  return offsets;
+}
+
+// Removes and returns the first line of text
+StringPiece NextLine(StringPiece& text) {
+  size_t newline = text.find('\n');
+  StringPiece line = text.substr(0, newline);
+  text = (newline == StringPiece::npos) ? StringPiece() : text.substr(newline + 1);
+  return line;
+}
+
+// The result of parsing one range of lines, with word and tag ids from
+// chunk-local vocabularies
+struct DataChunk {
+  Dict vocab;
+  Dict pos_vocab;
+  vector<InputSentence> data;
+  unsigned bad_line = 0; // 1-based index of a line whose words and tags do not match up
+};
+
+// Parses the matching line ranges sentence_text and pos_text, whose first
+// line is line first_line of the files
+void ReadDataChunk(StringPiece sentence_text, StringPiece pos_text, unsigned first_line, unsigned num_lines, DataChunk& chunk) {
+  TokenBuffers sentence_buffers;
+  TokenBuffers pos_buffers;
+  vector<StringPiece>& sentence = sentence_buffers.words;
+  vector<StringPiece>& pos_tags = pos_buffers.words;
+  chunk.data.resize(num_lines);
+  for (unsigned i = 0; i < num_lines; ++i) {
+    InputSentence& input_sentence = chunk.data[i];
+    Split(NextLine(sentence_text), " ", sentence);
+    Split(NextLine(pos_text), " ", pos_tags);
+    if (sentence.size() != pos_tags.size()) {
+      chunk.bad_line = first_line + i + 1;
+      return;
+    }
+    for (StringPiece word : sentence) {
+      input_sentence.sentence.push_back(chunk.vocab.Convert(sentence_buffers.Word(word)));
+    }
+    for (StringPiece pos_tag : pos_tags) {
+      input_sentence.pos_tags.push_back(chunk.pos_vocab.Convert(pos_buffers.Word(pos_tag)));
+    }
+  }
+}
+
+// Reads three line-aligned files. The sentence and POS files are mapped and
+// split into matching ranges of lines, which are parsed on num_threads threads
+// (0 uses one per core) and merged in order, so ids come out as if read serially.
+vector<InputSentence>* ReadData(const string& sentence_filename, const string& pos_filename, const string& compound_filename, Dict* vocab, Dict* pos_vocab, unsigned num_threads = 1) {
   assert (vocab != NULL);
   assert (pos_vocab != NULL);
-  vector<InputSentence>* data = new vector<InputSentence>();
-  ifstream sentence_file(sentence_filename);
-  ifstream pos_file(pos_filename);
+  MappedText sentence_file(sentence_filename);
+  MappedText pos_file(pos_filename);
   ifstream compound_file(compound_filename);
   if (!sentence_file.is_open() || !pos_file.is_open() || !compound_file.is_open()) {
     return nullptr;
   }
 
-  string sentence_line;
-  string pos_line;
-  string compound_line;
-  unsigned next_compound_line;
-  Span next_compound_span;
-  bool more_compounds = ReadNextCompound(compound_file, &next_compound_line, &next_compound_span);
-
-  unsigned i = 0;
-  while (getline(sentence_file, sentence_line)) {
-    cerr << i << "\r";
-    ++i;
-    data->push_back(InputSentence());
-    InputSentence& input_sentence = data->back();
-    if (!getline(pos_file, pos_line)) {
-     cerr << "POS tag file (" << pos_filename << ") contains fewer lines than sentences file (" << sentence_filename << ")!" << endl;
-     return nullptr;
-    }
-    //cout << sentence_line << endl << pos_line << endl;
-    vector<string> sentence = tokenize(sentence_line, " ");
-    vector<string> pos_tags = tokenize(pos_line, " ");
-    if (sentence.size() != pos_tags.size()) {
-      cerr << "Mismatch in number of words and POS tags on line " << i << endl;
-      return nullptr;
-    }
+  const StringPiece sentence_text = sentence_file.text();
+  const StringPiece pos_text = pos_file.text();
+  const unsigned num_lines = CountLines(sentence_text);
+  const unsigned num_pos_lines = CountLines(pos_text);
+  if (num_pos_lines < num_lines) {
+    cerr << "POS tag file (" << pos_filename << ") contains fewer lines than sentences file (" << sentence_filename << ")!" << endl;
+    return nullptr;
+  }
+  if (num_pos_lines > num_lines) {
+    cerr << "POS tag file (" << pos_filename << ") contains more lines than sentences file (" << sentence_filename << ")!" << endl;
+    return nullptr;
+  }
 
-    for (string word : sentence) {
-      input_sentence.sentence.push_back(vocab->Convert(word));
-    }
+  if (num_threads == 0) {
+    num_threads = max(thread::hardware_concurrency(), 1U);
+  }
+  num_threads = max(min(num_threads, num_lines), 1U);
+  vector<unsigned> first_lines;
+  for (unsigned i = 0; i <= num_threads; ++i) {
+    first_lines.push_back((uint64_t)num_lines * i / num_threads);
+  }
+  const vector<size_t> sentence_offsets = LineOffsets(sentence_text, first_lines);
+  const vector<size_t> pos_offsets = LineOffsets(pos_text, first_lines);
 
-    for (string pos_tag : pos_tags) {
-      input_sentence.pos_tags.push_back(pos_vocab->Convert(pos_tag));
-    }
+  vector<DataChunk> chunks(num_threads);
+  vector<thread> threads;
+  for (unsigned i = 0; i < num_threads; ++i) {
+    StringPiece sentence_chunk = sentence_text.substr(sentence_offsets[i], sentence_offsets[i + 1] - sentence_offsets[i]);
+    StringPiece pos_chunk = pos_text.substr(pos_offsets[i], pos_offsets[i + 1] - pos_offsets[i]);
+    unsigned first_line = first_lines[i];
+    unsigned chunk_lines = first_lines[i + 1] - first_lines[i];
+    DataChunk& chunk = chunks[i];
+    threads.push_back(thread([sentence_chunk, pos_chunk, first_line, chunk_lines, &chunk]() { ReadDataChunk(sentence_chunk, pos_chunk, first_line, chunk_lines, chunk); }));
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
 
-    while (more_compounds && next_compound_line == i) {
-      input_sentence.compound_spans.push_back(next_compound_span);
-      //cout << "Compound from " << get<0>(next_compound_span) << " to " << get<1>(next_compound_span) << endl;
-      more_compounds = ReadNextCompound(compound_file, &next_compound_line, &next_compound_span);
+  vector<InputSentence>* data = new vector<InputSentence>();
+  data->reserve(num_lines);
+  vector<WordId> word_map;
+  vector<WordId> pos_map;
+  for (DataChunk& chunk : chunks) {
+    if (chunk.bad_line != 0) {
+      cerr << "Mismatch in number of words and POS tags on line " << chunk.bad_line << endl;
+      delete data;
+      return nullptr;
     }
-    //cout << endl;
+    BuildVocabMap(chunk.vocab, *vocab, word_map);
+    BuildVocabMap(chunk.pos_vocab, *pos_vocab, pos_map);
+    for (InputSentence& input_sentence : chunk.data) {
+      for (WordId& word : input_sentence.sentence) {
+        word = word_map[word];
+      }
+      for (WordId& pos_tag : input_sentence.pos_tags) {
+        pos_tag = pos_map[pos_tag];
+      }
+      data->push_back(move(input_sentence));
+    }
+    chunk = DataChunk();
   }
 
-  if (getline(pos_file, pos_line)) {
-    cerr << "POS tag file (" << pos_filename << ") contains more lines than sentences file (" << sentence_filename << ")!" << endl;
-    return nullptr;
-  }
-  if (more_compounds) {
-    cerr << "Compounds exist in the compounds file (" << compound_filename << ") with indices longer than the length of the sentences file!" << endl;
-    return nullptr;
+  // Compound lines are 1-based indices into the sentences file
+  unsigned compound_line;
+  Span compound_span;
+  TokenBuffers compound_buffers;
+  while (ReadNextCompound(compound_file, compound_buffers, &compound_line, &compound_span)) {
+    if (compound_line == 0 || compound_line > data->size()) {
+      cerr << "Compounds exist in the compounds file (" << compound_filename << ") with indices longer than the length of the sentences file!" << endl;
+      delete data;
+      return nullptr;
+    }
+    data->at(compound_line - 1).compound_spans.push_back(compound_span);
   }
+
   cerr << "Read " << data->size() << " sentences from " << sentence_filename << endl;
   return data;
 }
@@ -147,11 +268,16 @@ Trainer* CreateTrainer(Model& model, const po::variables_map& vm) {
   double regularization_strength = vm["regularization"].as<double>();
   double eta_decay = vm["eta_decay"].as<double>();
   bool clipping_enabled = (vm.count("no_clipping") == 0);
+  bool lazy = (vm.count("lazy_sparse") > 0);
   unsigned learner_count = vm.count("sgd") + vm.count("momentum") + vm.count("adagrad") + vm.count("adadelta") + vm.count("rmsprop") + vm.count("adam");
   if (learner_count > 1) {
     cerr << "Invalid parameters: Please specify only one learner type.";
     exit(1);
   }
+  if (lazy && !(vm.count("adagrad") || vm.count("rmsprop") || vm.count("adam"))) {
+    cerr << "Invalid parameters: --lazy_sparse only works with Adagrad, RMSProp and Adam.";
+    exit(1);
+  }
 
   Trainer* trainer = NULL;
   if (vm.count("momentum")) {
@@ -162,7 +288,12 @@ Trainer* CreateTrainer(Model& model, const po::variables_map& vm) {
   else if (vm.count("adagrad")) {
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.1;
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-20;
-    trainer = new AdagradTrainer(&model, regularization_strength, learning_rate, eps);
+    if (lazy) {
+      trainer = new LazyAdagradTrainer(&model, regularization_strength, learning_rate, eps);
+    }
+    else {
+      trainer = new AdagradTrainer(&model, regularization_strength, learning_rate, eps);
+    }
   }
   else if (vm.count("adadelta")) {
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-6;
@@ -173,14 +304,24 @@ Trainer* CreateTrainer(Model& model, const po::variables_map& vm) {
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.1;
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-20;
     double rho = (vm.count("rho")) ? vm["rho"].as<double>() : 0.95;
-    trainer = new RmsPropTrainer(&model, regularization_strength, learning_rate, eps, rho);
+    if (lazy) {
+      trainer = new LazyRmsPropTrainer(&model, regularization_strength, learning_rate, eps, rho);
+    }
+    else {
+      trainer = new RmsPropTrainer(&model, regularization_strength, learning_rate, eps, rho);
+    }
   }
   else if (vm.count("adam")) {
     double alpha = (vm.count("alpha")) ? vm["alpha"].as<double>() : 0.001;
     double beta1 = (vm.count("beta1")) ? vm["beta1"].as<double>() : 0.9;
     double beta2 = (vm.count("beta2")) ? vm["beta2"].as<double>() : 0.999;
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-8;
-    trainer = new AdamTrainer(&model, regularization_strength, alpha, beta1, beta2, eps);
+    if (lazy) {
+      trainer = new LazyAdamTrainer(&model, regularization_strength, alpha, beta1, beta2, eps);
+    }
+    else {
+      trainer = new AdamTrainer(&model, regularization_strength, alpha, beta1, beta2, eps);
+    }
   }
   else { /* sgd */
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.1;
@@ -0,0 +1,56 @@
+#pragma once
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+// Attention weights for one sentence pair, one row per target word and one
+// column per source word. The storage is allocated once up front in Reset, from
+// the known sentence lengths, so appending rows during decoding never reallocates.
+class AlignmentMatrix {
+public:
+  AlignmentMatrix() : source_size(0), target_size(0), max_target_size(0) {}
+
+  void Reset(unsigned source_size, unsigned max_target_size) {
+    this->source_size = source_size;
+    this->max_target_size = max_target_size;
+    target_size = 0;
+    if (weights.size() < (size_t)source_size * max_target_size) {
+      weights.resize((size_t)source_size * max_target_size);
+    }
+  }
+
+  // At most max_target_size rows, as given to Reset, can be appended
+  void AppendRow(const float* row) {
+    assert (target_size < max_target_size);
+    copy(row, row + source_size, weights.begin() + (size_t)target_size * source_size);
+    target_size++;
+  }
+
+  unsigned rows() const { return target_size; }
+  unsigned cols() const { return source_size; }
+
+  const float* row(unsigned t) const {
+    assert (t < target_size);
+    return &weights[t * source_size];
+  }
+
+  // Writes one line per target word, each with one weight per source word
+  void Write(ostream& out) const {
+    for (unsigned t = 0; t < target_size; ++t) {
+      const float* r = row(t);
+      for (unsigned s = 0; s < source_size; ++s) {
+        out << (s == 0 ? "" : " ") << r[s];
+      }
+      out << "\n";
+    }
+  }
+
+private:
+  unsigned source_size;
+  unsigned target_size;
+  unsigned max_target_size;
+  vector<float> weights; // Row-major
+};
@@ -11,7 +11,13 @@ using namespace std;
 using namespace cnn;
 using namespace cnn::expr;
 
+AttentionalModel::AttentionalModel() {}
+
 AttentionalModel::AttentionalModel(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size) {
+  InitializeParameters(model, src_vocab_size, tgt_vocab_size);
+}
+
+void AttentionalModel::InitializeParameters(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size) {
   forward_builder = LSTMBuilder(lstm_layer_count, embedding_dim, half_annotation_dim, &model);
   reverse_builder = LSTMBuilder(lstm_layer_count, embedding_dim, half_annotation_dim, &model);
   output_builder = LSTMBuilder(lstm_layer_count, embedding_dim + 2 * half_annotation_dim, output_state_dim, &model);
@@ -67,33 +73,48 @@ vector<Expression> AttentionalModel::BuildAnnotationVectors(const vector<Express
   return annotations;
 }
 
+SourceAttention AttentionalModel::PrecomputeAttention(const vector<Expression>& annotations, const MLP& aligner, ComputationGraph& cg) const {
+  // p_aIH's columns are laid out as [output state; annotation]
+  vector<unsigned> state_columns(output_state_dim);
+  vector<unsigned> annotation_columns(2 * half_annotation_dim);
+  for (unsigned i = 0; i < output_state_dim; ++i) {
+    state_columns[i] = i;
+  }
+  for (unsigned i = 0; i < 2 * half_annotation_dim; ++i) {
+    annotation_columns[i] = output_state_dim + i;
+  }
+
+  SourceAttention attention;
+  attention.annotation_matrix = concatenate_cols(annotations);
+  attention.i_aIH_state = select_cols(aligner.i_IH[0], state_columns);
+  Expression i_aIH_annotation = select_cols(aligner.i_IH[0], annotation_columns);
+  attention.keys = colwise_add(i_aIH_annotation * attention.annotation_matrix, aligner.i_Hb);
+  attention.i_aHO = aligner.i_HO;
+  return attention;
+}
+
 OutputState AttentionalModel::GetNextOutputState(const Expression& prev_context, const Expression& prev_target_word_embedding,
-    const vector<Expression>& annotations, const MLP& aligner, ComputationGraph& cg, vector<float>* out_alignment) {
-  return GetNextOutputState(output_builder.state(), prev_context, prev_target_word_embedding, annotations, aligner, cg, out_alignment);
+    const SourceAttention& attention, ComputationGraph& cg, AlignmentMatrix* out_alignment) {
+  return GetNextOutputState(output_builder.state(), prev_context, prev_target_word_embedding, attention, cg, out_alignment);
 }
 
 OutputState AttentionalModel::GetNextOutputState(const RNNPointer& rnn_pointer, const Expression& prev_context, const Expression& prev_target_word_embedding,
-    const vector<Expression>& annotations, const MLP& aligner, ComputationGraph& cg, vector<float>* out_alignment) {
-  const unsigned source_size = annotations.size();
-
+    const SourceAttention& attention, ComputationGraph& cg, AlignmentMatrix* out_alignment) {
   Expression state_rnn_input = concatenate({prev_context, prev_target_word_embedding});
   Expression new_state = output_builder.add_input(rnn_pointer, state_rnn_input); // new_state = RNN(prev_state, prev_context, prev_target_word)
-  vector<Expression> unnormalized_alignments(source_size); // e_ij
 
-  for (unsigned s = 0; s < source_size; ++s) {
-    double prior = 1.0;
-    Expression a_input = concatenate({new_state, annotations[s]});
-    Expression a_output = aligner.Feed({a_input});
-    unnormalized_alignments[s] = a_output * prior;
-  }
-
-  Expression unnormalized_alignment_vector = concatenate(unnormalized_alignments);
+  // e_ij for all source positions at once. The aligner's output bias is the same
+  // for every position, so it cancels out in the softmax and is left out.
+  Expression query = attention.i_aIH_state * new_state;
+  Expression alignment_hidden = tanh(colwise_add(attention.keys, query));
+  Expression unnormalized_alignment_vector = transpose(attention.i_aHO * alignment_hidden);
   Expression normalized_alignment_vector = softmax(unnormalized_alignment_vector); // \alpha_ij
   if (out_alignment != NULL) {
-    *out_alignment = as_vector(cg.forward());
+    // Only evaluates the nodes added since the last call, rather than the whole graph
+    const Tensor& alignment = cg.incremental_forward();
+    out_alignment->AppendRow(alignment.v);
   }
-  Expression annotation_matrix = concatenate_cols(annotations); // \alpha
-  Expression context = annotation_matrix * normalized_alignment_vector; // c = \alpha * h
+  Expression context = attention.annotation_matrix * normalized_alignment_vector; // c = \alpha * h
 
   OutputState os;
   os.state = new_state;
@@ -133,10 +154,10 @@ Expression AttentionalModel::GetZerothContext(Expression zeroth_reverse_annotati
   return zeroth_context;
 }
 
-OutputState AttentionalModel::GetInitialOutputState(Expression zeroth_context, const vector<Expression>& annotations, const MLP& aligner, const WordId kSOS, ComputationGraph& cg, vector<float>* alignment) {
+OutputState AttentionalModel::GetInitialOutputState(Expression zeroth_context, const SourceAttention& attention, const WordId kSOS, ComputationGraph& cg, AlignmentMatrix* alignment) {
   output_builder.start_new_sequence();
   Expression previous_target_word_embedding = lookup(cg, p_Et, kSOS);
-  OutputState os = GetNextOutputState(zeroth_context, previous_target_word_embedding, annotations, aligner, cg, alignment);
+  OutputState os = GetNextOutputState(zeroth_context, previous_target_word_embedding, attention, cg, alignment);
   return os;
 }
 
@@ -153,6 +174,7 @@ Expression AttentionalModel::BuildGraph(const vector<WordId>& source, const vect
 
   MLP aligner = GetAligner(cg);
   MLP final = GetFinalMLP(cg);
+  SourceAttention attention = PrecomputeAttention(annotations, aligner, cg);
 
   vector<Expression> output_states(target.size());
   vector<Expression> contexts(target.size());
@@ -160,7 +182,7 @@ Expression AttentionalModel::BuildGraph(const vector<WordId>& source, const vect
 
   for (unsigned t = 1; t < target.size(); ++t) {
     Expression prev_target_word_embedding = lookup(cg, p_Et, target[t - 1]);
-    OutputState os = GetNextOutputState(contexts[t - 1], prev_target_word_embedding, annotations, aligner, cg);
+    OutputState os = GetNextOutputState(contexts[t - 1], prev_target_word_embedding, attention, cg);
     output_states[t] = os.state;
     contexts[t] = os.context;
   }
@@ -180,3 +202,51 @@ Expression AttentionalModel::BuildGraph(const vector<WordId>& source, const vect
   Expression total_error = sum(errors);
   return total_error;
 }
+
+void AttentionalModel::Align(const vector<WordId>& source, const vector<WordId>& target, AlignmentMatrix& alignment, ComputationGraph& cg) {
+  assert (target.size() >= 2);
+  output_builder.new_graph(cg);
+  output_builder.start_new_sequence();
+
+  vector<Expression> forward_annotations = BuildForwardAnnotations(source, cg);
+  vector<Expression> reverse_annotations = BuildReverseAnnotations(source, cg);
+  vector<Expression> annotations = BuildAnnotationVectors(forward_annotations, reverse_annotations, cg);
+  Expression context = GetZerothContext(reverse_annotations[0], cg);
+  MLP aligner = GetAligner(cg);
+  SourceAttention attention = PrecomputeAttention(annotations, aligner, cg);
+
+  alignment.Reset(source.size(), target.size() - 1);
+  for (unsigned t = 1; t < target.size(); ++t) {
+    Expression prev_target_word_embedding = lookup(cg, p_Et, target[t - 1]);
+    OutputState os = GetNextOutputState(context, prev_target_word_embedding, attention, cg, &alignment);
+    context = os.context;
+  }
+}
+
+DecoderState AttentionalModel::StartDecoding(const vector<WordId>& source, WordId kSOS, ComputationGraph& cg) {
+  output_builder.new_graph(cg);
+  vector<Expression> forward_annotations = BuildForwardAnnotations(source, cg);
+  vector<Expression> reverse_annotations = BuildReverseAnnotations(source, cg);
+  vector<Expression> annotations = BuildAnnotationVectors(forward_annotations, reverse_annotations, cg);
+  Expression zeroth_context = GetZerothContext(reverse_annotations[0], cg);
+  shared_ptr<AttentionalSourceState> source_state = make_shared<AttentionalSourceState>();
+  source_state->attention = PrecomputeAttention(annotations, GetAligner(cg), cg);
+  source_state->final = GetFinalMLP(cg);
+
+  OutputState os = GetInitialOutputState(zeroth_context, source_state->attention, kSOS, cg);
+  return {os.state, os.context, os.rnn_pointer, kSOS, source_state};
+}
+
+DecoderState AttentionalModel::AddOutputWord(const DecoderState& state, WordId word, ComputationGraph& cg) {
+  Expression word_embedding = lookup(cg, p_Et, word);
+  const AttentionalSourceState& source_state = static_cast<const AttentionalSourceState&>(*state.source);
+  OutputState os = GetNextOutputState(state.rnn_pointer, state.context, word_embedding, source_state.attention, cg);
+  return {os.state, os.context, os.rnn_pointer, word, state.source};
+}
+
+Expression AttentionalModel::ComputeLogOutputDistribution(const DecoderState& state, unsigned class_beam, vector<WordId>* word_ids, ComputationGraph& cg) {
+  word_ids->clear();
+  const AttentionalSourceState& source_state = static_cast<const AttentionalSourceState&>(*state.source);
+  Expression output_dist = ComputeOutputDistribution(state.prev_word, state.output_state, state.context, source_state.final, cg);
+  return log_softmax(output_dist);
+}
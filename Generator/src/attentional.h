@@ -6,6 +6,8 @@
 #include "cnn/lstm.h"
 #include "bitext.h"
 #include "kbestlist.h"
+#include "alignmentmatrix.h"
+#include "translationmodel.h"
 #include "mlp.h"
 
 using namespace std;
@@ -22,24 +24,48 @@ struct OutputState {
   RNNPointer rnn_pointer;
 };
 
-class AttentionalModel {
-  friend class AttentionalDecoder;
+// The parts of the attention computation that depend only on the source sentence.
+// These are computed once per sentence so that each output step only needs to
+// project the new output state and add it to every key.
+struct SourceAttention {
+  Expression annotation_matrix; // One annotation per column
+  Expression keys; // Annotation half of the aligner's hidden layer (plus bias), one column per source word
+  Expression i_aIH_state; // Output state half of the aligner's input->hidden weights
+  Expression i_aHO;
+};
+
+// Built by StartDecoding and shared by every hypothesis
+struct AttentionalSourceState : public SourceState {
+  SourceAttention attention;
+  MLP final;
+};
+
+class AttentionalModel : public TranslationModel {
 public:
+  AttentionalModel();
   AttentionalModel(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size);
-  Expression BuildGraph(const vector<WordId>& source, const vector<WordId>& target, ComputationGraph& hg); 
+  void InitializeParameters(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size);
+  Expression BuildGraph(const vector<WordId>& source, const vector<WordId>& target, ComputationGraph& hg) override;
+  // Fills alignment with the attention weights used at each step of force-decoding target
+  void Align(const vector<WordId>& source, const vector<WordId>& target, AlignmentMatrix& alignment, ComputationGraph& hg);
+
+  DecoderState StartDecoding(const vector<WordId>& source, WordId kSOS, ComputationGraph& cg) override;
+  DecoderState AddOutputWord(const DecoderState& state, WordId word, ComputationGraph& cg) override;
+  Expression ComputeLogOutputDistribution(const DecoderState& state, unsigned class_beam, vector<WordId>* word_ids, ComputationGraph& cg) override;
 
 protected:
   vector<Expression> BuildForwardAnnotations(const vector<WordId>& sentence, ComputationGraph& hg);
   vector<Expression> BuildReverseAnnotations(const vector<WordId>& sentence, ComputationGraph& hg);
   vector<Expression> BuildAnnotationVectors(const vector<Expression>& forward_contexts, const vector<Expression>& reverse_contexts, ComputationGraph& hg);
-  OutputState GetNextOutputState(const Expression& context, const Expression& prev_target_word_embedding, const vector<Expression>& annotations, const MLP& aligner, ComputationGraph& hg, vector<float>* out_alignment = NULL);
-  OutputState GetNextOutputState(const RNNPointer& rnn_pointer, const Expression& context, const Expression& prev_target_word_embedding, const vector<Expression>& annotations, const MLP& aligner, ComputationGraph& hg, vector<float>* out_alignment = NULL);
+  SourceAttention PrecomputeAttention(const vector<Expression>& annotations, const MLP& aligner, ComputationGraph& cg) const;
+  OutputState GetNextOutputState(const Expression& context, const Expression& prev_target_word_embedding, const SourceAttention& attention, ComputationGraph& hg, AlignmentMatrix* out_alignment = NULL);
+  OutputState GetNextOutputState(const RNNPointer& rnn_pointer, const Expression& context, const Expression& prev_target_word_embedding, const SourceAttention& attention, ComputationGraph& hg, AlignmentMatrix* out_alignment = NULL);
   Expression ComputeOutputDistribution(const WordId prev_word, const Expression state, const Expression context, const MLP& final, ComputationGraph& hg);
   vector<unsigned&> GetParams();
   MLP GetAligner(ComputationGraph& cg) const;
   MLP GetFinalMLP(ComputationGraph& cg) const; 
   Expression GetZerothContext(Expression zeroth_reverse_annotation, ComputationGraph& cg) const;
-  OutputState GetInitialOutputState(Expression zeroth_context, const vector<Expression>& annotations, const MLP& aligner, const WordId kSOS, ComputationGraph& cg, vector<float>* alignment = NULL);
+  OutputState GetInitialOutputState(Expression zeroth_context, const SourceAttention& attention, const WordId kSOS, ComputationGraph& cg, AlignmentMatrix* alignment = NULL);
 
 private:
   LSTMBuilder forward_builder, reverse_builder, output_builder;
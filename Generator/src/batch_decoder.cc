@@ -0,0 +1,164 @@
+#include <cassert>
+#include <limits>
+#include "batch_decoder.h"
+
+BatchDecoder::BatchDecoder(const vector<InferenceModel*>& models) : models(models) {
+  assert (models.size() > 0);
+}
+
+void BatchDecoder::SetParams(unsigned max_length, WordId kSOS, WordId kEOS) {
+  this->max_length = max_length;
+  this->kSOS = kSOS;
+  this->kEOS = kEOS;
+}
+
+vector<KBestList<vector<WordId>>> BatchDecoder::TranslateKBest(const vector<vector<WordId>>& sources, unsigned K, unsigned beam_size) {
+  const unsigned num_models = models.size();
+  const unsigned num_sentences = sources.size();
+  vector<KBestList<vector<WordId>>> completed_hyps(num_sentences, KBestList<vector<WordId>>(K));
+
+  // Column j of every model's state belongs to beam[j]
+  vector<InferenceBatchState> states(num_models);
+  for (unsigned i = 0; i < num_models; ++i) {
+    states[i] = models[i]->EncodeBatch(sources);
+  }
+  vector<Hypothesis> beam(num_sentences);
+  for (unsigned s = 0; s < num_sentences; ++s) {
+    beam[s] = {s, 0.0, {kSOS}};
+  }
+
+  vector<Eigen::MatrixXf> dists(num_models);
+  for (unsigned t = 1; t <= max_length && beam.size() > 0; ++t) {
+    for (unsigned i = 0; i < num_models; ++i) {
+      models[i]->ComputeLogDistributions(states[i], dists[i]);
+    }
+    Eigen::MatrixXf& dist = dists[0];
+    for (unsigned i = 1; i < num_models; ++i) {
+      dist += dists[i];
+    }
+    if (num_models > 1) {
+      dist /= num_models;
+      LogSoftmaxColumnsInPlace(dist); // Renormalize
+    }
+
+    // Each sentence keeps its own beam of (parent column, word) extensions
+    vector<KBestList<pair<unsigned, WordId>>> new_hyps(num_sentences, KBestList<pair<unsigned, WordId>>(beam_size));
+    for (unsigned j = 0; j < beam.size(); ++j) {
+      const Hypothesis& hyp = beam[j];
+
+      // Take the K best-looking words, skipping any the class beam pruned
+      KBestList<WordId> best_words(beam_size);
+      for (unsigned w = 0; w < dist.rows(); ++w) {
+        if (dist(w, j) != -numeric_limits<float>::infinity()) {
+          best_words.add(dist(w, j), w);
+        }
+      }
+
+      for (pair<double, WordId> p : best_words.hypothesis_list()) {
+        double new_score = hyp.score + p.first;
+        WordId word = p.second;
+        if (t == max_length || word == kEOS) {
+          vector<WordId> words = hyp.words;
+          words.push_back(word);
+          completed_hyps[hyp.sentence].add(new_score, words);
+        }
+        else {
+          new_hyps[hyp.sentence].add(new_score, make_pair(j, word));
+        }
+      }
+    }
+
+    vector<Hypothesis> new_beam;
+    vector<unsigned> parents;
+    vector<WordId> words;
+    for (unsigned s = 0; s < num_sentences; ++s) {
+      for (auto& scored_hyp : new_hyps[s].hypothesis_list()) {
+        unsigned parent = scored_hyp.second.first;
+        WordId word = scored_hyp.second.second;
+        Hypothesis new_hyp = {s, scored_hyp.first, beam[parent].words};
+        new_hyp.words.push_back(word);
+        new_beam.push_back(new_hyp);
+        parents.push_back(parent);
+        words.push_back(word);
+      }
+    }
+    beam = new_beam;
+
+    if (beam.size() > 0) {
+      for (unsigned i = 0; i < num_models; ++i) {
+        states[i] = models[i]->AddOutputWords(states[i], parents, words);
+      }
+    }
+  }
+  return completed_hyps;
+}
+
+BatchSampler::BatchSampler(const vector<InferenceModel*>& models) : models(models) {
+  assert (models.size() > 0);
+}
+
+void BatchSampler::SetParams(unsigned max_length, WordId kSOS, WordId kEOS) {
+  this->max_length = max_length;
+  this->kSOS = kSOS;
+  this->kEOS = kEOS;
+}
+
+void BatchSampler::SetOptions(const SamplingOptions& options, unsigned seed) {
+  sampler.SetOptions(options, seed);
+}
+
+vector<pair<double, vector<WordId>>> BatchSampler::SampleTranslations(const vector<WordId>& source, unsigned num_samples) {
+  const unsigned num_models = models.size();
+  vector<pair<double, vector<WordId>>> samples(num_samples, make_pair(0.0, vector<WordId>(1, kSOS)));
+
+  // The encoded source is a single column, which every sample draws its first
+  // word from. After that, column j belongs to sample live[j].
+  vector<InferenceBatchState> states(num_models);
+  for (unsigned i = 0; i < num_models; ++i) {
+    states[i] = models[i]->EncodeBatch({source});
+  }
+  vector<unsigned> live(num_samples);
+  for (unsigned s = 0; s < num_samples; ++s) {
+    live[s] = s;
+  }
+
+  vector<Eigen::MatrixXf> dists(num_models);
+  for (unsigned t = 1; t <= max_length && live.size() > 0; ++t) {
+    for (unsigned i = 0; i < num_models; ++i) {
+      models[i]->ComputeLogDistributions(states[i], dists[i]);
+    }
+    Eigen::MatrixXf& dist = dists[0];
+    for (unsigned i = 1; i < num_models; ++i) {
+      dist += dists[i];
+    }
+    if (num_models > 1) {
+      dist /= num_models;
+      LogSoftmaxColumnsInPlace(dist); // Renormalize
+    }
+
+    vector<unsigned> still_live;
+    vector<unsigned> parents;
+    vector<WordId> words;
+    for (unsigned j = 0; j < live.size(); ++j) {
+      const unsigned s = live[j];
+      const unsigned column = t == 1 ? 0 : j;
+      const float* log_probs = dist.col(column).data();
+      WordId word = sampler.Sample(log_probs, dist.rows());
+      samples[s].first += log_probs[word];
+      samples[s].second.push_back(word);
+      if (t < max_length && word != kEOS) {
+        still_live.push_back(s);
+        parents.push_back(column);
+        words.push_back(word);
+      }
+    }
+    live = still_live;
+
+    if (live.size() > 0) {
+      for (unsigned i = 0; i < num_models; ++i) {
+        states[i] = models[i]->AddOutputWords(states[i], parents, words);
+      }
+    }
+  }
+  return samples;
+}
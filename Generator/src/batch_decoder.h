@@ -0,0 +1,53 @@
+#pragma once
+#include <vector>
+#include "inference.h"
+#include "kbestlist.h"
+#include "sampling.h"
+
+using namespace std;
+
+// Beam search over several source sentences at once. The sentences are encoded
+// as one length-sorted batch, and at every time step the live hypotheses of all
+// of them are scored and advanced together, one column each, so that the output
+// layer becomes a single matrix-matrix product.
+class BatchDecoder {
+public:
+  explicit BatchDecoder(const vector<InferenceModel*>& models);
+  void SetParams(unsigned max_length, WordId kSOS, WordId kEOS);
+
+  // Returns one k-best list per source sentence, in the same order
+  vector<KBestList<vector<WordId>>> TranslateKBest(const vector<vector<WordId>>& sources, unsigned K, unsigned beam_size);
+
+private:
+  struct Hypothesis {
+    unsigned sentence;
+    double score;
+    vector<WordId> words;
+  };
+
+  vector<InferenceModel*> models;
+  unsigned max_length;
+  WordId kSOS;
+  WordId kEOS;
+};
+
+// Ancestral sampling of many translations of one source sentence at once. The
+// source is encoded once, and every unfinished sample is a column of the same
+// batch state, so each step scores all of them with one matrix-matrix product.
+class BatchSampler {
+public:
+  explicit BatchSampler(const vector<InferenceModel*>& models);
+  void SetParams(unsigned max_length, WordId kSOS, WordId kEOS);
+  void SetOptions(const SamplingOptions& options, unsigned seed = 0);
+
+  // Returns num_samples translations in the order they were drawn, each with
+  // its log probability under the (untempered) models
+  vector<pair<double, vector<WordId>>> SampleTranslations(const vector<WordId>& source, unsigned num_samples);
+
+private:
+  vector<InferenceModel*> models;
+  unsigned max_length;
+  WordId kSOS;
+  WordId kEOS;
+  WordSampler sampler;
+};
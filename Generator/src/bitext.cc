@@ -1,24 +1,237 @@
 #include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include <cmath>
+#include <boost/functional/hash.hpp>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
 #include "bitext.h"
 #include "utils.h"
+#include "tokenizer.h"
+#include "vocabmap.h"
 
 using namespace std;
 
-void ReadSentencePair(const std::string& line, std::vector<int>* s, Dict* sd, std::vector<int>* t, Dict* td, float* weight) {
-  vector<string> parts = tokenize(line, "|||");
+namespace {
+
+const char kCompiledCorpusMagic[8] = {'G', 'E', 'N', 'B', 'T', 'X', 'T', '1'};
+
+// Every section is 8-byte aligned and addressed by its byte offset from the
+// start of the file. Offset arrays have num_sentences + 1 entries, so sentence i
+// spans tokens [offsets[i], offsets[i + 1]).
+struct CompiledCorpusHeader {
+  char magic[8];
+  uint32_t add_bos_eos;
+  uint32_t reserved;
+  uint64_t num_sentences;
+  uint64_t num_source_tokens;
+  uint64_t num_target_tokens;
+  uint64_t weights_offset;
+  uint64_t source_offsets_offset;
+  uint64_t source_tokens_offset;
+  uint64_t target_offsets_offset;
+  uint64_t target_tokens_offset;
+  uint64_t vocab_offset; // Both Dicts, as a boost text archive
+  uint64_t vocab_length;
+};
+
+void AttachSentences(Bitext& bitext, uint64_t num_sentences, const float* weights,
+    const uint64_t* source_offsets, const WordId* source_tokens, const uint64_t* target_offsets, const WordId* target_tokens) {
+  bitext.sentences.resize(num_sentences);
+  for (uint64_t i = 0; i < num_sentences; ++i) {
+    Bitext::SentencePair& pair = bitext.sentences[i];
+    pair.source = {source_tokens + source_offsets[i], (unsigned)(source_offsets[i + 1] - source_offsets[i])};
+    pair.target = {target_tokens + target_offsets[i], (unsigned)(target_offsets[i + 1] - target_offsets[i])};
+    pair.weight = weights[i];
+  }
+}
+
+void WritePadding(ofstream& f) {
+  const char zeros[8] = {0};
+  unsigned remainder = f.tellp() % 8;
+  if (remainder != 0) {
+    f.write(zeros, 8 - remainder);
+  }
+}
+
+template <typename T>
+uint64_t WriteSection(ofstream& f, const T* data, uint64_t count) {
+  WritePadding(f);
+  uint64_t offset = f.tellp();
+  f.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+  return offset;
+}
+
+// Whether count elements of type T fit in the file at offset, aligned for T
+template <typename T>
+bool SectionFits(uint64_t offset, uint64_t count, uint64_t file_size) {
+  return offset % sizeof(T) == 0 && offset <= file_size && count <= (file_size - offset) / sizeof(T);
+}
+
+// Whether offsets runs from 0 up to num_tokens without ever going back
+bool ValidOffsets(const uint64_t* offsets, uint64_t num_sentences, uint64_t num_tokens) {
+  if (offsets[0] != 0 || offsets[num_sentences] != num_tokens) {
+    return false;
+  }
+  for (uint64_t i = 0; i < num_sentences; ++i) {
+    if (offsets[i + 1] < offsets[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ValidTokens(const WordId* tokens, uint64_t num_tokens, unsigned vocab_size) {
+  for (uint64_t i = 0; i < num_tokens; ++i) {
+    if (tokens[i] < 0 || (unsigned)tokens[i] >= vocab_size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks that every section the header points to lies within the file, before any of them is read
+bool ValidHeader(const CompiledCorpusHeader& header, uint64_t file_size) {
+  return memcmp(header.magic, kCompiledCorpusMagic, sizeof(header.magic)) == 0 &&
+      header.add_bos_eos <= 1 &&
+      header.num_sentences < file_size &&
+      SectionFits<float>(header.weights_offset, header.num_sentences, file_size) &&
+      SectionFits<uint64_t>(header.source_offsets_offset, header.num_sentences + 1, file_size) &&
+      SectionFits<uint64_t>(header.target_offsets_offset, header.num_sentences + 1, file_size) &&
+      SectionFits<WordId>(header.source_tokens_offset, header.num_source_tokens, file_size) &&
+      SectionFits<WordId>(header.target_tokens_offset, header.num_target_tokens, file_size) &&
+      SectionFits<char>(header.vocab_offset, header.vocab_length, file_size);
+}
+
+bool ReadCompiledCorpus(string filename, Bitext& bitext, bool add_bos_eos) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CompiledCorpusHeader)) {
+    close(fd);
+    return false;
+  }
+
+  // A shared read-only mapping, so processes forked by cnn::mp all use the same physical pages
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  bitext.mapped_data = data;
+  bitext.mapped_size = st.st_size;
+
+  const char* base = static_cast<const char*>(data);
+  const CompiledCorpusHeader* header = reinterpret_cast<const CompiledCorpusHeader*>(base);
+  if (!ValidHeader(*header, st.st_size)) {
+    cerr << "ERROR: " << filename << " is truncated or corrupt" << endl;
+    return false;
+  }
+  if ((bool)header->add_bos_eos != add_bos_eos) {
+    cerr << "ERROR: " << filename << " was compiled " << (header->add_bos_eos ? "with" : "without") << " sentence boundary markers" << endl;
+    return false;
+  }
+
+  Dict source_vocab;
+  Dict target_vocab;
+  try {
+    istringstream vocab_stream(string(base + header->vocab_offset, header->vocab_length));
+    boost::archive::text_iarchive ia(vocab_stream);
+    ia & source_vocab;
+    ia & target_vocab;
+  }
+  catch (const boost::archive::archive_exception&) {
+    cerr << "ERROR: " << filename << " is truncated or corrupt" << endl;
+    return false;
+  }
+
+  const float* weights = reinterpret_cast<const float*>(base + header->weights_offset);
+  const uint64_t* source_offsets = reinterpret_cast<const uint64_t*>(base + header->source_offsets_offset);
+  const uint64_t* target_offsets = reinterpret_cast<const uint64_t*>(base + header->target_offsets_offset);
+  const WordId* source_tokens = reinterpret_cast<const WordId*>(base + header->source_tokens_offset);
+  const WordId* target_tokens = reinterpret_cast<const WordId*>(base + header->target_tokens_offset);
+  if (!ValidOffsets(source_offsets, header->num_sentences, header->num_source_tokens) ||
+      !ValidOffsets(target_offsets, header->num_sentences, header->num_target_tokens) ||
+      !ValidTokens(source_tokens, header->num_source_tokens, source_vocab.size()) ||
+      !ValidTokens(target_tokens, header->num_target_tokens, target_vocab.size())) {
+    cerr << "ERROR: " << filename << " is truncated or corrupt" << endl;
+    return false;
+  }
+
+  // The common case: a fresh vocabulary, so the token arrays are used in place
+  if (bitext.source_vocab.size() == 0 && bitext.target_vocab.size() == 0) {
+    bitext.source_vocab = source_vocab;
+    bitext.target_vocab = target_vocab;
+    AttachSentences(bitext, header->num_sentences, weights, source_offsets, source_tokens, target_offsets, target_tokens);
+    return true;
+  }
+
+  // Otherwise the ids have to be translated into the existing vocabulary, e.g. for
+  // dev sets or when continuing to train a model. That still skips all the parsing.
+  vector<WordId> source_map;
+  vector<WordId> target_map;
+  bool source_identity = BuildVocabMap(source_vocab, bitext.source_vocab, source_map);
+  bool target_identity = BuildVocabMap(target_vocab, bitext.target_vocab, target_map);
+  if (!source_identity) {
+    bitext.source_tokens.resize(header->num_source_tokens);
+    for (uint64_t i = 0; i < header->num_source_tokens; ++i) {
+      bitext.source_tokens[i] = source_map[source_tokens[i]];
+    }
+    source_tokens = bitext.source_tokens.data();
+  }
+  if (!target_identity) {
+    bitext.target_tokens.resize(header->num_target_tokens);
+    for (uint64_t i = 0; i < header->num_target_tokens; ++i) {
+      bitext.target_tokens[i] = target_map[target_tokens[i]];
+    }
+    target_tokens = bitext.target_tokens.data();
+  }
+  AttachSentences(bitext, header->num_sentences, weights, source_offsets, source_tokens, target_offsets, target_tokens);
+  return true;
+}
+
+} // namespace
+
+void ReadSentencePair(StringPiece line, TokenBuffers& buffers, std::vector<int>* s, Dict* sd, std::vector<int>* t, Dict* td, float* weight) {
+  vector<StringPiece>& parts = buffers.fields;
+  Split(line, "|||", parts);
   for (unsigned i = 0; i < parts.size(); ++i) {
-    parts[i] = strip(parts[i]);
+    parts[i] = Strip(parts[i]);
   }
   *weight = 1.0;
+  unsigned first = 0;
   if (parts.size() == 3) {
-    *weight = atof(parts[0].c_str());
-    parts.erase(parts.begin());
+    *weight = ParseDouble(parts[0], buffers);
+    first = 1;
   }
-  for (string word : tokenize(parts[0], " ")) {
-    s->push_back(sd->Convert(word));
+  Split(parts[first], " ", buffers.words);
+  for (StringPiece word : buffers.words) {
+    s->push_back(sd->Convert(buffers.Word(word)));
   }
-  for (string word : tokenize(parts[1], " ")) {
-    t->push_back(td->Convert(word));
+  Split(parts[first + 1], " ", buffers.words);
+  for (StringPiece word : buffers.words) {
+    t->push_back(td->Convert(buffers.Word(word)));
+  }
+}
+
+Bitext::Bitext() : mapped_data(NULL), mapped_size(0) {}
+
+Bitext::~Bitext() {
+  if (mapped_data != NULL) {
+    munmap(mapped_data, mapped_size);
   }
 }
 
@@ -26,37 +239,234 @@ unsigned Bitext::size() const {
   return sentences.size();
 }
 
-bool ReadCorpus(string filename, Bitext& bitext, bool add_bos_eos) {
-  ifstream f(filename);
-  if (!f.is_open()) {
-    return false;
-  }
+bool IsCompiledCorpus(string filename) {
+  ifstream f(filename, ios::binary);
+  char magic[sizeof(kCompiledCorpusMagic)];
+  return f.read(magic, sizeof(magic)) && memcmp(magic, kCompiledCorpusMagic, sizeof(magic)) == 0;
+}
 
-  bitext.source_vocab.Convert("UNK");
-  bitext.target_vocab.Convert("UNK");
+namespace {
+
+// The result of parsing one byte range of a text corpus, with word ids
+// from chunk-local vocabularies
+struct CorpusChunk {
+  Dict source_vocab;
+  Dict target_vocab;
+  vector<WordId> source_tokens;
+  vector<WordId> target_tokens;
+  vector<uint64_t> source_offsets;
+  vector<uint64_t> target_offsets;
+  vector<float> weights;
+};
 
+void ReadCorpusChunk(StringPiece text, bool add_bos_eos, CorpusChunk& chunk) {
   WordId sBOS, sEOS, tBOS, tEOS;
   if (add_bos_eos) {
-    sBOS = bitext.source_vocab.Convert("<s>");
-    sEOS = bitext.source_vocab.Convert("</s>");
-    tBOS = bitext.target_vocab.Convert("<s>");
-    tEOS = bitext.target_vocab.Convert("</s>");
+    sBOS = chunk.source_vocab.Convert("<s>");
+    sEOS = chunk.source_vocab.Convert("</s>");
+    tBOS = chunk.target_vocab.Convert("<s>");
+    tEOS = chunk.target_vocab.Convert("</s>");
   }
 
-  for (string line; getline(f, line);) {
-    vector<WordId> source;
-    vector<WordId> target;
+  chunk.source_offsets.push_back(0);
+  chunk.target_offsets.push_back(0);
+  TokenBuffers buffers;
+  while (text.size() > 0) {
+    size_t newline = text.find('\n');
+    StringPiece line = text.substr(0, newline);
+    text = (newline == StringPiece::npos) ? StringPiece() : text.substr(newline + 1);
+
     float weight;
     if (add_bos_eos) {
-      source.push_back(sBOS);
-      target.push_back(tBOS);
+      chunk.source_tokens.push_back(sBOS);
+      chunk.target_tokens.push_back(tBOS);
     }
-    ReadSentencePair(line, &source, &bitext.source_vocab, &target, &bitext.target_vocab, &weight);
+    ReadSentencePair(line, buffers, &chunk.source_tokens, &chunk.source_vocab, &chunk.target_tokens, &chunk.target_vocab, &weight);
     if (add_bos_eos) {
-      source.push_back(sEOS);
-      target.push_back(tEOS);
+      chunk.source_tokens.push_back(sEOS);
+      chunk.target_tokens.push_back(tEOS);
     }
-    bitext.sentences.push_back(make_tuple(source, target, weight));
+    chunk.source_offsets.push_back(chunk.source_tokens.size());
+    chunk.target_offsets.push_back(chunk.target_tokens.size());
+    chunk.weights.push_back(weight);
+  }
+}
+
+// Appends a chunk's tokens, translated into the global vocabulary
+void MergeTokens(const vector<WordId>& chunk_tokens, const vector<uint64_t>& chunk_offsets, const Dict& chunk_vocab,
+    Dict& vocab, vector<WordId>& tokens, vector<uint64_t>& offsets) {
+  vector<WordId> id_map;
+  BuildVocabMap(chunk_vocab, vocab, id_map);
+  const uint64_t base = tokens.size();
+  for (WordId word : chunk_tokens) {
+    tokens.push_back(id_map[word]);
+  }
+  for (unsigned i = 1; i < chunk_offsets.size(); ++i) {
+    offsets.push_back(base + chunk_offsets[i]);
+  }
+}
+
+} // namespace
+
+bool ReadCorpus(string filename, Bitext& bitext, bool add_bos_eos, unsigned num_threads) {
+  if (IsCompiledCorpus(filename)) {
+    return ReadCompiledCorpus(filename, bitext, add_bos_eos);
+  }
+
+  ifstream f(filename, ios::binary);
+  if (!f.is_open()) {
+    return false;
+  }
+  string text((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+
+  bitext.source_vocab.Convert("UNK");
+  bitext.target_vocab.Convert("UNK");
+  if (add_bos_eos) {
+    bitext.source_vocab.Convert("<s>");
+    bitext.source_vocab.Convert("</s>");
+    bitext.target_vocab.Convert("<s>");
+    bitext.target_vocab.Convert("</s>");
+  }
+
+  // Split the text into roughly equal byte ranges that end at line boundaries
+  if (num_threads == 0) {
+    num_threads = max(thread::hardware_concurrency(), 1U);
+  }
+  vector<StringPiece> chunk_texts;
+  size_t begin = 0;
+  for (unsigned i = 1; i <= num_threads && begin < text.size(); ++i) {
+    size_t end = (i == num_threads) ? text.size() : max(begin, text.size() * i / num_threads);
+    end = text.find('\n', end);
+    end = (end == string::npos) ? text.size() : end + 1;
+    chunk_texts.push_back(StringPiece(text.data() + begin, end - begin));
+    begin = end;
+  }
+
+  vector<CorpusChunk> chunks(chunk_texts.size());
+  vector<thread> threads;
+  for (unsigned i = 0; i < chunks.size(); ++i) {
+    threads.push_back(thread(ReadCorpusChunk, chunk_texts[i], add_bos_eos, ref(chunks[i])));
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+
+  // Merging the chunks in order hands out ids in order of first occurrence,
+  // exactly as reading the file line by line would.
+  vector<uint64_t> source_offsets(1, 0);
+  vector<uint64_t> target_offsets(1, 0);
+  vector<float> weights;
+  for (CorpusChunk& chunk : chunks) {
+    MergeTokens(chunk.source_tokens, chunk.source_offsets, chunk.source_vocab, bitext.source_vocab, bitext.source_tokens, source_offsets);
+    MergeTokens(chunk.target_tokens, chunk.target_offsets, chunk.target_vocab, bitext.target_vocab, bitext.target_tokens, target_offsets);
+    weights.insert(weights.end(), chunk.weights.begin(), chunk.weights.end());
+    chunk = CorpusChunk();
   }
+  AttachSentences(bitext, weights.size(), weights.data(), source_offsets.data(), bitext.source_tokens.data(),
+      target_offsets.data(), bitext.target_tokens.data());
   return true;
 }
+
+namespace {
+
+struct SentencePairHash {
+  size_t operator()(const Bitext::SentencePair* pair) const {
+    size_t seed = boost::hash_range(pair->source.begin(), pair->source.end());
+    boost::hash_combine(seed, boost::hash_range(pair->target.begin(), pair->target.end()));
+    return seed;
+  }
+};
+
+struct SentencePairEqual {
+  bool operator()(const Bitext::SentencePair* a, const Bitext::SentencePair* b) const {
+    return a->source.size() == b->source.size() && a->target.size() == b->target.size() &&
+        equal(a->source.begin(), a->source.end(), b->source.begin()) &&
+        equal(a->target.begin(), a->target.end(), b->target.begin());
+  }
+};
+
+} // namespace
+
+unsigned DeduplicateBitext(Bitext& bitext, float temperature, float max_weight) {
+  assert (temperature > 0.0f);
+  // Maps each distinct pair to its position in the deduplicated list
+  unordered_map<const Bitext::SentencePair*, unsigned, SentencePairHash, SentencePairEqual> first_copy;
+  vector<Bitext::SentencePair> unique_pairs;
+  for (const Bitext::SentencePair& pair : bitext.sentences) {
+    auto it = first_copy.find(&pair);
+    if (it == first_copy.end()) {
+      first_copy[&pair] = unique_pairs.size();
+      unique_pairs.push_back(pair);
+    }
+    else {
+      unique_pairs[it->second].weight += pair.weight;
+    }
+  }
+
+  for (Bitext::SentencePair& pair : unique_pairs) {
+    if (temperature != 1.0f) {
+      pair.weight = pow(pair.weight, 1.0f / temperature);
+    }
+    if (max_weight > 0.0f) {
+      pair.weight = min(pair.weight, max_weight);
+    }
+  }
+
+  unsigned removed = bitext.sentences.size() - unique_pairs.size();
+  bitext.sentences.swap(unique_pairs);
+  return removed;
+}
+
+bool WriteCompiledCorpus(string filename, const Bitext& bitext, bool add_bos_eos) {
+  ofstream f(filename, ios::binary);
+  if (!f.is_open()) {
+    return false;
+  }
+
+  CompiledCorpusHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kCompiledCorpusMagic, sizeof(header.magic));
+  header.add_bos_eos = add_bos_eos;
+  header.num_sentences = bitext.size();
+  f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  vector<float> weights(bitext.size());
+  vector<uint64_t> source_offsets(bitext.size() + 1, 0);
+  vector<uint64_t> target_offsets(bitext.size() + 1, 0);
+  for (unsigned i = 0; i < bitext.size(); ++i) {
+    const Bitext::SentencePair& pair = bitext.sentences[i];
+    weights[i] = pair.weight;
+    source_offsets[i + 1] = source_offsets[i] + pair.source.size();
+    target_offsets[i + 1] = target_offsets[i] + pair.target.size();
+  }
+  header.num_source_tokens = source_offsets.back();
+  header.num_target_tokens = target_offsets.back();
+
+  header.weights_offset = WriteSection(f, weights.data(), weights.size());
+  header.source_offsets_offset = WriteSection(f, source_offsets.data(), source_offsets.size());
+  WritePadding(f);
+  header.source_tokens_offset = f.tellp();
+  for (const Bitext::SentencePair& pair : bitext.sentences) {
+    f.write(reinterpret_cast<const char*>(pair.source.begin()), pair.source.size() * sizeof(WordId));
+  }
+  header.target_offsets_offset = WriteSection(f, target_offsets.data(), target_offsets.size());
+  WritePadding(f);
+  header.target_tokens_offset = f.tellp();
+  for (const Bitext::SentencePair& pair : bitext.sentences) {
+    f.write(reinterpret_cast<const char*>(pair.target.begin()), pair.target.size() * sizeof(WordId));
+  }
+
+  ostringstream vocab_stream;
+  {
+    boost::archive::text_oarchive oa(vocab_stream);
+    oa & bitext.source_vocab;
+    oa & bitext.target_vocab;
+  }
+  const string vocab = vocab_stream.str();
+  header.vocab_offset = WriteSection(f, vocab.data(), vocab.size());
+  header.vocab_length = vocab.size();
+
+  f.seekp(0);
+  f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  return f.good();
+}
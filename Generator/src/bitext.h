@@ -1,5 +1,6 @@
 #pragma once
 #include <vector>
+#include <string>
 #include "cnn/dict.h"
 
 using namespace std;
@@ -7,15 +8,61 @@ using namespace cnn;
 
 typedef int WordId;
 
+// A read-only view of a sentence's word ids. The words themselves live in a
+// Bitext's token arrays or in a memory-mapped compiled corpus.
+struct WordIdSpan {
+  const WordId* words;
+  unsigned length;
+
+  const WordId* begin() const { return words; }
+  const WordId* end() const { return words + length; }
+  unsigned size() const { return length; }
+  WordId operator[](unsigned i) const { return words[i]; }
+  WordId back() const { return words[length - 1]; }
+  vector<WordId> ToVector() const { return vector<WordId>(begin(), end()); }
+};
+
 struct Bitext {
-  typedef vector<WordId> SourceSentence;
-  typedef vector<WordId> TargetSentence;
-  typedef tuple<SourceSentence, TargetSentence, float> SentencePair;
+  typedef WordIdSpan SourceSentence;
+  typedef WordIdSpan TargetSentence;
+  struct SentencePair {
+    SourceSentence source;
+    TargetSentence target;
+    float weight;
+  };
   vector<SentencePair> sentences;
   Dict source_vocab;
   Dict target_vocab;
 
+  Bitext();
+  ~Bitext();
+  // Sentences point into this object's storage, so it must not be copied
+  Bitext(const Bitext&) = delete;
+  Bitext& operator=(const Bitext&) = delete;
+
   unsigned size() const;
+
+  // Storage for corpora read from text or remapped into another vocabulary.
+  // Compiled corpora that are used as-is point straight into mapped_data instead.
+  vector<WordId> source_tokens;
+  vector<WordId> target_tokens;
+  void* mapped_data;
+  size_t mapped_size;
 };
 
-bool ReadCorpus(string filename, Bitext& bitext, bool add_bos_eos);
+// Reads a corpus in either the source ||| target text format or the binary
+// format written by WriteCompiledCorpus, which is detected automatically.
+// Text is parsed in num_threads chunks (0 for one per core). The result is the
+// same whatever the number of threads.
+bool ReadCorpus(string filename, Bitext& bitext, bool add_bos_eos, unsigned num_threads = 1);
+
+// Collapses identical (source, target) pairs into the first occurrence, whose
+// weight becomes the total weight of its copies. The total is then raised to
+// the power 1 / temperature and capped at max_weight (if max_weight > 0).
+// Returns the number of pairs that were removed.
+unsigned DeduplicateBitext(Bitext& bitext, float temperature = 1.0f, float max_weight = 0.0f);
+
+// Writes the vocabularies and flat, offset-indexed token arrays of bitext, so
+// that ReadCorpus can later mmap it without any parsing.
+bool WriteCompiledCorpus(string filename, const Bitext& bitext, bool add_bos_eos);
+bool IsCompiledCorpus(string filename);
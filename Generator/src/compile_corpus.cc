@@ -0,0 +1,63 @@
+#include <boost/program_options.hpp>
+
+#include <iostream>
+
+#include "bitext.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Converts a source ||| target text corpus into the binary format that train
+// can mmap, so that tokenization and vocabulary lookups happen only once.
+int main(int argc, char** argv) {
+  po::options_description desc("description");
+  desc.add_options()
+  ("input", po::value<string>()->required(), "Bitext in source ||| target format")
+  ("output", po::value<string>()->required(), "Where to write the compiled corpus")
+  ("load_threads", po::value<unsigned>()->default_value(0), "Number of threads used to parse the input. 0 uses one per core.")
+  ("dedup", "Merge identical sentence pairs into one pair, weighted by the number of copies")
+  ("dedup_temperature", po::value<double>()->default_value(1.0), "With --dedup, each merged weight is raised to the power 1 / this")
+  ("max_weight", po::value<double>()->default_value(0.0), "With --dedup, cap merged weights at this value. 0 means no cap.")
+  ("no_bos_eos", "Don't add <s> and </s> to each sentence. train expects them, so this is rarely what you want.")
+  ("help", "Display this help message");
+
+  po::positional_options_description positional_options;
+  positional_options.add("input", 1);
+  positional_options.add("output", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  const string input_filename = vm["input"].as<string>();
+  const string output_filename = vm["output"].as<string>();
+  const bool add_bos_eos = vm.count("no_bos_eos") == 0;
+  if (!(vm["dedup_temperature"].as<double>() > 0.0) || !(vm["max_weight"].as<double>() >= 0.0)) {
+    cerr << "Invalid parameters: --dedup_temperature must be positive and --max_weight must not be negative." << endl;
+    exit(1);
+  }
+
+  Bitext bitext;
+  if (!ReadCorpus(input_filename, bitext, add_bos_eos, vm["load_threads"].as<unsigned>())) {
+    cerr << "ERROR: Unable to read " << input_filename << endl;
+    return 1;
+  }
+  cerr << "Read " << bitext.size() << " lines from " << input_filename << endl;
+  cerr << "Vocab size: " << bitext.source_vocab.size() << "/" << bitext.target_vocab.size() << endl;
+  if (vm.count("dedup")) {
+    unsigned removed = DeduplicateBitext(bitext, vm["dedup_temperature"].as<double>(), vm["max_weight"].as<double>());
+    cerr << "Merged " << removed << " duplicate sentence pairs, leaving " << bitext.size() << endl;
+  }
+
+  if (!WriteCompiledCorpus(output_filename, bitext, add_bos_eos)) {
+    cerr << "ERROR: Unable to write " << output_filename << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include "corpusstream.h"
+#include "tokenizer.h"
+
+CorpusStream::CorpusStream(const vector<string>& shard_filenames, const Dict& source_vocab, const Dict& target_vocab, unsigned buffer_size, unsigned seed) :
+    shard_filenames(shard_filenames), source_vocab(source_vocab), target_vocab(target_vocab), buffer_size(buffer_size), rng(seed),
+    shard_position(0), loading_done(true), stop_loading(false) {
+  assert (buffer_size > 0);
+  this->source_vocab.Freeze();
+  this->source_vocab.SetUnk("UNK");
+  this->target_vocab.Freeze();
+  this->target_vocab.SetUnk("UNK");
+}
+
+CorpusStream::~CorpusStream() {
+  StopLoading();
+}
+
+void CorpusStream::StopLoading() {
+  if (loader.joinable()) {
+    {
+      lock_guard<mutex> lock(m);
+      stop_loading = true;
+    }
+    cv.notify_all();
+    loader.join();
+  }
+  loaded_shards.clear();
+  stop_loading = false;
+}
+
+void CorpusStream::StartEpoch() {
+  StopLoading();
+  buffer.clear();
+  shard.reset();
+  shard_position = 0;
+
+  vector<string> shard_order = shard_filenames;
+  shuffle(shard_order.begin(), shard_order.end(), rng);
+  loading_done = false;
+  loader = thread(&CorpusStream::LoadShards, this, shard_order);
+
+  BufferedPair buffered_pair;
+  while (buffer.size() < buffer_size && NextFromShard(buffered_pair)) {
+    buffer.push_back(buffered_pair);
+  }
+}
+
+void CorpusStream::LoadShards(vector<string> shard_order) {
+  for (const string& filename : shard_order) {
+    shared_ptr<Bitext> bitext = make_shared<Bitext>();
+    bitext->source_vocab = source_vocab;
+    bitext->target_vocab = target_vocab;
+    if (!ReadCorpus(filename, *bitext, true)) {
+      cerr << "WARNING: Unable to read shard " << filename << endl;
+      continue;
+    }
+
+    // Stay at most one shard ahead of the trainer
+    unique_lock<mutex> lock(m);
+    cv.wait(lock, [this]() { return loaded_shards.empty() || stop_loading; });
+    if (stop_loading) {
+      break;
+    }
+    loaded_shards.push_back(bitext);
+    cv.notify_all();
+  }
+
+  lock_guard<mutex> lock(m);
+  loading_done = true;
+  cv.notify_all();
+}
+
+// Returns the next sentence in file order, waiting for the loader if need be
+bool CorpusStream::NextFromShard(BufferedPair& buffered_pair) {
+  while (shard == nullptr || shard_position >= shard->size()) {
+    unique_lock<mutex> lock(m);
+    cv.wait(lock, [this]() { return !loaded_shards.empty() || loading_done; });
+    if (loaded_shards.empty()) {
+      shard.reset();
+      return false;
+    }
+    shard = loaded_shards.front();
+    loaded_shards.pop_front();
+    shard_position = 0;
+    cv.notify_all();
+  }
+  buffered_pair = make_pair(shard->sentences[shard_position++], shard);
+  return true;
+}
+
+bool CorpusStream::Next(Bitext::SentencePair& pair) {
+  if (buffer.empty()) {
+    return false;
+  }
+
+  // Emit a random element of the buffer and refill its slot from the stream
+  uniform_int_distribution<unsigned> pick(0, buffer.size() - 1);
+  unsigned i = pick(rng);
+  current = buffer[i];
+  if (!NextFromShard(buffer[i])) {
+    buffer[i] = buffer.back();
+    buffer.pop_back();
+  }
+  pair = current.first;
+  return true;
+}
+
+vector<string> ReadShardList(const string& filename) {
+  vector<string> shard_filenames;
+  ifstream f(filename);
+  for (string line; getline(f, line);) {
+    StringPiece filename = Strip(line);
+    if (filename.size() > 0) {
+      shard_filenames.push_back(string(filename.data(), filename.size()));
+    }
+  }
+  return shard_filenames;
+}
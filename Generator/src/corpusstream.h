@@ -0,0 +1,60 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "bitext.h"
+
+using namespace std;
+
+// Streams a training corpus that is split over many shard files, so that only
+// a few shards are ever in memory. Shards are read in a new random order each
+// epoch, and a background thread loads the next shard while the current one
+// is being trained on. Sentences are shuffled within a bounded buffer, which
+// mixes neighbouring shards.
+class CorpusStream {
+public:
+  // Every shard is mapped into the given (frozen) vocabularies
+  CorpusStream(const vector<string>& shard_filenames, const Dict& source_vocab, const Dict& target_vocab, unsigned buffer_size, unsigned seed);
+  ~CorpusStream();
+  CorpusStream(const CorpusStream&) = delete;
+  CorpusStream& operator=(const CorpusStream&) = delete;
+
+  void StartEpoch();
+  // Returns false once every sentence of the epoch has been returned. The
+  // pair stays valid until the next call to Next or StartEpoch.
+  bool Next(Bitext::SentencePair& pair);
+
+private:
+  // A sentence pair, plus the shard that owns its words
+  typedef pair<Bitext::SentencePair, shared_ptr<const Bitext>> BufferedPair;
+
+  void LoadShards(vector<string> shard_order);
+  bool NextFromShard(BufferedPair& buffered_pair);
+  void StopLoading();
+
+  vector<string> shard_filenames;
+  Dict source_vocab;
+  Dict target_vocab;
+  unsigned buffer_size;
+  mt19937 rng;
+
+  vector<BufferedPair> buffer;
+  BufferedPair current;
+  shared_ptr<const Bitext> shard; // The shard currently being read into the buffer
+  unsigned shard_position;
+
+  // Shared with the loader thread
+  thread loader;
+  deque<shared_ptr<const Bitext>> loaded_shards;
+  bool loading_done;
+  bool stop_loading;
+  mutex m;
+  condition_variable cv;
+};
+
+// Reads a file with one shard filename per line
+vector<string> ReadShardList(const string& filename);
@@ -1,12 +1,13 @@
 #include <iostream>
+#include <map>
 #include "decoder.h"
 #include "utils.h"
 
-Decoder::Decoder(Generator* model) {
+Decoder::Decoder(TranslationModel* model) : class_beam(0) {
   models.push_back(model);
 }
 
-Decoder::Decoder(const vector<Generator*>& models) : models(models) {
+Decoder::Decoder(const vector<TranslationModel*>& models) : models(models), class_beam(0) {
   assert (models.size() > 0);
 }
 
@@ -16,6 +17,14 @@ void Decoder::SetParams(unsigned max_length, WordId kSOS, WordId kEOS) {
   this->kEOS = kEOS;
 }
 
+void Decoder::SetClassBeam(unsigned class_beam) {
+  this->class_beam = class_beam;
+}
+
+void Decoder::SetSamplingOptions(const SamplingOptions& options, unsigned seed) {
+  sampler.SetOptions(options, seed);
+}
+
 vector<WordId> Decoder::Translate(const vector<WordId>& source, unsigned beam_size, ComputationGraph& cg) {
   KBestList<vector<WordId>> kbest = TranslateKBest(source, 1, beam_size, cg);
   return kbest.hypothesis_list().begin()->second;
@@ -29,8 +38,7 @@ KBestList<vector<WordId>> Decoder::TranslateKBest(const vector<WordId>& source,
   // XXX: We're storing the same word sequence N times
   vector<PartialHypothesis> initial_partial_hyps(models.size());
   for (unsigned i = 0; i < models.size(); ++i) {
-    models[i]->Encode(source, cg);
-    initial_partial_hyps[i] = {{kSOS}, models[i]->output_builder.back(), models[i]->output_builder.state()};
+    initial_partial_hyps[i] = {{kSOS}, models[i]->StartDecoding(source, kSOS, cg)};
   }
   top_hyps.add(0.0, initial_partial_hyps);
 
@@ -41,26 +49,30 @@ KBestList<vector<WordId>> Decoder::TranslateKBest(const vector<WordId>& source,
       double score = scored_hyp.first;
       vector<PartialHypothesis>& hyp = scored_hyp.second;
       assert (hyp[0].words.size() == t);
-      WordId prev_word = hyp[0].words.back();
 
-      vector<Expression> model_log_output_distributions(models.size());
-      for (unsigned i = 0; i < models.size(); ++i) {
-        Generator* model = models[i];
-        const MLP& final_mlp = model->GetFinalMLP(cg);
-        model_log_output_distributions[i] = model->ComputeNormalizedLogOutputDistribution(hyp[i].output_state, final_mlp, cg);
+      // If word_ids stays empty, row j of the distribution is the score of word j
+      vector<WordId> word_ids;
+      if (class_beam > 0 && models.size() == 1) {
+        models[0]->ComputeLogOutputDistribution(hyp[0].state, class_beam, &word_ids, cg);
       }
+      else {
+        vector<Expression> model_log_output_distributions(models.size());
+        for (unsigned i = 0; i < models.size(); ++i) {
+          model_log_output_distributions[i] = models[i]->ComputeLogOutputDistribution(hyp[i].state, 0, &word_ids, cg);
+        }
 
-      Expression overall_distribution = sum(model_log_output_distributions) / models.size();
+        Expression overall_distribution = sum(model_log_output_distributions) / models.size();
 
-      if (models.size() > 1) {
-        overall_distribution = log(softmax(overall_distribution)); // Renormalize
+        if (models.size() > 1) {
+          overall_distribution = log(softmax(overall_distribution)); // Renormalize
+        }
       }
       vector<float> dist = as_vector(cg.incremental_forward());
 
       // Take the K best-looking words
       KBestList<WordId> best_words(beam_size);
       for (unsigned j = 0; j < dist.size(); ++j) {
-        best_words.add(dist[j], j);
+        best_words.add(dist[j], word_ids.size() > 0 ? word_ids[j] : j);
       }
 
       // For each of those K words, add it to the current hypothesis, and add the
@@ -72,8 +84,7 @@ KBestList<vector<WordId>> Decoder::TranslateKBest(const vector<WordId>& source,
         double new_score = score + word_score;
         vector<PartialHypothesis> new_model_hyps(models.size());
         for (unsigned i = 0; i < models.size(); ++i) {
-          Expression output_state = models[i]->AddOutputWord(word, hyp[i].rnn_pointer, cg);
-          PartialHypothesis new_hyp = {hyp[i].words, output_state, models[i]->output_builder.state()};
+          PartialHypothesis new_hyp = {hyp[i].words, models[i]->AddOutputWord(hyp[i].state, word, cg)};
           new_hyp.words.push_back(word);
           new_model_hyps[i] = new_hyp;
         }
@@ -90,3 +101,76 @@ KBestList<vector<WordId>> Decoder::TranslateKBest(const vector<WordId>& source,
   }
   return completed_hyps;
 }
+
+vector<WordId> Decoder::SampleTranslation(const vector<WordId>& source, ComputationGraph& cg) {
+  return SampleTranslations(source, 1, cg)[0].second;
+}
+
+Expression Decoder::LogOutputDistribution(const vector<DecoderState>& states, ComputationGraph& cg) {
+  vector<WordId> word_ids;
+  vector<Expression> model_log_output_distributions(models.size());
+  for (unsigned i = 0; i < models.size(); ++i) {
+    model_log_output_distributions[i] = models[i]->ComputeLogOutputDistribution(states[i], 0, &word_ids, cg);
+  }
+
+  Expression overall_distribution = sum(model_log_output_distributions) / models.size();
+  if (models.size() > 1) {
+    overall_distribution = log(softmax(overall_distribution)); // Renormalize
+  }
+  return overall_distribution;
+}
+
+vector<pair<double, vector<WordId>>> Decoder::SampleTranslations(const vector<WordId>& source, unsigned num_samples, ComputationGraph& cg) {
+  vector<pair<double, vector<WordId>>> samples(num_samples, make_pair(0.0, vector<WordId>(1, kSOS)));
+
+  // Samples that have drawn the same words so far share a row of states, so
+  // each distinct prefix is extended and scored only once per step.
+  vector<vector<DecoderState>> rows(1, vector<DecoderState>(models.size()));
+  for (unsigned i = 0; i < models.size(); ++i) {
+    rows[0][i] = models[i]->StartDecoding(source, kSOS, cg);
+  }
+  vector<unsigned> live(num_samples);
+  vector<unsigned> row_of(num_samples, 0);
+  for (unsigned s = 0; s < num_samples; ++s) {
+    live[s] = s;
+  }
+
+  for (unsigned t = 1; t <= max_length && live.size() > 0; ++t) {
+    vector<Expression> distributions(rows.size());
+    for (unsigned r = 0; r < rows.size(); ++r) {
+      distributions[r] = LogOutputDistribution(rows[r], cg);
+    }
+    cg.incremental_forward();
+    vector<vector<float>> dists(rows.size());
+    for (unsigned r = 0; r < rows.size(); ++r) {
+      dists[r] = as_vector(distributions[r].value());
+    }
+
+    vector<vector<DecoderState>> new_rows;
+    map<pair<unsigned, WordId>, unsigned> new_row_of; // (row, word) -> new row
+    vector<unsigned> still_live;
+    for (unsigned s : live) {
+      const vector<float>& dist = dists[row_of[s]];
+      WordId word = sampler.Sample(dist.data(), dist.size());
+      samples[s].first += dist[word];
+      samples[s].second.push_back(word);
+      if (t == max_length || word == kEOS) {
+        continue;
+      }
+
+      auto inserted = new_row_of.insert(make_pair(make_pair(row_of[s], word), (unsigned)new_rows.size()));
+      if (inserted.second) {
+        vector<DecoderState> new_row(models.size());
+        for (unsigned i = 0; i < models.size(); ++i) {
+          new_row[i] = models[i]->AddOutputWord(rows[row_of[s]][i], word, cg);
+        }
+        new_rows.push_back(new_row);
+      }
+      row_of[s] = inserted.first->second;
+      still_live.push_back(s);
+    }
+    rows = new_rows;
+    live = still_live;
+  }
+  return samples;
+}
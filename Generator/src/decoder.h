@@ -1,27 +1,42 @@
 #pragma once
-#include "encdec.h"
+#include "translationmodel.h"
+#include "kbestlist.h"
+#include "sampling.h"
 
 struct PartialHypothesis {
   vector<WordId> words;
-  Expression output_state;
-  RNNPointer rnn_pointer;
+  DecoderState state;
 };
 
-typedef EncoderDecoderModel Generator;
-
 class Decoder {
 public:
-  explicit Decoder(Generator* model);
-  explicit Decoder(const vector<Generator*>& models);
+  explicit Decoder(TranslationModel* model);
+  explicit Decoder(const vector<TranslationModel*>& models);
   void SetParams(unsigned max_length, WordId kSOS, WordId kEOS);
+  // For a single class-factored model, only expand words from this many
+  // of the most probable classes at each step. 0 scores every word.
+  void SetClassBeam(unsigned class_beam);
+  void SetSamplingOptions(const SamplingOptions& options, unsigned seed = 0);
 
-  vector<WordId> SampleTranslation(const vector<WordId>& source);
+  // Draws num_samples translations by ancestral sampling, in the order they
+  // were drawn, each with its log probability under the (untempered) model.
+  // Samples with the same prefix share their states, and every step evaluates
+  // all of the distinct prefixes with a single forward pass. The models' cnn
+  // interface scores one state at a time, so nothing is stacked; BatchSampler
+  // stacks the samples of encoder-decoder models.
+  vector<pair<double, vector<WordId>>> SampleTranslations(const vector<WordId>& source, unsigned num_samples, ComputationGraph& cg);
+  vector<WordId> SampleTranslation(const vector<WordId>& source, ComputationGraph& cg);
   vector<WordId> Translate(const vector<WordId>& source, unsigned beam_size, ComputationGraph& cg);
   KBestList<vector<WordId>> TranslateKBest(const vector<WordId>& source, unsigned K, unsigned beam_size, ComputationGraph& cg);
 
 private:
-  vector<Generator*> models;
+  // The ensemble's log distribution over the next word, as an expression over the models' states
+  Expression LogOutputDistribution(const vector<DecoderState>& states, ComputationGraph& cg);
+
+  vector<TranslationModel*> models;
   unsigned max_length;
   WordId kSOS;
   WordId kEOS;
+  unsigned class_beam;
+  WordSampler sampler;
 };
@@ -1,4 +1,5 @@
 #include <queue>
+#include <unordered_map>
 #include "cnn/nodes.h"
 #include "cnn/cnn.h"
 #include "cnn/expr.h"
@@ -6,6 +7,7 @@
 
 #include "bitext.h"
 #include "encdec.h"
+#include "kbestlist.h"
 
 using namespace std;
 using namespace cnn;
@@ -13,7 +15,11 @@ using namespace cnn::expr;
 
 EncoderDecoderModel::EncoderDecoderModel() : feed(false) {}
 
-EncoderDecoderModel::EncoderDecoderModel(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size, bool train, bool feed) : feed(feed) {
+EncoderDecoderModel::EncoderDecoderModel(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size, bool train, bool feed, const WordClasses* word_classes) : feed(feed) {
+  if (word_classes != NULL) {
+    class_factored = true;
+    this->word_classes = *word_classes;
+  }
   InitializeParameters(model, src_vocab_size, tgt_vocab_size, train);
 }
 
@@ -26,8 +32,29 @@ void EncoderDecoderModel::InitializeParameters(Model& model, unsigned src_vocab_
 
   p_fIH = model.add_parameters({final_hidden_dim, output_hidden_dim});
   p_fHb = model.add_parameters({final_hidden_dim});
-  p_fHO = model.add_parameters({tgt_vocab_size, final_hidden_dim});
-  p_fOb = model.add_parameters({tgt_vocab_size});
+  if (class_factored) {
+    assert (word_classes.vocab_size() == tgt_vocab_size);
+    const unsigned num_classes = word_classes.num_classes();
+    p_fHO = model.add_parameters({num_classes, final_hidden_dim});
+    p_fOb = model.add_parameters({num_classes});
+    p_wHO.clear();
+    p_wOb.clear();
+    class_order.resize(tgt_vocab_size);
+    unsigned offset = 0;
+    for (unsigned c = 0; c < num_classes; ++c) {
+      const unsigned class_size = word_classes.class_words[c].size();
+      p_wHO.push_back(model.add_parameters({class_size, final_hidden_dim}));
+      p_wOb.push_back(model.add_parameters({class_size}));
+      for (WordId word : word_classes.class_words[c]) {
+        class_order[word] = offset + word_classes.index_in_class[word];
+      }
+      offset += class_size;
+    }
+  }
+  else {
+    p_fHO = model.add_parameters({tgt_vocab_size, final_hidden_dim});
+    p_fOb = model.add_parameters({tgt_vocab_size});
+  }
 
   p_mW = model.add_parameters({output_builder.num_h0_components() * output_hidden_dim, 2 * half_encoding_dim});
   p_mb = model.add_parameters({output_builder.num_h0_components() * output_hidden_dim});
@@ -73,6 +100,66 @@ Expression EncoderDecoderModel::BuildReverseEncoding(const vector<WordId>& sente
   return r;
 }
 
+// The words at position t of each sentence, as a batched lookup. Sentences that
+// are too short contribute pad instead.
+vector<unsigned> GetBatchColumn(const vector<vector<WordId>>& sentences, unsigned t, WordId pad) {
+  vector<unsigned> words(sentences.size());
+  for (unsigned i = 0; i < sentences.size(); ++i) {
+    words[i] = (t < sentences[i].size()) ? sentences[i][t] : pad;
+  }
+  return words;
+}
+
+// A batch of dim-sized vectors, all ones for the sentences whose last word is
+// at position t and all zeros for the rest
+Expression LastWordMask(const vector<vector<WordId>>& sentences, unsigned t, unsigned dim, ComputationGraph& cg) {
+  vector<float> mask(dim * sentences.size(), 0.0f);
+  for (unsigned i = 0; i < sentences.size(); ++i) {
+    if (sentences[i].size() == t + 1) {
+      fill(mask.begin() + i * dim, mask.begin() + (i + 1) * dim, 1.0f);
+    }
+  }
+  return input(cg, Dim({dim}, sentences.size()), mask);
+}
+
+// Shorter sentences are padded at the end. Each sentence's encoding is the
+// builder's output after its own last word, picked out of the padded steps
+// with masks, so the padding never reaches it.
+Expression EncoderDecoderModel::BuildBatchEncoding(LSTMBuilder& builder, const vector<Expression>& init,
+    const vector<vector<WordId>>& sentences, ComputationGraph& cg) {
+  unsigned min_length = sentences[0].size();
+  unsigned max_length = 0;
+  for (const vector<WordId>& sentence : sentences) {
+    min_length = min(min_length, (unsigned)sentence.size());
+    max_length = max(max_length, (unsigned)sentence.size());
+  }
+  assert (min_length > 0);
+  builder.new_graph(cg);
+  builder.start_new_sequence(init);
+  Expression r;
+  vector<Expression> encodings;
+  for (unsigned t = 0; t < max_length; ++t) {
+    Expression i_x_t = lookup(cg, p_Es, GetBatchColumn(sentences, t, 0));
+    r = builder.add_input(i_x_t);
+    if (t + 1 >= min_length && min_length != max_length) {
+      encodings.push_back(cwise_multiply(r, LastWordMask(sentences, t, half_encoding_dim, cg)));
+    }
+  }
+  return (min_length == max_length) ? r : sum(encodings);
+}
+
+Expression EncoderDecoderModel::BuildForwardEncoding(const vector<vector<WordId>>& sentences, ComputationGraph& cg) {
+  return BuildBatchEncoding(forward_builder, forward_init, sentences, cg);
+}
+
+Expression EncoderDecoderModel::BuildReverseEncoding(const vector<vector<WordId>>& sentences, ComputationGraph& cg) {
+  vector<vector<WordId>> reversed(sentences.size());
+  for (unsigned i = 0; i < sentences.size(); ++i) {
+    reversed[i].assign(sentences[i].rbegin(), sentences[i].rend());
+  }
+  return BuildBatchEncoding(reverse_builder, reverse_init, reversed, cg);
+}
+
 Expression EncoderDecoderModel::BuildEncoding(const Expression& fwd_embedding, const Expression& rev_embedding) const {
   return concatenate({fwd_embedding, rev_embedding});
 }
@@ -88,6 +175,12 @@ Expression EncoderDecoderModel::AddOutputWord(WordId word, RNNPointer location,
   return new_output_embedding;
 }
 
+Expression EncoderDecoderModel::AddOutputWords(const vector<unsigned>& words, ComputationGraph& cg) {
+  Expression word_embeddings = lookup(cg, p_Et, words);
+  Expression input = feed ? concatenate({word_embeddings, output_builder.back()}) : word_embeddings;
+  return output_builder.add_input(input);
+}
+
 Expression EncoderDecoderModel::ComputeOutputDistribution(Expression output_state, const MLP& final, ComputationGraph& cg) const {
   Expression output_dist = final.Feed({output_state}); 
   return output_dist;
@@ -98,8 +191,68 @@ Expression EncoderDecoderModel::ComputeOutputDistribution(const MLP& final, Comp
 }
 
 Expression EncoderDecoderModel::ComputeNormalizedLogOutputDistribution(Expression output_state, const MLP& final, ComputationGraph& cg) const {
-  Expression output_dist = ComputeOutputDistribution(output_state, final, cg);
-  return log(softmax(output_dist));
+  if (!class_factored) {
+    Expression output_dist = ComputeOutputDistribution(output_state, final, cg);
+    return log(softmax(output_dist));
+  }
+
+  // log p(w) = log p(c) + log p(w | c) for every class, which are then
+  // shuffled from class order back into WordId order.
+  Expression hidden = final.Hidden({output_state});
+  Expression class_log_dist = log_softmax(affine_transform({final.i_Ob, final.i_HO, hidden}));
+  vector<Expression> pieces(word_classes.num_classes());
+  for (unsigned c = 0; c < word_classes.num_classes(); ++c) {
+    pieces[c] = ComputeClassOutputDistribution(c, hidden, class_log_dist, cg);
+  }
+  return select_rows(concatenate(pieces), class_order);
+}
+
+Expression EncoderDecoderModel::ComputePrunedLogOutputDistribution(Expression output_state, const MLP& final, unsigned class_beam, vector<WordId>* word_ids, ComputationGraph& cg) const {
+  assert (class_factored);
+  Expression hidden = final.Hidden({output_state});
+  Expression class_log_dist = log_softmax(affine_transform({final.i_Ob, final.i_HO, hidden}));
+  cg.incremental_forward();
+  vector<float> class_scores = as_vector(class_log_dist.value());
+
+  KBestList<unsigned> best_classes(class_beam);
+  for (unsigned c = 0; c < class_scores.size(); ++c) {
+    best_classes.add(class_scores[c], c);
+  }
+
+  word_ids->clear();
+  vector<Expression> pieces;
+  for (auto& scored_class : best_classes.hypothesis_list()) {
+    unsigned c = scored_class.second;
+    pieces.push_back(ComputeClassOutputDistribution(c, hidden, class_log_dist, cg));
+    word_ids->insert(word_ids->end(), word_classes.class_words[c].begin(), word_classes.class_words[c].end());
+  }
+  return concatenate(pieces);
+}
+
+// Returns log p(w | c) + log p(c) for each word w in class c
+Expression EncoderDecoderModel::ComputeClassOutputDistribution(unsigned c, Expression hidden, Expression class_log_dist, ComputationGraph& cg) const {
+  Expression i_wHO = parameter(cg, p_wHO[c]);
+  Expression i_wOb = parameter(cg, p_wOb[c]);
+  Expression word_log_dist = log_softmax(affine_transform({i_wOb, i_wHO, hidden}));
+  // cnn doesn't broadcast, so log p(c) is spread over the class with a column of ones
+  const unsigned class_size = word_classes.class_words[c].size();
+  Expression ones = input(cg, {class_size}, vector<float>(class_size, 1.0f));
+  return word_log_dist + ones * pick(class_log_dist, c);
+}
+
+Expression EncoderDecoderModel::ComputeWordLoss(Expression output_state, const MLP& final, WordId word, ComputationGraph& cg) const {
+  if (!class_factored) {
+    Expression dist = ComputeOutputDistribution(output_state, final, cg);
+    return pickneglogsoftmax(dist, word);
+  }
+
+  Expression hidden = final.Hidden({output_state});
+  unsigned c = word_classes.word_class[word];
+  Expression class_loss = pickneglogsoftmax(affine_transform({final.i_Ob, final.i_HO, hidden}), c);
+  Expression i_wHO = parameter(cg, p_wHO[c]);
+  Expression i_wOb = parameter(cg, p_wOb[c]);
+  Expression word_loss = pickneglogsoftmax(affine_transform({i_wOb, i_wHO, hidden}), word_classes.index_in_class[word]);
+  return class_loss + word_loss;
 }
 
 Expression EncoderDecoderModel::ComputeNormalizedLogOutputDistribution(const MLP& final, ComputationGraph& cg) const {
@@ -135,7 +288,10 @@ void EncoderDecoderModel::Encode(const vector<WordId>& source, ComputationGraph&
   output_builder.new_graph(cg);
 
   Expression encoding = BuildEncoding(BuildForwardEncoding(source, cg), BuildReverseEncoding(source, cg));
+  StartOutputSequence(encoding);
+}
 
+void EncoderDecoderModel::StartOutputSequence(const Expression& encoding) {
   Expression output_init_all = tanh(affine_transform({mb, mW, encoding}));
   vector<Expression> output_init;
   unsigned start = 0;
@@ -147,6 +303,32 @@ void EncoderDecoderModel::Encode(const vector<WordId>& source, ComputationGraph&
   output_builder.start_new_sequence(output_init);
 }
 
+// Built by StartDecoding and shared by every hypothesis
+struct EncoderDecoderSourceState : public SourceState {
+  MLP final;
+};
+
+DecoderState EncoderDecoderModel::StartDecoding(const vector<WordId>& source, WordId kSOS, ComputationGraph& cg) {
+  Encode(source, cg);
+  shared_ptr<EncoderDecoderSourceState> source_state = make_shared<EncoderDecoderSourceState>();
+  source_state->final = GetFinalMLP(cg);
+  return {output_builder.back(), Expression(), output_builder.state(), kSOS, source_state};
+}
+
+DecoderState EncoderDecoderModel::AddOutputWord(const DecoderState& state, WordId word, ComputationGraph& cg) {
+  Expression output_state = AddOutputWord(word, state.rnn_pointer, cg);
+  return {output_state, Expression(), output_builder.state(), word, state.source};
+}
+
+Expression EncoderDecoderModel::ComputeLogOutputDistribution(const DecoderState& state, unsigned class_beam, vector<WordId>* word_ids, ComputationGraph& cg) {
+  word_ids->clear();
+  const MLP& final = static_cast<const EncoderDecoderSourceState&>(*state.source).final;
+  if (class_beam > 0 && class_factored) {
+    return ComputePrunedLogOutputDistribution(state.output_state, final, class_beam, word_ids, cg);
+  }
+  return ComputeNormalizedLogOutputDistribution(state.output_state, final, cg);
+}
+
 Expression EncoderDecoderModel::BuildGraph(const vector<WordId>& source, const vector<WordId>& target, ComputationGraph& cg) {
   // Target should always contain at least <s> and </s>
   assert (target.size() > 2);
@@ -160,8 +342,75 @@ Expression EncoderDecoderModel::BuildGraph(const vector<WordId>& source, const v
 
   vector<Expression> losses;
   for (unsigned t = 1; t < target.size(); ++t) {
-    Expression dist = ComputeOutputDistribution(final, cg);
-    Expression word_loss = pickneglogsoftmax(dist, target[t]);
+    Expression word_loss = ComputeWordLoss(output_builder.back(), final, target[t], cg);
+    losses.push_back(word_loss);
+    AddOutputWord(target[t], cg);
+  }
+
+  Expression total_loss = sum(losses);
+  return total_loss;
+}
+
+Expression EncoderDecoderModel::BuildBatchGraph(const vector<vector<WordId>>& sources, const vector<vector<WordId>>& targets,
+    const vector<float>& weights, ComputationGraph& cg) {
+  assert (!class_factored);
+  const unsigned batch_size = sources.size();
+  assert (batch_size > 0 && targets.size() == batch_size && weights.size() == batch_size);
+  unsigned max_target_length = 0;
+  for (unsigned i = 0; i < batch_size; ++i) {
+    max_target_length = max(max_target_length, (unsigned)targets[i].size());
+  }
+
+  NewGraph(cg);
+  output_builder.new_graph(cg);
+  Expression encoding = BuildEncoding(BuildForwardEncoding(sources, cg), BuildReverseEncoding(sources, cg));
+  StartOutputSequence(encoding);
+  MLP final = GetFinalMLP(cg);
+
+  // Sentences that have already ended keep being fed </s>, and a mask zeroes their losses
+  const WordId kEOS = 2;
+  vector<Expression> losses;
+  for (unsigned t = 1; t < max_target_length; ++t) {
+    vector<unsigned> words = GetBatchColumn(targets, t, kEOS);
+    vector<float> mask(batch_size);
+    for (unsigned i = 0; i < batch_size; ++i) {
+      mask[i] = (t < targets[i].size()) ? weights[i] : 0.0f;
+    }
+    Expression word_losses = pickneglogsoftmax(ComputeOutputDistribution(output_builder.back(), final, cg), words);
+    losses.push_back(cwise_multiply(word_losses, input(cg, Dim({1}, batch_size), mask)));
+    AddOutputWords(words, cg);
+  }
+
+  // Averaging over the pairs keeps each update the size of a single pair's,
+  // as the per-sentence trainers' update(1.0) is
+  return sum_batches(sum(losses)) / batch_size;
+}
+
+Expression EncoderDecoderModel::BuildSampledGraph(const vector<WordId>& source, const vector<WordId>& target,
+    const vector<WordId>& candidates, const vector<float>& log_correction, ComputationGraph& cg) {
+  assert (target.size() > 2);
+  assert (candidates.size() == log_correction.size());
+  assert (!class_factored);
+
+  unordered_map<WordId, unsigned> candidate_index;
+  for (unsigned i = 0; i < candidates.size(); ++i) {
+    candidate_index[candidates[i]] = i;
+  }
+
+  Encode(source, cg);
+  MLP final = GetFinalMLP(cg);
+
+  // Only the rows of the output layer belonging to candidate words are ever touched.
+  vector<unsigned> rows(candidates.begin(), candidates.end());
+  Expression sampled_HO = select_rows(final.i_HO, rows);
+  Expression sampled_Ob = select_rows(final.i_Ob, rows) - input(cg, {(unsigned)rows.size()}, log_correction);
+
+  vector<Expression> losses;
+  for (unsigned t = 1; t < target.size(); ++t) {
+    assert (candidate_index.find(target[t]) != candidate_index.end());
+    Expression hidden = final.Hidden({output_builder.back()});
+    Expression dist = affine_transform({sampled_Ob, sampled_HO, hidden});
+    Expression word_loss = pickneglogsoftmax(dist, candidate_index[target[t]]);
     losses.push_back(word_loss);
     AddOutputWord(target[t], cg);
   }
@@ -1,38 +1,69 @@
 #pragma once
 #include <vector>
 #include <boost/archive/text_oarchive.hpp>
+#include <boost/serialization/version.hpp>
 #include "cnn/cnn.h"
 #include "cnn/expr.h"
 #include "cnn/lstm.h"
 #include "bitext.h"
 #include "kbestlist.h"
 #include "mlp.h"
+#include "wordclasses.h"
+#include "translationmodel.h"
 
 using namespace std;
 using namespace cnn;
 using namespace cnn::expr;
 
-class EncoderDecoderModel {
-  friend class Decoder;
+class EncoderDecoderModel : public TranslationModel {
+  friend class InferenceModel;
 public:
   EncoderDecoderModel();
-  EncoderDecoderModel(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size, bool train = false, bool feed = false);
+  EncoderDecoderModel(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size, bool train = false, bool feed = false, const WordClasses* word_classes = NULL);
   void InitializeParameters(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size, bool train);
   void Encode(const vector<WordId>& source, ComputationGraph& cg);
-  Expression BuildGraph(const vector<WordId>& source, const vector<WordId>& target, ComputationGraph& cg);
+  Expression BuildGraph(const vector<WordId>& source, const vector<WordId>& target, ComputationGraph& cg) override;
+  // Like BuildGraph, but each softmax is computed only over the given candidate words.
+  // Every word in target[1:] must appear in candidates. log_correction is subtracted
+  // from the candidates' logits (see UnigramSampler::BuildCandidates).
+  Expression BuildSampledGraph(const vector<WordId>& source, const vector<WordId>& target,
+    const vector<WordId>& candidates, const vector<float>& log_correction, ComputationGraph& cg);
+  // Like BuildGraph, but for a minibatch that is run through the network as one
+  // batched graph. Sources and targets may both be ragged, and are padded and
+  // masked. Each sentence's loss is scaled by its weight. Returns the mean loss per
+  // sentence pair, rather than the sum.
+  Expression BuildBatchGraph(const vector<vector<WordId>>& sources, const vector<vector<WordId>>& targets,
+    const vector<float>& weights, ComputationGraph& cg);
   void NewGraph(ComputationGraph& cg);
+  bool IsClassFactored() const { return class_factored; }
+
+  DecoderState StartDecoding(const vector<WordId>& source, WordId kSOS, ComputationGraph& cg) override;
+  DecoderState AddOutputWord(const DecoderState& state, WordId word, ComputationGraph& cg) override;
+  Expression ComputeLogOutputDistribution(const DecoderState& state, unsigned class_beam, vector<WordId>* word_ids, ComputationGraph& cg) override;
 
 protected:
   Expression BuildForwardEncoding(const vector<WordId>& sentence, ComputationGraph& cg);
   Expression BuildReverseEncoding(const vector<WordId>& sentence, ComputationGraph& cg);
   Expression BuildEncoding(const Expression& fwd_encoding, const Expression& rev_encoding) const;
+  Expression BuildForwardEncoding(const vector<vector<WordId>>& sentences, ComputationGraph& cg);
+  Expression BuildReverseEncoding(const vector<vector<WordId>>& sentences, ComputationGraph& cg);
+  void StartOutputSequence(const Expression& encoding);
+  // Runs builder over a batch of sentences of any lengths, and returns each one's final output
+  Expression BuildBatchEncoding(LSTMBuilder& builder, const vector<Expression>& init,
+    const vector<vector<WordId>>& sentences, ComputationGraph& cg);
 
   Expression AddOutputWord(WordId word, ComputationGraph& cg);
   Expression AddOutputWord(WordId word, RNNPointer location, ComputationGraph& cg);
+  Expression AddOutputWords(const vector<unsigned>& words, ComputationGraph& cg);
   Expression ComputeOutputDistribution(const MLP& final, ComputationGraph& cg) const;
   Expression ComputeNormalizedLogOutputDistribution(const MLP& final, ComputationGraph& cg) const;
   Expression ComputeOutputDistribution(Expression output_state, const MLP& final, ComputationGraph& cg) const;
   Expression ComputeNormalizedLogOutputDistribution(Expression output_state, const MLP& final, ComputationGraph& cg) const;
+  // Only valid for class-factored models. Scores just the words in the class_beam most
+  // probable classes. word_ids receives the word corresponding to each output row.
+  Expression ComputePrunedLogOutputDistribution(Expression output_state, const MLP& final, unsigned class_beam, vector<WordId>* word_ids, ComputationGraph& cg) const;
+  Expression ComputeWordLoss(Expression output_state, const MLP& final, WordId word, ComputationGraph& cg) const;
+  Expression ComputeClassOutputDistribution(unsigned c, Expression hidden, Expression class_log_dist, ComputationGraph& cg) const;
   MLP GetFinalMLP(ComputationGraph& cg) const; 
 
 private:
@@ -47,8 +78,11 @@ private:
   LookupParameters* p_Et; // target language word embedding matrix
   Parameters* p_fIH; // "Final" NN (from the tuple (y_{i-1}, s_i, c_i) to the distribution over output words y_i), input->hidden weights
   Parameters* p_fHb; // Same, hidden bias
-  Parameters* p_fHO; // Same, hidden->output weights
+  Parameters* p_fHO; // Same, hidden->output weights. For a class-factored softmax these score the classes.
   Parameters* p_fOb; // Same, output bias
+  vector<Parameters*> p_wHO; // Class-factored softmax only: per-class hidden->word weights
+  vector<Parameters*> p_wOb; // Class-factored softmax only: per-class word biases
+  vector<unsigned> class_order; // Maps concatenated per-class outputs back into WordId order
 
   bool feed = false;
   unsigned lstm_layer_count = 2;
@@ -56,14 +90,21 @@ private:
   unsigned half_encoding_dim = 128; // Dimensionality of h_forward and h_backward. The full h has twice this dimension.
   unsigned output_hidden_dim = 256; // Dimensionality of s_j, the state just before outputing target word y_j
   unsigned final_hidden_dim = 64; // Dimensionality of the hidden layer in the "final" FFNN
+  bool class_factored = false; // Use a two-level class-factored softmax instead of a flat one
+  WordClasses word_classes;
 
   friend class boost::serialization::access;
-  template<class Archive> void serialize(Archive& ar, const unsigned int) {
+  template<class Archive> void serialize(Archive& ar, const unsigned int version) {
     ar & lstm_layer_count;
     ar & embedding_dim;
     ar & half_encoding_dim;
     ar & output_hidden_dim;
     ar & final_hidden_dim;
     ar & feed;
+    if (version > 0) {
+      ar & class_factored;
+      ar & word_classes;
+    }
   }
 };
+BOOST_CLASS_VERSION(EncoderDecoderModel, 1)
@@ -0,0 +1,116 @@
+#include <cassert>
+#include <limits>
+#include "ensemble.h"
+
+InferenceDecoder::InferenceDecoder(const vector<InferenceModel*>& models, bool parallel) : models(models), pool(nullptr) {
+  assert (models.size() > 0);
+  if (parallel && models.size() > 1) {
+    pool = new ThreadPool(models.size());
+  }
+}
+
+InferenceDecoder::~InferenceDecoder() {
+  delete pool;
+}
+
+void InferenceDecoder::RunJobs(const vector<function<void()>>& jobs) {
+  if (pool != nullptr) {
+    pool->Run(jobs);
+  }
+  else {
+    for (const function<void()>& job : jobs) {
+      job();
+    }
+  }
+}
+
+void InferenceDecoder::SetParams(unsigned max_length, WordId kSOS, WordId kEOS) {
+  this->max_length = max_length;
+  this->kSOS = kSOS;
+  this->kEOS = kEOS;
+}
+
+KBestList<vector<WordId>> InferenceDecoder::TranslateKBest(const vector<WordId>& source, unsigned K, unsigned beam_size) {
+  const unsigned num_models = models.size();
+  KBestList<vector<WordId>> completed_hyps(K);
+
+  vector<EnsembleHypothesis> beam(1);
+  vector<double> beam_scores(1, 0.0);
+  beam[0].words.push_back(kSOS);
+  beam[0].states.resize(num_models);
+
+  vector<function<void()>> jobs(num_models);
+  for (unsigned i = 0; i < num_models; ++i) {
+    jobs[i] = [&, i]() {
+      beam[0].states[i] = models[i]->Encode(source);
+    };
+  }
+  RunJobs(jobs);
+
+  // dists[i][j] is model i's log distribution for the j-th hypothesis in the beam
+  vector<vector<Eigen::VectorXf>> dists(num_models);
+  for (unsigned t = 1; t <= max_length && beam.size() > 0; ++t) {
+    // Each model advances its own state for every hypothesis by the word that was
+    // added to it in the previous step, then scores its possible continuations.
+    for (unsigned i = 0; i < num_models; ++i) {
+      jobs[i] = [&, i, t]() {
+        dists[i].resize(beam.size());
+        for (unsigned j = 0; j < beam.size(); ++j) {
+          InferenceState& state = beam[j].states[i];
+          if (t > 1) {
+            state = models[i]->AddOutputWord(state, beam[j].words.back());
+          }
+          models[i]->ComputeLogDistribution(state, dists[i][j]);
+        }
+      };
+    }
+    RunJobs(jobs);
+
+    KBestList<pair<unsigned, WordId>> new_hyps(beam_size);
+    for (unsigned j = 0; j < beam.size(); ++j) {
+      Eigen::VectorXf dist = dists[0][j];
+      for (unsigned i = 1; i < num_models; ++i) {
+        dist += dists[i][j];
+      }
+      if (num_models > 1) {
+        dist /= num_models;
+        LogSoftmaxInPlace(dist); // Renormalize
+      }
+
+      // Take the K best-looking words, skipping any the class beam pruned
+      KBestList<WordId> best_words(beam_size);
+      for (unsigned w = 0; w < dist.size(); ++w) {
+        if (dist(w) != -numeric_limits<float>::infinity()) {
+          best_words.add(dist(w), w);
+        }
+      }
+
+      for (pair<double, WordId> p : best_words.hypothesis_list()) {
+        double new_score = beam_scores[j] + p.first;
+        WordId word = p.second;
+        if (t == max_length || word == kEOS) {
+          vector<WordId> words = beam[j].words;
+          words.push_back(word);
+          completed_hyps.add(new_score, words);
+        }
+        else {
+          new_hyps.add(new_score, make_pair(j, word));
+        }
+      }
+    }
+
+    // The new hypotheses' model states are only advanced in the next step, on the workers
+    vector<EnsembleHypothesis> new_beam;
+    vector<double> new_beam_scores;
+    for (auto& scored_hyp : new_hyps.hypothesis_list()) {
+      const EnsembleHypothesis& parent = beam[scored_hyp.second.first];
+      EnsembleHypothesis hyp = parent;
+      hyp.words.push_back(scored_hyp.second.second);
+      new_beam.push_back(hyp);
+      new_beam_scores.push_back(scored_hyp.first);
+    }
+    beam = new_beam;
+    beam_scores = new_beam_scores;
+  }
+  return completed_hyps;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+#include "inference.h"
+#include "kbestlist.h"
+#include "threadpool.h"
+
+using namespace std;
+
+struct EnsembleHypothesis {
+  vector<WordId> words;
+  vector<InferenceState> states; // One per model in the ensemble
+};
+
+// Beam search over an ensemble of InferenceModels. If parallel is set, every
+// model runs on its own worker thread, and each time step ends with a barrier
+// after which the models' log distributions are averaged and the beam is
+// extended. Otherwise everything runs on the calling thread, so that several
+// InferenceDecoders can share the same models from different threads.
+class InferenceDecoder {
+public:
+  explicit InferenceDecoder(const vector<InferenceModel*>& models, bool parallel = true);
+  InferenceDecoder(const InferenceDecoder&) = delete;
+  ~InferenceDecoder();
+  void SetParams(unsigned max_length, WordId kSOS, WordId kEOS);
+
+  KBestList<vector<WordId>> TranslateKBest(const vector<WordId>& source, unsigned K, unsigned beam_size);
+
+private:
+  void RunJobs(const vector<function<void()>>& jobs);
+
+  vector<InferenceModel*> models;
+  ThreadPool* pool;
+  unsigned max_length;
+  WordId kSOS;
+  WordId kEOS;
+};
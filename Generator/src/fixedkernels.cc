@@ -0,0 +1,33 @@
+#include "fixedkernels.h"
+
+// The default EncoderDecoderModel sizes: 32 dimensional embeddings, a 128
+// dimensional LSTM in each encoder direction, a 256 dimensional output LSTM
+// that sees the embedding and, with feed, its initial 256 dimensional hidden
+// state as well, and a 64 dimensional hidden layer in the final MLP.
+LSTMCellKernel FindLSTMCellKernel(unsigned input_dim, unsigned hidden_dim) {
+  struct Entry {
+    unsigned input_dim;
+    unsigned hidden_dim;
+    LSTMCellKernel kernel;
+  };
+  static const Entry kernels[] = {
+    {32, 128, FixedLSTMCell<32, 128>},
+    {128, 128, FixedLSTMCell<128, 128>},
+    {32, 256, FixedLSTMCell<32, 256>},
+    {32 + 256, 256, FixedLSTMCell<32 + 256, 256>},
+    {256, 256, FixedLSTMCell<256, 256>},
+  };
+  for (const Entry& entry : kernels) {
+    if (entry.input_dim == input_dim && entry.hidden_dim == hidden_dim) {
+      return entry.kernel;
+    }
+  }
+  return nullptr;
+}
+
+MLPKernel FindMLPKernel(unsigned input_dim, unsigned hidden_dim) {
+  if (input_dim == 256 && hidden_dim == 64) {
+    return FixedMLP<256, 64>;
+  }
+  return nullptr;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <Eigen/Eigen>
+
+// Kernels for single-hypothesis decoding steps, specialized at compile time
+// for the layer sizes models are usually trained with. The generic path works
+// on dynamically sized vectors, so every gate of every step allocates its
+// temporaries on the heap and every product checks its shapes at run time.
+// Here the shapes are template parameters: the weights are mapped as
+// fixed-size aligned matrices, which lets Eigen choose fully sized,
+// vectorized loops, and all temporaries live on the stack.
+//
+// All matrices are column-major, as Eigen stores them, and must satisfy
+// Eigen's own alignment, which every heap-allocated Eigen matrix does.
+
+// The weights of one LSTM layer, laid out as in InferenceLSTM::Layer
+struct LSTMLayerWeights {
+  const float *x2i, *h2i, *c2i, *x2o, *h2o, *c2o, *x2c, *h2c;
+  const float *bi, *bo, *bc;
+};
+
+// Advances one LSTM layer by one step, updating c and h in place
+typedef void (*LSTMCellKernel)(const LSTMLayerWeights& w, const float* x, float* c, float* h);
+
+// Computes hidden = tanh(b1 + W1 x) and out = b2 + W2 hidden, where W2 has output_dim rows
+typedef void (*MLPKernel)(const float* w1, const float* b1, const float* w2, const float* b2, unsigned output_dim,
+    const float* x, float* hidden, float* out);
+
+// The same equations as InferenceLSTM::AddInput
+template<int Input, int Hidden>
+void FixedLSTMCell(const LSTMLayerWeights& w, const float* x, float* c, float* h) {
+  typedef Eigen::Map<const Eigen::Matrix<float, Hidden, Input>, Eigen::Aligned> InputWeights;
+  typedef Eigen::Map<const Eigen::Matrix<float, Hidden, Hidden>, Eigen::Aligned> HiddenWeights;
+  typedef Eigen::Matrix<float, Hidden, 1> HiddenVector;
+  Eigen::Map<const Eigen::Matrix<float, Input, 1>> input(x);
+  Eigen::Map<HiddenVector> cell(c);
+  Eigen::Map<HiddenVector> hidden(h);
+
+  HiddenVector input_gate = Eigen::Map<const HiddenVector>(w.bi);
+  input_gate.noalias() += InputWeights(w.x2i) * input;
+  input_gate.noalias() += HiddenWeights(w.h2i) * hidden;
+  input_gate.noalias() += HiddenWeights(w.c2i) * cell;
+  HiddenVector write = Eigen::Map<const HiddenVector>(w.bc);
+  write.noalias() += InputWeights(w.x2c) * input;
+  write.noalias() += HiddenWeights(w.h2c) * hidden;
+
+  Eigen::Array<float, Hidden, 1> i = (1.0f + (-input_gate.array()).exp()).inverse();
+  cell = (i * write.array().tanh() + (1.0f - i) * cell.array()).matrix();
+
+  // The output gate looks at the new memory cell, but the old hidden state
+  HiddenVector output_gate = Eigen::Map<const HiddenVector>(w.bo);
+  output_gate.noalias() += InputWeights(w.x2o) * input;
+  output_gate.noalias() += HiddenWeights(w.h2o) * hidden;
+  output_gate.noalias() += HiddenWeights(w.c2o) * cell;
+  hidden = ((1.0f + (-output_gate.array()).exp()).inverse() * cell.array().tanh()).matrix();
+}
+
+template<int Input, int Hidden>
+void FixedMLP(const float* w1, const float* b1, const float* w2, const float* b2, unsigned output_dim,
+    const float* x, float* hidden, float* out) {
+  typedef Eigen::Matrix<float, Hidden, 1> HiddenVector;
+  Eigen::Map<HiddenVector> h(hidden);
+  h = Eigen::Map<const HiddenVector>(b1);
+  h.noalias() += Eigen::Map<const Eigen::Matrix<float, Hidden, Input>, Eigen::Aligned>(w1) * Eigen::Map<const Eigen::Matrix<float, Input, 1>>(x);
+  h = h.array().tanh().matrix();
+
+  // The output layer is as tall as the vocabulary, so only its width is fixed
+  Eigen::Map<Eigen::VectorXf> o(out, output_dim);
+  o = Eigen::Map<const Eigen::VectorXf>(b2, output_dim);
+  o.noalias() += Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Hidden>, Eigen::Aligned>(w2, output_dim, Hidden) * h;
+}
+
+// Returns the specialized kernel for these sizes, or nullptr if there is none
+LSTMCellKernel FindLSTMCellKernel(unsigned input_dim, unsigned hidden_dim);
+MLPKernel FindMLPKernel(unsigned input_dim, unsigned hidden_dim);
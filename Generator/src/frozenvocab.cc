@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include "frozenvocab.h"
+
+namespace {
+
+// FNV-1a, followed by a final mix so that nearby seeds give unrelated hashes
+uint64_t HashString(StringPiece word, uint64_t seed) {
+  uint64_t h = 14695981039346656037ULL ^ seed;
+  for (char c : word) {
+    h ^= (unsigned char)c;
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Average number of words per bucket. Larger values make the table smaller but slower to build.
+const unsigned kBucketSize = 4;
+// How many values of d0 (see Slot) to try for a bucket before starting over with a new seed
+const unsigned kMaxD0 = 64;
+
+} // namespace
+
+FrozenVocab::HashPair FrozenVocab::Hash(StringPiece word) const {
+  HashPair h;
+  h.bucket = HashString(word, 3 * seed) % num_buckets;
+  h.f1 = HashString(word, 3 * seed + 1) % num_words;
+  h.f2 = HashString(word, 3 * seed + 2) % num_words;
+  return h;
+}
+
+// The displacement packs two numbers, d0 and d1, and the slot is f1 + d0 * f2 + d1
+unsigned FrozenVocab::Slot(const HashPair& h, uint32_t displacement) const {
+  const uint64_t n = num_words;
+  const uint64_t d0 = displacement / n;
+  const uint64_t d1 = displacement % n;
+  return (h.f1 + d0 * h.f2 + d1) % n;
+}
+
+FrozenVocab::FrozenVocab() : num_words(0), num_buckets(0), strings(nullptr), offsets(nullptr), displacements(nullptr), slot_ids(nullptr), seed(0), unk_id(-1) {}
+
+FrozenVocab::FrozenVocab(const Dict& dict, const string& unk_word) {
+  const unsigned n = dict.size();
+  assert (n > 0);
+  offset_storage.push_back(0);
+  for (unsigned i = 0; i < n; ++i) {
+    const string& word = dict.Convert(i);
+    string_storage.insert(string_storage.end(), word.begin(), word.end());
+    offset_storage.push_back(string_storage.size());
+  }
+
+  num_words = n;
+  num_buckets = (n + kBucketSize - 1) / kBucketSize;
+  displacement_storage.resize(num_buckets);
+  slot_id_storage.resize(n);
+  UseStorage();
+  // Two words can collide under every displacement, in which case we rehash
+  for (seed = 0; !PlaceWords(); ++seed) {}
+
+  unk_id = -1;
+  unk_id = Convert(StringPiece(unk_word));
+  assert (unk_id != -1);
+}
+
+void FrozenVocab::UseStorage() {
+  strings = string_storage.data();
+  offsets = offset_storage.data();
+  displacements = displacement_storage.data();
+  slot_ids = slot_id_storage.data();
+}
+
+// Tries to find a displacement for every bucket under the current seed
+bool FrozenVocab::PlaceWords() {
+  const unsigned n = num_words;
+  fill(displacement_storage.begin(), displacement_storage.end(), 0);
+  fill(slot_id_storage.begin(), slot_id_storage.end(), -1);
+  vector<HashPair> hashes(n);
+  vector<vector<WordId>> buckets(num_buckets);
+  for (unsigned i = 0; i < n; ++i) {
+    hashes[i] = Hash(Convert((WordId)i));
+    buckets[hashes[i].bucket].push_back(i);
+  }
+
+  // Place the biggest buckets first, while the table is still mostly empty.
+  // Each bucket gets the first displacement that sends all its words to free slots.
+  vector<unsigned> order(buckets.size());
+  for (unsigned b = 0; b < buckets.size(); ++b) {
+    order[b] = b;
+  }
+  stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) { return buckets[a].size() > buckets[b].size(); });
+  // Computed in 64 bits, since kMaxD0 * n overflows 32 bits for large vocabularies.
+  // Displacements are stored in 32 bits, so that is the most that can be tried.
+  const uint64_t max_displacement = min<uint64_t>(kMaxD0 * (uint64_t)n, numeric_limits<uint32_t>::max());
+  vector<unsigned> slots;
+  for (unsigned b : order) {
+    if (buckets[b].empty()) {
+      break;
+    }
+    bool placed = false;
+    for (uint32_t displacement = 0; displacement < max_displacement && !placed; ++displacement) {
+      slots.clear();
+      placed = true;
+      for (WordId id : buckets[b]) {
+        unsigned slot = Slot(hashes[id], displacement);
+        if (slot_id_storage[slot] != -1 || find(slots.begin(), slots.end(), slot) != slots.end()) {
+          placed = false;
+          break;
+        }
+        slots.push_back(slot);
+      }
+      if (placed) {
+        for (unsigned i = 0; i < slots.size(); ++i) {
+          slot_id_storage[slots[i]] = buckets[b][i];
+        }
+        displacement_storage[b] = displacement;
+      }
+    }
+    if (!placed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+WordId FrozenVocab::Convert(StringPiece word) const {
+  HashPair h = Hash(word);
+  WordId id = slot_ids[Slot(h, displacements[h.bucket])];
+  return (Convert(id) == word) ? id : unk_id;
+}
+
+namespace {
+
+// Copies an array out of the file, unless it is to be used in place
+template <typename T>
+const T* ReadTable(ModelReader& in, uint64_t count, vector<T>& storage) {
+  const T* table = reinterpret_cast<const T*>(in.ReadArray(count * sizeof(T)));
+  if (table != nullptr && !in.share()) {
+    storage.assign(table, table + count);
+    table = storage.data();
+  }
+  return table;
+}
+
+} // namespace
+
+void FrozenVocab::Write(ostream& out) const {
+  uint64_t header[5] = {num_words, num_buckets, offsets[num_words], seed, (uint64_t)unk_id};
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  WriteArray(out, strings, offsets[num_words]);
+  WriteArray(out, offsets, (num_words + 1) * sizeof(uint64_t));
+  WriteArray(out, displacements, num_buckets * sizeof(uint32_t));
+  WriteArray(out, slot_ids, num_words * sizeof(WordId));
+}
+
+FrozenVocab* FrozenVocab::Read(ModelReader& in) {
+  uint64_t header[5];
+  if (!in.Read(header, sizeof(header))) {
+    return nullptr;
+  }
+  unique_ptr<FrozenVocab> vocab(new FrozenVocab());
+  vocab->num_words = header[0];
+  vocab->num_buckets = header[1];
+  const uint64_t string_bytes = header[2];
+  vocab->seed = header[3];
+  vocab->unk_id = (WordId)header[4];
+  if (vocab->num_words == 0 || vocab->num_words >= (1ULL << 31) || string_bytes >= (1ULL << 40) ||
+      vocab->num_buckets != (vocab->num_words + kBucketSize - 1) / kBucketSize || header[4] >= vocab->num_words) {
+    return nullptr;
+  }
+
+  vocab->strings = ReadTable(in, string_bytes, vocab->string_storage);
+  vocab->offsets = (vocab->strings == nullptr) ? nullptr : ReadTable(in, vocab->num_words + 1, vocab->offset_storage);
+  vocab->displacements = (vocab->offsets == nullptr) ? nullptr : ReadTable(in, vocab->num_buckets, vocab->displacement_storage);
+  vocab->slot_ids = (vocab->displacements == nullptr) ? nullptr : ReadTable(in, vocab->num_words, vocab->slot_id_storage);
+  if (vocab->slot_ids == nullptr || vocab->offsets[vocab->num_words] != string_bytes) {
+    return nullptr;
+  }
+  if (in.share()) {
+    vocab->file = in.file();
+  }
+  return vocab.release();
+}
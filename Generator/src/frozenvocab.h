@@ -0,0 +1,66 @@
+#pragma once
+#include <vector>
+#include <cassert>
+#include <string>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include "cnn/dict.h"
+#include "bitext.h"
+#include "quantize.h"
+#include "tokenizer.h"
+
+using namespace std;
+using namespace cnn;
+
+// A read-only vocabulary for decoding. Words are found with a minimal perfect
+// hash (hash and displace), and all strings are stored back to back in a single
+// buffer with an id -> offset table. Lookups neither allocate nor copy.
+class FrozenVocab {
+public:
+  // Words missing from the vocabulary are mapped to unk_word, which must be in dict
+  FrozenVocab(const Dict& dict, const string& unk_word);
+  FrozenVocab(const FrozenVocab&) = delete;
+  FrozenVocab& operator=(const FrozenVocab&) = delete;
+
+  unsigned size() const { return num_words; }
+  WordId Convert(StringPiece word) const;
+  StringPiece Convert(WordId id) const {
+    assert (id >= 0 && (unsigned)id < num_words);
+    return StringPiece(&strings[offsets[id]], offsets[id + 1] - offsets[id]);
+  }
+
+  // Writes the tables as aligned arrays, so that Read can use them in place
+  void Write(ostream& out) const;
+  // Returns nullptr if the file ends first. With in.share() set, the tables stay
+  // in the mapped file.
+  static FrozenVocab* Read(ModelReader& in);
+
+private:
+  struct HashPair {
+    uint64_t bucket;
+    uint64_t f1;
+    uint64_t f2;
+  };
+  FrozenVocab();
+  HashPair Hash(StringPiece word) const;
+  unsigned Slot(const HashPair& h, uint32_t displacement) const;
+  bool PlaceWords();
+  void UseStorage();
+
+  uint64_t num_words;
+  uint64_t num_buckets;
+  const char* strings; // Every word, in id order
+  const uint64_t* offsets; // Word i is strings[offsets[i], offsets[i + 1])
+  const uint32_t* displacements; // One per bucket
+  const WordId* slot_ids; // Which word hashes to each slot
+  uint64_t seed;
+  WordId unk_id;
+
+  // The tables point either into these or into a mapped file
+  vector<char> string_storage;
+  vector<uint64_t> offset_storage;
+  vector<uint32_t> displacement_storage;
+  vector<WordId> slot_id_storage;
+  shared_ptr<const MappedFile> file;
+};
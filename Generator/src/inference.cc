@@ -0,0 +1,835 @@
+#include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include "inference.h"
+#include "placement.h"
+
+// The order in which LSTMBuilder stores each layer's parameters
+enum { X2I, H2I, C2I, BI, X2O, H2O, C2O, BO, X2C, H2C, BC };
+
+const char kInferenceModelMagic[8] = {'G', 'E', 'N', 'I', 'N', 'F', 'R', '2'};
+// Files from before the vocabularies were stored as FrozenVocab tables, which
+// hold them as a length-prefixed boost text archive of both Dicts instead
+const char kTextVocabInferenceModelMagic[8] = {'G', 'E', 'N', 'I', 'N', 'F', 'R', '1'};
+
+static Eigen::MatrixXf ToMatrix(const Parameters* p) {
+  const Tensor& t = p->values;
+  return Eigen::Map<const Eigen::MatrixXf>(t.v, t.d.rows(), t.d.cols());
+}
+
+static Eigen::VectorXf ToVector(const Parameters* p) {
+  const Tensor& t = p->values;
+  return Eigen::Map<const Eigen::VectorXf>(t.v, t.d.rows());
+}
+
+static Eigen::MatrixXf ToMatrix(const LookupParameters* p) {
+  const unsigned dim = p->dim.rows();
+  Eigen::MatrixXf m(dim, p->values.size());
+  for (unsigned i = 0; i < p->values.size(); ++i) {
+    m.col(i) = Eigen::Map<const Eigen::VectorXf>(p->values[i].v, dim);
+  }
+  return m;
+}
+
+static Eigen::MatrixXf Logistic(const Eigen::MatrixXf& x) {
+  return (1.0f + (-x.array()).exp()).inverse().matrix();
+}
+
+bool IsInferenceModelFile(const string& filename) {
+  ifstream f(filename, ios::binary);
+  char magic[sizeof(kInferenceModelMagic)];
+  return f.read(magic, sizeof(magic)) && (memcmp(magic, kInferenceModelMagic, sizeof(magic)) == 0 ||
+      memcmp(magic, kTextVocabInferenceModelMagic, sizeof(magic)) == 0);
+}
+
+bool WriteInferenceModelFile(const string& filename, const FrozenVocab& source_vocab, const FrozenVocab& target_vocab, const InferenceModel& model) {
+  ofstream f(filename, ios::binary);
+  if (!f.is_open()) {
+    return false;
+  }
+  f.write(kInferenceModelMagic, sizeof(kInferenceModelMagic));
+  source_vocab.Write(f);
+  target_vocab.Write(f);
+  model.Write(f);
+  return (bool)f;
+}
+
+namespace {
+
+bool ReadTextVocabs(ModelReader& in, FrozenVocab*& source_vocab, FrozenVocab*& target_vocab) {
+  uint64_t vocab_length;
+  if (!in.Read(&vocab_length, sizeof(vocab_length)) || vocab_length >= (1ULL << 32)) {
+    return false;
+  }
+  string vocab(vocab_length, '\0');
+  if (!in.Read(&vocab[0], vocab_length)) {
+    return false;
+  }
+
+  Dict source_dict;
+  Dict target_dict;
+  istringstream vocab_stream(vocab);
+  boost::archive::text_iarchive ia(vocab_stream);
+  ia & source_dict;
+  ia & target_dict;
+  source_vocab = new FrozenVocab(source_dict, "UNK");
+  target_vocab = new FrozenVocab(target_dict, "UNK");
+  return true;
+}
+
+} // namespace
+
+tuple<FrozenVocab*, FrozenVocab*, InferenceModel*> ReadInferenceModelFile(const string& filename, bool share) {
+  shared_ptr<const MappedFile> file = make_shared<MappedFile>(filename);
+  if (!file->is_open()) {
+    return make_tuple(nullptr, nullptr, nullptr);
+  }
+  ModelReader in(file, share);
+  char magic[sizeof(kInferenceModelMagic)];
+  if (!in.Read(magic, sizeof(magic))) {
+    return make_tuple(nullptr, nullptr, nullptr);
+  }
+
+  FrozenVocab* source_vocab = nullptr;
+  FrozenVocab* target_vocab = nullptr;
+  if (memcmp(magic, kInferenceModelMagic, sizeof(magic)) == 0) {
+    source_vocab = FrozenVocab::Read(in);
+    target_vocab = (source_vocab == nullptr) ? nullptr : FrozenVocab::Read(in);
+  }
+  else if (memcmp(magic, kTextVocabInferenceModelMagic, sizeof(magic)) == 0) {
+    ReadTextVocabs(in, source_vocab, target_vocab);
+  }
+
+  InferenceModel* model = (target_vocab == nullptr) ? nullptr : InferenceModel::Read(in);
+  if (model == nullptr) {
+    delete source_vocab;
+    delete target_vocab;
+    return make_tuple(nullptr, nullptr, nullptr);
+  }
+  return make_tuple(source_vocab, target_vocab, model);
+}
+
+void LogSoftmaxInPlace(Eigen::VectorXf& v) {
+  float m = v.maxCoeff();
+  float z = m + log((v.array() - m).exp().sum());
+  v.array() -= z;
+}
+
+void LogSoftmaxColumnsInPlace(Eigen::MatrixXf& m) {
+  Eigen::RowVectorXf max = m.colwise().maxCoeff();
+  m.rowwise() -= max;
+  Eigen::RowVectorXf z = m.array().exp().colwise().sum().log().matrix();
+  m.rowwise() -= z;
+}
+
+InferenceBatchState::InferenceBatchState(const vector<InferenceState>& states) {
+  assert (states.size() > 0);
+  const InferenceState& first = states[0];
+  c.resize(first.c.size());
+  h.resize(first.h.size());
+  for (unsigned i = 0; i < c.size(); ++i) {
+    c[i].resize(first.c[i].size(), states.size());
+    h[i].resize(first.h[i].size(), states.size());
+    for (unsigned j = 0; j < states.size(); ++j) {
+      c[i].col(j) = states[j].c[i];
+      h[i].col(j) = states[j].h[i];
+    }
+  }
+  feed.resize(first.feed.size(), states.size());
+  for (unsigned j = 0; j < states.size(); ++j) {
+    feed.col(j) = states[j].feed;
+  }
+}
+
+unsigned InferenceBatchState::size() const {
+  return h.size() > 0 ? h[0].cols() : 0;
+}
+
+InferenceState InferenceBatchState::Column(unsigned j) const {
+  InferenceState state;
+  for (const Eigen::MatrixXf& m : c) {
+    state.c.push_back(m.col(j));
+  }
+  for (const Eigen::MatrixXf& m : h) {
+    state.h.push_back(m.col(j));
+  }
+  if (feed.size() > 0) {
+    state.feed = feed.col(j);
+  }
+  return state;
+}
+
+InferenceLSTM::InferenceLSTM(const LSTMBuilder& builder) {
+  for (const vector<Parameters*>& p : builder.params) {
+    Layer layer;
+    layer.x2i = WeightMatrix(ToMatrix(p[X2I]));
+    layer.h2i = WeightMatrix(ToMatrix(p[H2I]));
+    layer.c2i = WeightMatrix(ToMatrix(p[C2I]));
+    layer.bi = ToVector(p[BI]);
+    layer.x2o = WeightMatrix(ToMatrix(p[X2O]));
+    layer.h2o = WeightMatrix(ToMatrix(p[H2O]));
+    layer.c2o = WeightMatrix(ToMatrix(p[C2O]));
+    layer.bo = ToVector(p[BO]);
+    layer.x2c = WeightMatrix(ToMatrix(p[X2C]));
+    layer.h2c = WeightMatrix(ToMatrix(p[H2C]));
+    layer.bc = ToVector(p[BC]);
+    layers.push_back(layer);
+  }
+  SelectKernels();
+}
+
+LSTMLayerWeights InferenceLSTM::Layer::weights() const {
+  return {x2i.dense_data(), h2i.dense_data(), c2i.dense_data(), x2o.dense_data(), h2o.dense_data(), c2o.dense_data(),
+      x2c.dense_data(), h2c.dense_data(), bi.data(), bo.data(), bc.data()};
+}
+
+void InferenceLSTM::SelectKernels() {
+  for (Layer& l : layers) {
+    l.kernel = l.x2i.quantized() ? nullptr : FindLSTMCellKernel(l.x2i.cols(), l.x2i.rows());
+  }
+}
+
+void InferenceLSTM::Quantize() {
+  for (Layer& l : layers) {
+    for (WeightMatrix* w : {&l.x2i, &l.h2i, &l.c2i, &l.x2o, &l.h2o, &l.c2o, &l.x2c, &l.h2c}) {
+      w->Quantize();
+    }
+  }
+  SelectKernels();
+}
+
+void InferenceLSTM::Write(ostream& out) const {
+  uint64_t count = layers.size();
+  out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  for (const Layer& l : layers) {
+    for (const WeightMatrix* w : {&l.x2i, &l.h2i, &l.c2i, &l.x2o, &l.h2o, &l.c2o, &l.x2c, &l.h2c}) {
+      w->Write(out);
+    }
+    for (const Eigen::VectorXf* b : {&l.bi, &l.bo, &l.bc}) {
+      WriteEigen(out, *b);
+    }
+  }
+}
+
+bool InferenceLSTM::Read(ModelReader& in) {
+  uint64_t count;
+  if (!in.Read(&count, sizeof(count)) || count > 64) {
+    return false;
+  }
+  layers.resize(count);
+  for (Layer& l : layers) {
+    for (WeightMatrix* w : {&l.x2i, &l.h2i, &l.c2i, &l.x2o, &l.h2o, &l.c2o, &l.x2c, &l.h2c}) {
+      if (!w->Read(in)) {
+        return false;
+      }
+    }
+    for (Eigen::VectorXf* b : {&l.bi, &l.bo, &l.bc}) {
+      if (!ReadEigen(in, *b)) {
+        return false;
+      }
+    }
+  }
+  SelectKernels();
+  return true;
+}
+
+bool InferenceLSTM::ValidShapes(unsigned input_dim, unsigned& output_dim) const {
+  unsigned in = input_dim;
+  for (const Layer& l : layers) {
+    const unsigned h = l.h2i.rows();
+    for (const WeightMatrix* w : {&l.x2i, &l.x2o, &l.x2c}) {
+      if (w->rows() != h || w->cols() != in) {
+        return false;
+      }
+    }
+    for (const WeightMatrix* w : {&l.h2i, &l.c2i, &l.h2o, &l.c2o, &l.h2c}) {
+      if (w->rows() != h || w->cols() != h) {
+        return false;
+      }
+    }
+    for (const Eigen::VectorXf* b : {&l.bi, &l.bo, &l.bc}) {
+      if (b->size() != h) {
+        return false;
+      }
+    }
+    in = h;
+  }
+  output_dim = in;
+  return true;
+}
+
+const Eigen::VectorXf& InferenceLSTM::AddInput(const Eigen::VectorXf& x, vector<Eigen::VectorXf>& c, vector<Eigen::VectorXf>& h) const {
+  assert (c.size() == layers.size() && h.size() == layers.size());
+  Eigen::VectorXf in = x;
+  for (unsigned i = 0; i < layers.size(); ++i) {
+    const Layer& l = layers[i];
+    if (l.kernel != nullptr) {
+      l.kernel(l.weights(), in.data(), c[i].data(), h[i].data());
+      in = h[i];
+      continue;
+    }
+    Eigen::VectorXf input_gate = Logistic(l.bi + l.x2i * in + l.h2i * h[i] + l.c2i * c[i]);
+    Eigen::VectorXf write = (l.bc + l.x2c * in + l.h2c * h[i]).array().tanh().matrix();
+    c[i] = (input_gate.array() * write.array() + (1.0f - input_gate.array()) * c[i].array()).matrix();
+    Eigen::VectorXf output_gate = Logistic(l.bo + l.x2o * in + l.h2o * h[i] + l.c2o * c[i]);
+    h[i] = (output_gate.array() * c[i].array().tanh()).matrix();
+    in = h[i];
+  }
+  return h.back();
+}
+
+void InferenceLSTM::AddInput(const Eigen::MatrixXf& x, vector<Eigen::MatrixXf>& c, vector<Eigen::MatrixXf>& h) const {
+  assert (c.size() == layers.size() && h.size() == layers.size());
+  Eigen::MatrixXf in = x;
+  for (unsigned i = 0; i < layers.size(); ++i) {
+    const Layer& l = layers[i];
+    Eigen::MatrixXf input_gate = Logistic((l.x2i * in + l.h2i * h[i] + l.c2i * c[i]).colwise() + l.bi);
+    Eigen::MatrixXf write = ((l.x2c * in + l.h2c * h[i]).colwise() + l.bc).array().tanh().matrix();
+    c[i] = (input_gate.array() * write.array() + (1.0f - input_gate.array()) * c[i].array()).matrix();
+    Eigen::MatrixXf output_gate = Logistic((l.x2o * in + l.h2o * h[i] + l.c2o * c[i]).colwise() + l.bo);
+    h[i] = (output_gate.array() * c[i].array().tanh()).matrix();
+    in = h[i];
+  }
+}
+
+InferenceModel::InferenceModel(const EncoderDecoderModel& model) :
+    forward_lstm(model.forward_builder), reverse_lstm(model.reverse_builder), output_lstm(model.output_builder), mlp_kernel(nullptr),
+    feed(model.feed), class_factored(model.class_factored), word_classes(model.word_classes), lstm_layer_count(model.lstm_layer_count), output_hidden_dim(model.output_hidden_dim), class_beam(0), encoder_cache_(nullptr) {
+  // Initial states are laid out as in LSTMBuilder::start_new_sequence: all the
+  // memory cells first, then all the hidden states.
+  for (unsigned i = 0; i < lstm_layer_count; ++i) {
+    forward_init_c.push_back(ToVector(model.forward_initp[i]));
+    forward_init_h.push_back(ToVector(model.forward_initp[i + lstm_layer_count]));
+    reverse_init_c.push_back(ToVector(model.reverse_initp[i]));
+    reverse_init_h.push_back(ToVector(model.reverse_initp[i + lstm_layer_count]));
+  }
+
+  mW = WeightMatrix(ToMatrix(model.p_mW));
+  mb = ToVector(model.p_mb);
+  Es = EmbeddingTable(ToMatrix(model.p_Es));
+  Et = EmbeddingTable(ToMatrix(model.p_Et));
+  fIH = WeightMatrix(ToMatrix(model.p_fIH));
+  fHb = ToVector(model.p_fHb);
+  fHO = WeightMatrix(ToMatrix(model.p_fHO));
+  fOb = ToVector(model.p_fOb);
+  for (unsigned c = 0; c < model.p_wHO.size(); ++c) {
+    wHO.push_back(WeightMatrix(ToMatrix(model.p_wHO[c])));
+    wOb.push_back(ToVector(model.p_wOb[c]));
+  }
+  SelectKernels();
+}
+
+InferenceModel::InferenceModel() : mlp_kernel(nullptr), feed(false), class_factored(false), lstm_layer_count(0), output_hidden_dim(0), class_beam(0), encoder_cache_(nullptr) {}
+
+InferenceModel::~InferenceModel() {
+  delete encoder_cache_;
+}
+
+void InferenceModel::Write(ostream& out) const {
+  uint32_t header[4] = {feed, class_factored, lstm_layer_count, output_hidden_dim};
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  forward_lstm.Write(out);
+  reverse_lstm.Write(out);
+  output_lstm.Write(out);
+  WriteEigenList(out, forward_init_c);
+  WriteEigenList(out, forward_init_h);
+  WriteEigenList(out, reverse_init_c);
+  WriteEigenList(out, reverse_init_h);
+  mW.Write(out);
+  WriteEigen(out, mb);
+  Es.Write(out);
+  Et.Write(out);
+  fIH.Write(out);
+  WriteEigen(out, fHb);
+  fHO.Write(out);
+  WriteEigen(out, fOb);
+  uint64_t num_classes = wHO.size();
+  out.write(reinterpret_cast<const char*>(&num_classes), sizeof(num_classes));
+  for (const WeightMatrix& w : wHO) {
+    w.Write(out);
+  }
+  WriteEigenList(out, wOb);
+
+  ostringstream classes_stream;
+  {
+    boost::archive::text_oarchive oa(classes_stream);
+    oa & word_classes;
+  }
+  const string classes = classes_stream.str();
+  uint64_t classes_length = classes.size();
+  out.write(reinterpret_cast<const char*>(&classes_length), sizeof(classes_length));
+  out.write(classes.data(), classes_length);
+}
+
+InferenceModel* InferenceModel::Read(ModelReader& in) {
+  InferenceModel* model = new InferenceModel();
+  uint32_t header[4];
+  bool ok = in.Read(header, sizeof(header));
+  if (ok) {
+    model->feed = header[0];
+    model->class_factored = header[1];
+    model->lstm_layer_count = header[2];
+    model->output_hidden_dim = header[3];
+  }
+  ok = ok && model->forward_lstm.Read(in) && model->reverse_lstm.Read(in) && model->output_lstm.Read(in);
+  ok = ok && ReadEigenList(in, model->forward_init_c) && ReadEigenList(in, model->forward_init_h);
+  ok = ok && ReadEigenList(in, model->reverse_init_c) && ReadEigenList(in, model->reverse_init_h);
+  ok = ok && model->mW.Read(in) && ReadEigen(in, model->mb) && model->Es.Read(in) && model->Et.Read(in);
+  ok = ok && model->fIH.Read(in) && ReadEigen(in, model->fHb) && model->fHO.Read(in) && ReadEigen(in, model->fOb);
+
+  uint64_t num_classes = 0;
+  ok = ok && in.Read(&num_classes, sizeof(num_classes)) && num_classes < (1 << 20);
+  if (ok) {
+    model->wHO.resize(num_classes);
+  }
+  for (unsigned c = 0; ok && c < num_classes; ++c) {
+    ok = model->wHO[c].Read(in);
+  }
+  ok = ok && ReadEigenList(in, model->wOb) && model->wOb.size() == num_classes;
+
+  uint64_t classes_length = 0;
+  ok = ok && in.Read(&classes_length, sizeof(classes_length)) && classes_length < (1ULL << 32);
+  if (ok) {
+    string classes(classes_length, '\0');
+    ok = in.Read(&classes[0], classes_length);
+    if (ok) {
+      istringstream classes_stream(classes);
+      boost::archive::text_iarchive ia(classes_stream);
+      ia & model->word_classes;
+    }
+  }
+
+  if (!ok || !model->ValidShapes()) {
+    delete model;
+    return nullptr;
+  }
+  model->SelectKernels();
+  return model;
+}
+
+// Everything the encoder and decoder index with sizes from the header or from
+// other matrices, so that a corrupt file is rejected here instead of being read
+// out of bounds while decoding.
+bool InferenceModel::ValidShapes() const {
+  const unsigned layer_count = lstm_layer_count;
+  if (layer_count == 0 || output_hidden_dim == 0) {
+    return false;
+  }
+  for (const InferenceLSTM* lstm : {&forward_lstm, &reverse_lstm, &output_lstm}) {
+    if (lstm->layers.size() != layer_count) {
+      return false;
+    }
+  }
+
+  unsigned forward_dim, reverse_dim, output_dim;
+  const unsigned output_input_dim = Et.rows() + (feed ? output_hidden_dim : 0);
+  if (!forward_lstm.ValidShapes(Es.rows(), forward_dim) || !reverse_lstm.ValidShapes(Es.rows(), reverse_dim) ||
+      !output_lstm.ValidShapes(output_input_dim, output_dim)) {
+    return false;
+  }
+  // The initial output state is split into equal c and h slices per layer
+  for (const InferenceLSTM::Layer& l : output_lstm.layers) {
+    if (l.h2i.rows() != output_hidden_dim) {
+      return false;
+    }
+  }
+
+  const pair<const InferenceLSTM*, const vector<Eigen::VectorXf>*> init_states[] = {
+    {&forward_lstm, &forward_init_c}, {&forward_lstm, &forward_init_h},
+    {&reverse_lstm, &reverse_init_c}, {&reverse_lstm, &reverse_init_h}};
+  for (const auto& init : init_states) {
+    if (init.second->size() != layer_count) {
+      return false;
+    }
+    for (unsigned i = 0; i < layer_count; ++i) {
+      if ((*init.second)[i].size() != init.first->layers[i].h2i.rows()) {
+        return false;
+      }
+    }
+  }
+
+  if (mW.rows() != 2 * layer_count * output_hidden_dim || mW.cols() != forward_dim + reverse_dim || mb.size() != mW.rows()) {
+    return false;
+  }
+  if (fIH.cols() != output_hidden_dim || fHb.size() != fIH.rows() || fHO.cols() != fIH.rows() || fOb.size() != fHO.rows()) {
+    return false;
+  }
+
+  if (!class_factored) {
+    return fHO.rows() == Et.cols() && wHO.empty();
+  }
+  const unsigned num_classes = word_classes.num_classes();
+  if (fHO.rows() != num_classes || wHO.size() != num_classes || word_classes.vocab_size() != Et.cols()) {
+    return false;
+  }
+  for (unsigned c = 0; c < num_classes; ++c) {
+    const vector<WordId>& members = word_classes.class_words[c];
+    if (wHO[c].rows() != members.size() || wHO[c].cols() != fIH.rows() || wOb[c].size() != members.size()) {
+      return false;
+    }
+    for (WordId word : members) {
+      if (word < 0 || (unsigned)word >= Et.cols()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void InferenceModel::Quantize() {
+  forward_lstm.Quantize();
+  reverse_lstm.Quantize();
+  output_lstm.Quantize();
+  mW.Quantize();
+  Es.Quantize();
+  Et.Quantize();
+  fIH.Quantize();
+  fHO.Quantize();
+  for (WeightMatrix& w : wHO) {
+    w.Quantize();
+  }
+  SelectKernels();
+}
+
+void InferenceModel::SelectKernels() {
+  mlp_kernel = nullptr;
+  if (!fIH.quantized() && !fHO.quantized() && fHO.cols() == fIH.rows()) {
+    mlp_kernel = FindMLPKernel(fIH.cols(), fIH.rows());
+  }
+}
+
+bool InferenceModel::quantized() const {
+  return fHO.quantized();
+}
+
+void InferenceModel::EnableEncoderCache(unsigned capacity) {
+  delete encoder_cache_;
+  encoder_cache_ = new LRUCache<vector<WordId>, InferenceState, WordIdSequenceHash>(capacity);
+}
+
+const LRUCache<vector<WordId>, InferenceState, WordIdSequenceHash>* InferenceModel::encoder_cache() const {
+  return encoder_cache_;
+}
+
+bool InferenceModel::InterleaveWeights() {
+  // Weights in a mapped file belong to the page cache, which every process shares
+  bool interleaved = !Es.mapped() && InterleaveMemory(Es.data(), Es.bytes());
+  interleaved = (!Et.mapped() && InterleaveMemory(Et.data(), Et.bytes())) || interleaved;
+  interleaved = (!fHO.mapped() && InterleaveMemory(fHO.data(), fHO.bytes())) || interleaved;
+  for (const WeightMatrix& w : wHO) {
+    interleaved = (!w.mapped() && InterleaveMemory(w.data(), w.bytes())) || interleaved;
+  }
+  return interleaved;
+}
+
+unsigned InferenceModel::target_vocab_size() const {
+  return Et.cols();
+}
+
+Eigen::VectorXf InferenceModel::Embed(const EmbeddingTable& embeddings, WordId word) const {
+  return embeddings.Column(word);
+}
+
+InferenceState InferenceModel::Encode(const vector<WordId>& source) const {
+  if (encoder_cache_ == nullptr) {
+    return EncodeUncached(source);
+  }
+
+  InferenceState state;
+  if (!encoder_cache_->Get(source, state)) {
+    state = EncodeUncached(source);
+    encoder_cache_->Put(source, state);
+  }
+  return state;
+}
+
+InferenceState InferenceModel::EncodeUncached(const vector<WordId>& source) const {
+  assert (source.size() > 0);
+  vector<Eigen::VectorXf> c = forward_init_c;
+  vector<Eigen::VectorXf> h = forward_init_h;
+  for (unsigned t = 0; t < source.size(); ++t) {
+    forward_lstm.AddInput(Embed(Es, source[t]), c, h);
+  }
+  Eigen::VectorXf forward_encoding = h.back();
+
+  c = reverse_init_c;
+  h = reverse_init_h;
+  for (unsigned t = source.size(); t > 0; ) {
+    t--;
+    reverse_lstm.AddInput(Embed(Es, source[t]), c, h);
+  }
+  Eigen::VectorXf reverse_encoding = h.back();
+
+  Eigen::VectorXf encoding(forward_encoding.size() + reverse_encoding.size());
+  encoding << forward_encoding, reverse_encoding;
+  Eigen::VectorXf output_init_all = (mb + mW * encoding).array().tanh().matrix();
+
+  InferenceState state;
+  for (unsigned i = 0; i < lstm_layer_count; ++i) {
+    state.c.push_back(output_init_all.segment(i * output_hidden_dim, output_hidden_dim));
+  }
+  for (unsigned i = 0; i < lstm_layer_count; ++i) {
+    state.h.push_back(output_init_all.segment((lstm_layer_count + i) * output_hidden_dim, output_hidden_dim));
+  }
+  // EncoderDecoderModel::AddOutputWord feeds output_builder.h0.back(), the
+  // top layer's initial hidden state, at every step.
+  if (feed) {
+    state.feed = state.h.back();
+  }
+  return state;
+}
+
+InferenceState InferenceModel::AddOutputWord(const InferenceState& state, WordId word) const {
+  InferenceState new_state = state;
+  Eigen::VectorXf input;
+  if (feed) {
+    input.resize(Et.rows() + new_state.feed.size());
+    input << Embed(Et, word), new_state.feed;
+  }
+  else {
+    input = Embed(Et, word);
+  }
+  output_lstm.AddInput(input, new_state.c, new_state.h);
+  return new_state;
+}
+
+void InferenceModel::ComputeLogDistribution(const InferenceState& state, Eigen::VectorXf& log_dist) const {
+  // For class-factored models, the output of fHO is the distribution over classes
+  Eigen::VectorXf hidden, output;
+  if (mlp_kernel != nullptr) {
+    hidden.resize(fIH.rows());
+    output.resize(fHO.rows());
+    mlp_kernel(fIH.dense_data(), fHb.data(), fHO.dense_data(), fOb.data(), fHO.rows(), state.h.back().data(), hidden.data(), output.data());
+  }
+  else {
+    hidden = (fHb + fIH * state.h.back()).array().tanh().matrix();
+    output = fOb + fHO * hidden;
+  }
+  LogSoftmaxInPlace(output);
+  if (!class_factored) {
+    log_dist.swap(output);
+    return;
+  }
+
+  const Eigen::VectorXf& class_log_dist = output;
+  vector<unsigned> classes;
+  SelectClasses(class_log_dist.data(), classes);
+  log_dist.setConstant(word_classes.vocab_size(), -numeric_limits<float>::infinity());
+  for (unsigned c : classes) {
+    Eigen::VectorXf word_log_dist = wOb[c] + wHO[c] * hidden;
+    LogSoftmaxInPlace(word_log_dist);
+    const vector<WordId>& members = word_classes.class_words[c];
+    for (unsigned j = 0; j < members.size(); ++j) {
+      log_dist(members[j]) = word_log_dist(j) + class_log_dist(c);
+    }
+  }
+}
+
+Eigen::MatrixXf InferenceModel::EncodeSortedBatch(const InferenceLSTM& lstm, const vector<Eigen::VectorXf>& init_c, const vector<Eigen::VectorXf>& init_h,
+    const vector<const vector<WordId>*>& sources, bool reverse) const {
+  const unsigned batch_size = sources.size();
+  const unsigned max_length = sources[0]->size();
+  vector<Eigen::MatrixXf> c(init_c.size()), h(init_h.size());
+  for (unsigned i = 0; i < init_c.size(); ++i) {
+    c[i] = init_c[i].replicate(1, batch_size);
+    h[i] = init_h[i].replicate(1, batch_size);
+  }
+
+  // Since the sentences are sorted by length, the ones that still have input
+  // left at step t always form a prefix of the batch.
+  unsigned active = batch_size;
+  for (unsigned t = 0; t < max_length; ++t) {
+    while (sources[active - 1]->size() <= t) {
+      active--;
+    }
+    Eigen::MatrixXf x(Es.rows(), active);
+    vector<Eigen::MatrixXf> active_c(c.size()), active_h(h.size());
+    for (unsigned j = 0; j < active; ++j) {
+      const vector<WordId>& source = *sources[j];
+      x.col(j) = Es.Column(reverse ? source[source.size() - 1 - t] : source[t]);
+    }
+    for (unsigned i = 0; i < c.size(); ++i) {
+      active_c[i] = c[i].leftCols(active);
+      active_h[i] = h[i].leftCols(active);
+    }
+    lstm.AddInput(x, active_c, active_h);
+    for (unsigned i = 0; i < c.size(); ++i) {
+      c[i].leftCols(active) = active_c[i];
+      h[i].leftCols(active) = active_h[i];
+    }
+  }
+  return h.back();
+}
+
+InferenceBatchState InferenceModel::InitialOutputState(const Eigen::MatrixXf& encodings) const {
+  Eigen::MatrixXf output_init_all = ((mW * encodings).colwise() + mb).array().tanh().matrix();
+  InferenceBatchState state;
+  for (unsigned i = 0; i < lstm_layer_count; ++i) {
+    state.c.push_back(output_init_all.middleRows(i * output_hidden_dim, output_hidden_dim));
+  }
+  for (unsigned i = 0; i < lstm_layer_count; ++i) {
+    state.h.push_back(output_init_all.middleRows((lstm_layer_count + i) * output_hidden_dim, output_hidden_dim));
+  }
+  if (feed) {
+    state.feed = state.h.back();
+  }
+  return state;
+}
+
+InferenceBatchState InferenceModel::EncodeBatch(const vector<vector<WordId>>& sources) const {
+  const unsigned batch_size = sources.size();
+  assert (batch_size > 0);
+  vector<const vector<WordId>*> source_pointers(batch_size);
+  for (unsigned j = 0; j < batch_size; ++j) {
+    source_pointers[j] = &sources[j];
+  }
+  if (encoder_cache_ == nullptr) {
+    return EncodeBatchUncached(source_pointers);
+  }
+
+  // Only the sentences missing from the cache are encoded, as one batch
+  vector<InferenceState> cached(batch_size);
+  vector<unsigned> misses;
+  vector<const vector<WordId>*> miss_sources;
+  for (unsigned j = 0; j < batch_size; ++j) {
+    if (!encoder_cache_->Get(sources[j], cached[j])) {
+      misses.push_back(j);
+      miss_sources.push_back(&sources[j]);
+    }
+  }
+  if (misses.size() == batch_size) {
+    InferenceBatchState state = EncodeBatchUncached(miss_sources);
+    for (unsigned j = 0; j < batch_size; ++j) {
+      encoder_cache_->Put(sources[j], state.Column(j));
+    }
+    return state;
+  }
+  if (misses.size() > 0) {
+    InferenceBatchState miss_state = EncodeBatchUncached(miss_sources);
+    for (unsigned k = 0; k < misses.size(); ++k) {
+      cached[misses[k]] = miss_state.Column(k);
+      encoder_cache_->Put(sources[misses[k]], cached[misses[k]]);
+    }
+  }
+  return InferenceBatchState(cached);
+}
+
+InferenceBatchState InferenceModel::EncodeBatchUncached(const vector<const vector<WordId>*>& sources) const {
+  const unsigned batch_size = sources.size();
+  vector<unsigned> order(batch_size);
+  for (unsigned j = 0; j < batch_size; ++j) {
+    assert (sources[j]->size() > 0);
+    order[j] = j;
+  }
+  stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) { return sources[a]->size() > sources[b]->size(); });
+  vector<const vector<WordId>*> sorted_sources(batch_size);
+  for (unsigned j = 0; j < batch_size; ++j) {
+    sorted_sources[j] = sources[order[j]];
+  }
+
+  Eigen::MatrixXf forward_encodings = EncodeSortedBatch(forward_lstm, forward_init_c, forward_init_h, sorted_sources, false);
+  Eigen::MatrixXf reverse_encodings = EncodeSortedBatch(reverse_lstm, reverse_init_c, reverse_init_h, sorted_sources, true);
+
+  // Undo the sort while stacking the two directions
+  Eigen::MatrixXf encodings(forward_encodings.rows() + reverse_encodings.rows(), batch_size);
+  for (unsigned j = 0; j < batch_size; ++j) {
+    encodings.col(order[j]) << forward_encodings.col(j), reverse_encodings.col(j);
+  }
+  return InitialOutputState(encodings);
+}
+
+InferenceBatchState InferenceModel::AddOutputWords(const InferenceBatchState& state, const vector<unsigned>& parents, const vector<WordId>& words) const {
+  assert (parents.size() == words.size());
+  const unsigned batch_size = parents.size();
+  InferenceBatchState new_state;
+  new_state.c.resize(state.c.size());
+  new_state.h.resize(state.h.size());
+  for (unsigned i = 0; i < state.c.size(); ++i) {
+    new_state.c[i].resize(state.c[i].rows(), batch_size);
+    new_state.h[i].resize(state.h[i].rows(), batch_size);
+    for (unsigned j = 0; j < batch_size; ++j) {
+      new_state.c[i].col(j) = state.c[i].col(parents[j]);
+      new_state.h[i].col(j) = state.h[i].col(parents[j]);
+    }
+  }
+
+  Eigen::MatrixXf input(Et.rows() + (feed ? state.feed.rows() : 0), batch_size);
+  if (feed) {
+    new_state.feed.resize(state.feed.rows(), batch_size);
+  }
+  for (unsigned j = 0; j < batch_size; ++j) {
+    input.col(j).head(Et.rows()) = Et.Column(words[j]);
+    if (feed) {
+      new_state.feed.col(j) = state.feed.col(parents[j]);
+      input.col(j).tail(state.feed.rows()) = new_state.feed.col(j);
+    }
+  }
+
+  output_lstm.AddInput(input, new_state.c, new_state.h);
+  return new_state;
+}
+
+void InferenceModel::ComputeLogDistributions(const InferenceBatchState& state, Eigen::MatrixXf& log_dists) const {
+  Eigen::MatrixXf hidden = ((fIH * state.h.back()).colwise() + fHb).array().tanh().matrix();
+  if (!class_factored) {
+    log_dists = (fHO * hidden).colwise() + fOb;
+    LogSoftmaxColumnsInPlace(log_dists);
+    return;
+  }
+
+  Eigen::MatrixXf class_log_dists = (fHO * hidden).colwise() + fOb;
+  LogSoftmaxColumnsInPlace(class_log_dists);
+
+  // Each class is scored for just the columns that selected it
+  vector<vector<unsigned>> class_columns(word_classes.num_classes());
+  vector<unsigned> classes;
+  for (unsigned k = 0; k < hidden.cols(); ++k) {
+    SelectClasses(class_log_dists.col(k).data(), classes);
+    for (unsigned c : classes) {
+      class_columns[c].push_back(k);
+    }
+  }
+
+  log_dists.setConstant(word_classes.vocab_size(), hidden.cols(), -numeric_limits<float>::infinity());
+  for (unsigned c = 0; c < word_classes.num_classes(); ++c) {
+    const vector<unsigned>& columns = class_columns[c];
+    if (columns.size() == 0) {
+      continue;
+    }
+    Eigen::MatrixXf class_hidden(hidden.rows(), columns.size());
+    for (unsigned k = 0; k < columns.size(); ++k) {
+      class_hidden.col(k) = hidden.col(columns[k]);
+    }
+    Eigen::MatrixXf word_log_dists = (wHO[c] * class_hidden).colwise() + wOb[c];
+    LogSoftmaxColumnsInPlace(word_log_dists);
+    const vector<WordId>& members = word_classes.class_words[c];
+    for (unsigned k = 0; k < columns.size(); ++k) {
+      for (unsigned j = 0; j < members.size(); ++j) {
+        log_dists(members[j], columns[k]) = word_log_dists(j, k) + class_log_dists(c, columns[k]);
+      }
+    }
+  }
+}
+
+void InferenceModel::SetClassBeam(unsigned class_beam) {
+  this->class_beam = class_beam;
+}
+
+void InferenceModel::SelectClasses(const float* class_log_dist, vector<unsigned>& classes) const {
+  const unsigned num_classes = word_classes.num_classes();
+  classes.resize(num_classes);
+  for (unsigned c = 0; c < num_classes; ++c) {
+    classes[c] = c;
+  }
+  if (class_beam > 0 && class_beam < num_classes) {
+    partial_sort(classes.begin(), classes.begin() + class_beam, classes.end(), [&](unsigned a, unsigned b) {
+      return class_log_dist[a] > class_log_dist[b];
+    });
+    classes.resize(class_beam);
+  }
+}
@@ -0,0 +1,176 @@
+#pragma once
+#include <vector>
+#include <Eigen/Eigen>
+#include "cnn/lstm.h"
+#include "bitext.h"
+#include "encdec.h"
+#include "wordclasses.h"
+#include "lrucache.h"
+#include "quantize.h"
+#include "fixedkernels.h"
+#include "frozenvocab.h"
+
+using namespace std;
+using namespace cnn;
+
+// Plain Eigen copies of the weights of one cnn LSTMBuilder, evaluated with
+// exactly the same (coupled input/forget gate, peephole) equations.
+struct InferenceLSTM {
+  struct Layer {
+    WeightMatrix x2i, h2i, c2i, x2o, h2o, c2o, x2c, h2c;
+    Eigen::VectorXf bi, bo, bc;
+    // Evaluates single steps of float layers with common sizes, if not null
+    LSTMCellKernel kernel = nullptr;
+
+    LSTMLayerWeights weights() const;
+  };
+  vector<Layer> layers;
+
+  InferenceLSTM() {}
+  explicit InferenceLSTM(const LSTMBuilder& builder);
+
+  // Quantizes the gate matrices to int8. The biases stay in float.
+  void Quantize();
+  void Write(ostream& out) const;
+  bool Read(ModelReader& in);
+  // Whether every layer's weights fit together and take input_dim sized
+  // inputs. Stores the top layer's hidden size in output_dim.
+  bool ValidShapes(unsigned input_dim, unsigned& output_dim) const;
+  // Picks each layer's specialized kernel, if its sizes have one
+  void SelectKernels();
+
+  // Feeds x through every layer, updating c and h (one vector per layer) in place.
+  // Returns the new output of the top layer.
+  const Eigen::VectorXf& AddInput(const Eigen::VectorXf& x, vector<Eigen::VectorXf>& c, vector<Eigen::VectorXf>& h) const;
+  // The same, for a batch of inputs stored as the columns of x
+  void AddInput(const Eigen::MatrixXf& x, vector<Eigen::MatrixXf>& c, vector<Eigen::MatrixXf>& h) const;
+};
+
+// The state of the output LSTM after some prefix of a translation
+struct InferenceState {
+  vector<Eigen::VectorXf> c; // Memory cells, one per layer
+  vector<Eigen::VectorXf> h; // Hidden states, one per layer
+  Eigen::VectorXf feed; // The vector fed back in alongside each word, if the model uses feed
+};
+
+// The output LSTM states of a batch of hypotheses, one column per hypothesis
+struct InferenceBatchState {
+  vector<Eigen::MatrixXf> c;
+  vector<Eigen::MatrixXf> h;
+  Eigen::MatrixXf feed;
+
+  InferenceBatchState() {}
+  // Stacks the states as columns, in order
+  explicit InferenceBatchState(const vector<InferenceState>& states);
+  unsigned size() const;
+  InferenceState Column(unsigned j) const;
+};
+
+// A read-only copy of a trained EncoderDecoderModel that runs without cnn.
+// cnn only allows a single ComputationGraph per process, so nothing built on
+// it can be evaluated from more than one thread. All of the methods here are
+// const and keep their state in the caller's InferenceState objects, so one
+// InferenceModel can be shared by any number of threads.
+class InferenceModel {
+public:
+  explicit InferenceModel(const EncoderDecoderModel& model);
+  InferenceModel(const InferenceModel&) = delete;
+  ~InferenceModel();
+
+  // Reads a model written by Write(). Returns nullptr if in does not hold one.
+  static InferenceModel* Read(ModelReader& in);
+  // Writes the weights in a binary format that needs neither cnn nor the original model file
+  void Write(ostream& out) const;
+
+  // Post-training quantization of the LSTM gate matrices, the final MLP, the
+  // encoder-to-decoder bridge and both embedding tables to int8 with per-row
+  // scales. Biases and initial states stay in float, and so does the log softmax.
+  // Call this before EnableEncoderCache(), whose entries it would not update.
+  void Quantize();
+  bool quantized() const;
+
+  // Remembers the results of up to capacity calls to Encode()
+  void EnableEncoderCache(unsigned capacity);
+  const LRUCache<vector<WordId>, InferenceState, WordIdSequenceHash>* encoder_cache() const;
+
+  InferenceState Encode(const vector<WordId>& source) const;
+  InferenceState AddOutputWord(const InferenceState& state, WordId word) const;
+  // For class-factored models, only score the words of this many of the most
+  // probable classes at each step, as Decoder::SetClassBeam does. The other
+  // words get a log probability of -infinity. 0 scores every word.
+  void SetClassBeam(unsigned class_beam);
+
+  // Fills log_dist with log p(w | state) for every word in the target vocabulary
+  void ComputeLogDistribution(const InferenceState& state, Eigen::VectorXf& log_dist) const;
+
+  // Batched versions of the above, which turn the per-hypothesis matrix-vector
+  // products into matrix-matrix products. Column j of the encoded batch state
+  // belongs to sources[j]. Like Encode, EncodeBatch uses the encoder cache.
+  InferenceBatchState EncodeBatch(const vector<vector<WordId>>& sources) const;
+  // Column j of the result is column parents[j] of state, advanced by words[j]
+  InferenceBatchState AddOutputWords(const InferenceBatchState& state, const vector<unsigned>& parents, const vector<WordId>& words) const;
+  // Column j of log_dists is the log distribution over target words for column j of state
+  void ComputeLogDistributions(const InferenceBatchState& state, Eigen::MatrixXf& log_dists) const;
+
+  unsigned target_vocab_size() const;
+  // Spreads the embeddings and the output layer, which every decoding thread
+  // reads, evenly over the NUMA nodes. Weights mapped from a file are left
+  // alone. Returns false if nothing was moved, e.g. on single-node machines.
+  bool InterleaveWeights();
+
+private:
+  InferenceModel();
+  // Whether the weights read from a file agree with each other and the header
+  bool ValidShapes() const;
+  void SelectKernels();
+  Eigen::VectorXf Embed(const EmbeddingTable& embeddings, WordId word) const;
+  InferenceState EncodeUncached(const vector<WordId>& source) const;
+  InferenceBatchState EncodeBatchUncached(const vector<const vector<WordId>*>& sources) const;
+  // Runs one direction of the encoder over a batch of sentences sorted by
+  // decreasing length, and returns the top layer's final hidden states.
+  Eigen::MatrixXf EncodeSortedBatch(const InferenceLSTM& lstm, const vector<Eigen::VectorXf>& init_c, const vector<Eigen::VectorXf>& init_h,
+    const vector<const vector<WordId>*>& sources, bool reverse) const;
+  InferenceBatchState InitialOutputState(const Eigen::MatrixXf& encodings) const;
+  // The classes whose words are scored, given the log distribution over classes
+  void SelectClasses(const float* class_log_dist, vector<unsigned>& classes) const;
+
+  InferenceLSTM forward_lstm, reverse_lstm, output_lstm;
+  vector<Eigen::VectorXf> forward_init_c, forward_init_h;
+  vector<Eigen::VectorXf> reverse_init_c, reverse_init_h;
+  WeightMatrix mW;
+  Eigen::VectorXf mb;
+  EmbeddingTable Es; // Source embeddings, one column per word
+  EmbeddingTable Et; // Target embeddings, one column per word
+  WeightMatrix fIH;
+  Eigen::VectorXf fHb;
+  WeightMatrix fHO;
+  Eigen::VectorXf fOb;
+  vector<WeightMatrix> wHO;
+  vector<Eigen::VectorXf> wOb;
+  MLPKernel mlp_kernel; // Computes the hidden layer and fHO's output in one go, if not null
+
+  bool feed;
+  bool class_factored;
+  WordClasses word_classes;
+  unsigned lstm_layer_count;
+  unsigned output_hidden_dim;
+  unsigned class_beam;
+
+  // The cache synchronizes itself, so Encode() stays safe to call from many threads
+  LRUCache<vector<WordId>, InferenceState, WordIdSequenceHash>* encoder_cache_;
+};
+
+// Stand-alone model files for predict, holding both vocabularies and an
+// InferenceModel, possibly quantized, as written by quantize_model. The
+// vocabularies are stored as FrozenVocab tables.
+bool IsInferenceModelFile(const string& filename);
+bool WriteInferenceModelFile(const string& filename, const FrozenVocab& source_vocab, const FrozenVocab& target_vocab, const InferenceModel& model);
+// Returns null pointers if the file cannot be read. With share set, the weight
+// matrices and vocabulary tables stay in the read-only mapping of the file, so
+// every process that loads the same file shares a single copy of them.
+tuple<FrozenVocab*, FrozenVocab*, InferenceModel*> ReadInferenceModelFile(const string& filename, bool share = false);
+
+// Replaces v with its log softmax
+void LogSoftmaxInPlace(Eigen::VectorXf& v);
+// Replaces each column of m with its log softmax
+void LogSoftmaxColumnsInPlace(Eigen::MatrixXf& m);
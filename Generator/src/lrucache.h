@@ -0,0 +1,72 @@
+#pragma once
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <functional>
+#include <boost/functional/hash.hpp>
+#include "bitext.h"
+
+using namespace std;
+
+// A bounded, thread-safe map that evicts the least recently used entry once
+// it holds capacity entries. Keeps count of lookup hits and misses.
+template <typename Key, typename Value, typename Hash = hash<Key>>
+class LRUCache {
+public:
+  explicit LRUCache(unsigned capacity) : capacity(capacity), hit_count(0), miss_count(0) {}
+
+  bool Get(const Key& key, Value& value) {
+    lock_guard<mutex> lock(m);
+    auto it = index.find(key);
+    if (it == index.end()) {
+      miss_count++;
+      return false;
+    }
+    // Move the entry to the front of the recency list
+    entries.splice(entries.begin(), entries, it->second);
+    value = it->second->second;
+    hit_count++;
+    return true;
+  }
+
+  void Put(const Key& key, const Value& value) {
+    lock_guard<mutex> lock(m);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      it->second->second = value;
+      entries.splice(entries.begin(), entries, it->second);
+      return;
+    }
+
+    entries.push_front(make_pair(key, value));
+    index[key] = entries.begin();
+    if (entries.size() > capacity) {
+      index.erase(entries.back().first);
+      entries.pop_back();
+    }
+  }
+
+  unsigned hits() const {
+    lock_guard<mutex> lock(m);
+    return hit_count;
+  }
+
+  unsigned misses() const {
+    lock_guard<mutex> lock(m);
+    return miss_count;
+  }
+
+private:
+  unsigned capacity;
+  unsigned hit_count;
+  unsigned miss_count;
+  list<pair<Key, Value>> entries; // Most recently used first
+  unordered_map<Key, typename list<pair<Key, Value>>::iterator, Hash> index;
+  mutable mutex m;
+};
+
+struct WordIdSequenceHash {
+  size_t operator()(const vector<WordId>& words) const {
+    return boost::hash_range(words.begin(), words.end());
+  }
+};
@@ -1,6 +1,12 @@
 #include "mlp.h"
 
 Expression MLP::Feed(vector<Expression> inputs) const {
+  Expression hidden2 = Hidden(inputs);
+  Expression output = affine_transform({i_Ob, i_HO, hidden2});
+  return output;
+}
+
+Expression MLP::Hidden(vector<Expression> inputs) const {
   assert (inputs.size() == i_IH.size());
   vector<Expression> xs(2 * inputs.size() + 1);
   xs[0] = i_Hb;
@@ -10,7 +16,6 @@ Expression MLP::Feed(vector<Expression> inputs) const {
   }
   Expression hidden1 = affine_transform(xs);
   Expression hidden2 = tanh({hidden1});
-  Expression output = affine_transform({i_Ob, i_HO, hidden2});
-  return output;
+  return hidden2;
 }
 
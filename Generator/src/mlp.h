@@ -14,4 +14,7 @@ struct MLP {
   Expression i_Ob;
 
   Expression Feed(vector<Expression> input) const;
+  // Returns only the (post-tanh) hidden layer, for callers that apply
+  // their own output layer, e.g. over a subset of the output rows.
+  Expression Hidden(vector<Expression> input) const;
 };
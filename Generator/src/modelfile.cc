@@ -0,0 +1,75 @@
+#include <cassert>
+#include <cctype>
+#include <fstream>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include "modelfile.h"
+#include "attentional.h"
+#include "encdec.h"
+
+const string kEncoderDecoderModelType = "encoder_decoder";
+const string kAttentionalModelType = "attentional";
+
+void WriteModel(ostream& out, const Dict& source_vocab, const Dict& target_vocab, TranslationModel& translation_model, Model& cnn_model) {
+  AttentionalModel* attentional = dynamic_cast<AttentionalModel*>(&translation_model);
+  EncoderDecoderModel* generator = dynamic_cast<EncoderDecoderModel*>(&translation_model);
+  assert (attentional != nullptr || generator != nullptr);
+  out << (attentional != nullptr ? kAttentionalModelType : kEncoderDecoderModelType) << "\n";
+
+  boost::archive::text_oarchive oa(out);
+  oa & source_vocab;
+  oa & target_vocab;
+  if (attentional != nullptr) {
+    oa << *attentional;
+  }
+  else {
+    oa << *generator;
+  }
+  oa << cnn_model;
+}
+
+tuple<Dict*, Dict*, Model*, TranslationModel*> LoadModel(const string& model_filename, bool train) {
+  ifstream model_file(model_filename);
+  if (!model_file.is_open()) {
+    cerr << "ERROR: Unable to open " << model_filename << endl;
+    exit(1);
+  }
+
+  // A boost archive starts with the length of its signature
+  string model_type = kEncoderDecoderModelType;
+  if (!isdigit(model_file.peek())) {
+    getline(model_file, model_type);
+  }
+  if (model_type != kEncoderDecoderModelType && model_type != kAttentionalModelType) {
+    cerr << "ERROR: " << model_filename << " holds an unknown kind of model: " << model_type << endl;
+    exit(1);
+  }
+  boost::archive::text_iarchive ia(model_file);
+
+  Dict* source_vocab = new Dict();
+  Dict* target_vocab = new Dict();
+  ia & *source_vocab;
+  ia & *target_vocab;
+  source_vocab->Freeze();
+  target_vocab->Freeze();
+
+  // The model header decides the shape of the parameters, so it has to be read
+  // before any of them are created.
+  Model* cnn_model = new Model();
+  TranslationModel* translation_model = nullptr;
+  if (model_type == kAttentionalModelType) {
+    AttentionalModel* attentional = new AttentionalModel();
+    ia & *attentional;
+    attentional->InitializeParameters(*cnn_model, source_vocab->size(), target_vocab->size());
+    translation_model = attentional;
+  }
+  else {
+    EncoderDecoderModel* generator = new EncoderDecoderModel();
+    ia & *generator;
+    generator->InitializeParameters(*cnn_model, source_vocab->size(), target_vocab->size(), train);
+    translation_model = generator;
+  }
+  ia & *cnn_model;
+
+  return make_tuple(source_vocab, target_vocab, cnn_model, translation_model);
+}
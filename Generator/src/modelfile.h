@@ -0,0 +1,23 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <tuple>
+#include "cnn/cnn.h"
+#include "cnn/dict.h"
+#include "translationmodel.h"
+
+using namespace std;
+using namespace cnn;
+
+// Model files written by train start with a line naming the kind of model,
+// followed by a boost text archive of the two vocabularies, the model's header
+// and its parameters. Files from before the line existed hold encoder-decoder
+// models.
+extern const string kEncoderDecoderModelType;
+extern const string kAttentionalModelType;
+
+void WriteModel(ostream& out, const Dict& source_vocab, const Dict& target_vocab, TranslationModel& translation_model, Model& cnn_model);
+
+// Reads a model file written by train, along with its vocabularies. With train
+// set, the model is built for further training.
+tuple<Dict*, Dict*, Model*, TranslationModel*> LoadModel(const string& model_filename, bool train = false);
@@ -0,0 +1,35 @@
+#include <boost/program_options.hpp>
+
+#include <iostream>
+
+#include "paramsync.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Holds the shared parameters for train --param_server. Runs until killed.
+int main(int argc, char** argv) {
+  po::options_description desc("description");
+  desc.add_options()
+  ("address", po::value<string>()->required(), "host:port to listen on over TCP, or a path for a Unix domain socket")
+  ("help", "Display this help message");
+
+  po::positional_options_description positional_options;
+  positional_options.add("address", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  const string address = vm["address"].as<string>();
+  ParameterServer server(address);
+  cerr << "Listening on " << address << endl;
+  server.Run();
+  return 0;
+}
@@ -0,0 +1,355 @@
+#include "paramsync.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+namespace {
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    // A worker that disappears must not take the server down with SIGPIPE
+    ssize_t written = send(fd, p, size, MSG_NOSIGNAL);
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void* data, size_t size) {
+  char* p = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t count = read(fd, p, size);
+    if (count <= 0) {
+      return false;
+    }
+    p += count;
+    size -= count;
+  }
+  return true;
+}
+
+bool WriteValues(int fd, const vector<float>& values) {
+  uint64_t count = values.size();
+  return WriteAll(fd, &count, sizeof(count)) && WriteAll(fd, values.data(), count * sizeof(float));
+}
+
+bool ReadValues(int fd, vector<float>& values) {
+  uint64_t count;
+  if (!ReadAll(fd, &count, sizeof(count))) {
+    return false;
+  }
+  values.resize(count);
+  return ReadAll(fd, values.data(), count * sizeof(float));
+}
+
+bool WriteSegments(int fd, const vector<ParameterSegment>& segments) {
+  uint64_t count = segments.size();
+  if (!WriteAll(fd, &count, sizeof(count))) {
+    return false;
+  }
+  for (const ParameterSegment& segment : segments) {
+    if (!WriteAll(fd, &segment.offset, sizeof(segment.offset)) || !WriteValues(fd, segment.values)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ReadSegments(int fd, vector<ParameterSegment>& segments) {
+  uint64_t count;
+  if (!ReadAll(fd, &count, sizeof(count))) {
+    return false;
+  }
+  segments.resize(count);
+  for (ParameterSegment& segment : segments) {
+    if (!ReadAll(fd, &segment.offset, sizeof(segment.offset)) || !ReadValues(fd, segment.values)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool IsUnixAddress(const string& address) {
+  return address.find('/') != string::npos || address.find(':') == string::npos;
+}
+
+int UnixSocket(const string& path, sockaddr_un* socket_address) {
+  if (path.size() >= sizeof(socket_address->sun_path)) {
+    return -1;
+  }
+  memset(socket_address, 0, sizeof(*socket_address));
+  socket_address->sun_family = AF_UNIX;
+  strncpy(socket_address->sun_path, path.c_str(), sizeof(socket_address->sun_path) - 1);
+  return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+addrinfo* ResolveTcpAddress(const string& address, bool passive) {
+  size_t colon = address.rfind(':');
+  string host = address.substr(0, colon);
+  string port = address.substr(colon + 1);
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  addrinfo* result = nullptr;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0) {
+    return nullptr;
+  }
+  return result;
+}
+
+} // namespace
+
+int ConnectSocket(const string& address) {
+  if (IsUnixAddress(address)) {
+    sockaddr_un socket_address;
+    int fd = UnixSocket(address, &socket_address);
+    if (fd >= 0 && connect(fd, (sockaddr*)&socket_address, sizeof(socket_address)) != 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  addrinfo* addresses = ResolveTcpAddress(address, false);
+  int fd = -1;
+  for (addrinfo* a = addresses; a != nullptr && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+int ListenSocket(const string& address) {
+  int fd = -1;
+  if (IsUnixAddress(address)) {
+    sockaddr_un socket_address;
+    fd = UnixSocket(address, &socket_address);
+    unlink(address.c_str());
+    if (fd >= 0 && bind(fd, (sockaddr*)&socket_address, sizeof(socket_address)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  else {
+    addrinfo* addresses = ResolveTcpAddress(address, true);
+    for (addrinfo* a = addresses; a != nullptr && fd < 0; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      int reuse = 1;
+      if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 || bind(fd, a->ai_addr, a->ai_addrlen) != 0)) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(addresses);
+  }
+
+  if (fd >= 0 && listen(fd, 64) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+ParameterServer::ParameterServer(const string& address) : initialized(false) {
+  listen_fd = ListenSocket(address);
+  if (listen_fd < 0) {
+    cerr << "ERROR: Unable to listen on " << address << endl;
+    exit(1);
+  }
+}
+
+void ParameterServer::Run() {
+  while (true) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    thread(&ParameterServer::ServeWorker, this, fd).detach();
+  }
+}
+
+void ParameterServer::ServeWorker(int fd) {
+  cerr << "Worker connected" << endl;
+  vector<float> values;
+  vector<ParameterSegment> segments;
+  uint64_t pushes = 0;
+  uint32_t type;
+  while (ReadAll(fd, &type, sizeof(type))) {
+    if (type == kSyncInit) {
+      if (!ReadValues(fd, values)) {
+        break;
+      }
+      lock_guard<mutex> guard(lock);
+      if (!initialized) {
+        master = values;
+        initialized = true;
+        cerr << "Initialized " << master.size() << " parameters" << endl;
+      }
+      else if (values.size() != master.size()) {
+        cerr << "Rejected a worker with " << values.size() << " parameters instead of " << master.size() << endl;
+        break;
+      }
+      values = master;
+    }
+    else if (type == kSyncPush) {
+      if (!ReadSegments(fd, segments)) {
+        break;
+      }
+      lock_guard<mutex> guard(lock);
+      // Closing the connection makes the worker exit with an error, instead of
+      // training on with changes that were never applied
+      if (!initialized) {
+        cerr << "Rejected a push that arrived before any worker initialized the parameters" << endl;
+        break;
+      }
+      bool in_range = true;
+      for (const ParameterSegment& segment : segments) {
+        in_range = in_range && segment.offset <= master.size() && segment.values.size() <= master.size() - segment.offset;
+      }
+      if (!in_range) {
+        cerr << "Rejected a push with parameters beyond the " << master.size() << " that the server holds" << endl;
+        break;
+      }
+      for (const ParameterSegment& segment : segments) {
+        for (unsigned i = 0; i < segment.values.size(); ++i) {
+          master[segment.offset + i] += segment.values[i];
+        }
+      }
+      values = master;
+      pushes++;
+    }
+    else {
+      cerr << "Unknown message type " << type << endl;
+      break;
+    }
+
+    // Replies are sent outside the lock, so a slow worker doesn't hold up the others
+    if (!WriteValues(fd, values)) {
+      break;
+    }
+  }
+  close(fd);
+  cerr << "Worker disconnected after " << pushes << " synchronizations" << endl;
+}
+
+ParameterClient::ParameterClient(Model& model, const string& address, float top_k) : total_size(0), top_k(top_k) {
+  for (Parameters* p : model.parameters_list()) {
+    blocks.push_back({p->values.v, p->values.d.size(), total_size, false});
+    total_size += p->values.d.size();
+  }
+  for (LookupParameters* p : model.lookup_parameters_list()) {
+    for (Tensor& row : p->values) {
+      blocks.push_back({row.v, row.d.size(), total_size, true});
+      total_size += row.d.size();
+    }
+  }
+
+  fd = ConnectSocket(address);
+  if (fd < 0) {
+    cerr << "ERROR: Unable to connect to the parameter server at " << address << endl;
+    exit(1);
+  }
+}
+
+ParameterClient::~ParameterClient() {
+  close(fd);
+}
+
+void ParameterClient::Initialize() {
+  vector<float> values(total_size);
+  for (const Block& block : blocks) {
+    copy(block.values, block.values + block.size, values.begin() + block.offset);
+  }
+  uint32_t type = kSyncInit;
+  if (!WriteAll(fd, &type, sizeof(type)) || !WriteValues(fd, values)) {
+    cerr << "ERROR: Lost the connection to the parameter server" << endl;
+    exit(1);
+  }
+  base.assign(total_size, 0.0f);
+  ReceiveMaster(vector<bool>(blocks.size(), true));
+}
+
+void ParameterClient::Synchronize() {
+  assert (base.size() == total_size);
+  vector<ParameterSegment> segments;
+  vector<bool> sent(blocks.size(), false);
+  vector<pair<float, unsigned>> changed_rows;
+  for (unsigned b = 0; b < blocks.size(); ++b) {
+    const Block& block = blocks[b];
+    float squared_change = 0.0f;
+    for (unsigned i = 0; i < block.size; ++i) {
+      float delta = block.values[i] - base[block.offset + i];
+      squared_change += delta * delta;
+    }
+    if (!block.sparse) {
+      sent[b] = true;
+    }
+    else if (squared_change > 0.0f) {
+      changed_rows.push_back(make_pair(squared_change, b));
+    }
+  }
+
+  // Embedding rows that nobody looked up since the last synchronization are not sent at all
+  unsigned k = changed_rows.size();
+  if (top_k < 1.0f) {
+    k = min(k, (unsigned)ceil(top_k * changed_rows.size()));
+    nth_element(changed_rows.begin(), changed_rows.begin() + k, changed_rows.end(), greater<pair<float, unsigned>>());
+  }
+  for (unsigned i = 0; i < k; ++i) {
+    sent[changed_rows[i].second] = true;
+  }
+
+  for (unsigned b = 0; b < blocks.size(); ++b) {
+    if (sent[b]) {
+      const Block& block = blocks[b];
+      ParameterSegment segment = {block.offset, vector<float>(block.size)};
+      for (unsigned i = 0; i < block.size; ++i) {
+        segment.values[i] = block.values[i] - base[block.offset + i];
+      }
+      segments.push_back(move(segment));
+    }
+  }
+
+  uint32_t type = kSyncPush;
+  if (!WriteAll(fd, &type, sizeof(type)) || !WriteSegments(fd, segments)) {
+    cerr << "ERROR: Lost the connection to the parameter server" << endl;
+    exit(1);
+  }
+  ReceiveMaster(sent);
+}
+
+// Adopts the server's parameters. Blocks whose change was not sent keep it on top of the new master.
+void ParameterClient::ReceiveMaster(const vector<bool>& sent) {
+  vector<float> master;
+  if (!ReadValues(fd, master) || master.size() != total_size) {
+    cerr << "ERROR: The parameter server rejected this model, or the connection was lost" << endl;
+    exit(1);
+  }
+  for (unsigned b = 0; b < blocks.size(); ++b) {
+    const Block& block = blocks[b];
+    for (unsigned i = 0; i < block.size; ++i) {
+      float residual = sent[b] ? 0.0f : block.values[i] - base[block.offset + i];
+      block.values[i] = master[block.offset + i] + residual;
+    }
+  }
+  base = move(master);
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include "cnn/model.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace cnn;
+using namespace std;
+
+// Socket addresses are either host:port for TCP, or a filesystem path for a
+// Unix domain socket. Both return -1 on failure.
+int ConnectSocket(const string& address);
+int ListenSocket(const string& address);
+
+// A run of consecutive parameter values, addressed by their offset in the
+// flattened model (every Parameters, then every row of every LookupParameters)
+struct ParameterSegment {
+  uint64_t offset;
+  vector<float> values;
+};
+
+enum SyncMessage : uint32_t {
+  kSyncInit = 1, // Followed by every parameter value
+  kSyncPush = 2 // Followed by the segments that changed since the last synchronization
+};
+
+// Holds the master copy of the parameters for distributed training. Every
+// worker node's changes are added to it as they arrive, and each node gets the
+// current master back in reply.
+class ParameterServer {
+public:
+  explicit ParameterServer(const string& address);
+  void Run();
+
+private:
+  void ServeWorker(int fd);
+
+  int listen_fd;
+  mutex lock;
+  bool initialized;
+  vector<float> master;
+};
+
+// Keeps the parameters of a local model in sync with a ParameterServer.
+// Synchronize() sends the change since the previous synchronization and adopts
+// the server's parameters. With top_k below 1, only that fraction of the
+// changed embedding rows is sent, largest change first. The change to the
+// other rows is kept locally and goes out with a later synchronization.
+class ParameterClient {
+public:
+  ParameterClient(Model& model, const string& address, float top_k = 1.0f);
+  ~ParameterClient();
+  // Offers the local parameters as the initial master, and adopts whichever
+  // parameters the server actually holds
+  void Initialize();
+  void Synchronize();
+
+private:
+  // One Parameters, or one row of a LookupParameters
+  struct Block {
+    float* values;
+    unsigned size;
+    uint64_t offset;
+    bool sparse;
+  };
+  void ReceiveMaster(const vector<bool>& sent);
+
+  vector<Block> blocks;
+  uint64_t total_size;
+  vector<float> base; // The master parameters as of the last synchronization
+  int fd;
+  float top_k;
+};
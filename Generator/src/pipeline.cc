@@ -0,0 +1,142 @@
+#include <cassert>
+#include "pipeline.h"
+#include "ensemble.h"
+#include "batch_decoder.h"
+
+TranslationPipeline::TranslationPipeline(const vector<InferenceModel*>& models, unsigned num_threads, unsigned max_in_flight, unsigned batch_sentences) :
+    models(models), num_threads(num_threads), max_in_flight(max_in_flight), batch_sentences(batch_sentences), cache(nullptr), read_count(0), written_count(0), reading_done(false) {
+  assert (num_threads > 0);
+  assert (batch_sentences > 0);
+  // Workers wait for full batches, so the reader must be allowed to get at least one batch ahead
+  assert (max_in_flight >= batch_sentences);
+}
+
+void TranslationPipeline::SetParams(unsigned max_length, WordId kSOS, WordId kEOS, unsigned kbest_size, unsigned beam_size) {
+  this->max_length = max_length;
+  this->kSOS = kSOS;
+  this->kEOS = kEOS;
+  this->kbest_size = kbest_size;
+  this->beam_size = beam_size;
+}
+
+void TranslationPipeline::SetCache(TranslationCache* cache) {
+  this->cache = cache;
+}
+
+void TranslationPipeline::SetPlacement(const vector<CpuPlacement>& placements) {
+  this->placements = placements;
+}
+
+TranslationKey TranslationPipeline::MakeKey(const vector<WordId>& source) const {
+  return {source, kbest_size, beam_size, max_length};
+}
+
+void TranslationPipeline::Run(Reader read, Writer write) {
+  read_count = 0;
+  written_count = 0;
+  reading_done = false;
+
+  thread reader(&TranslationPipeline::ReaderLoop, this, read);
+  vector<thread> workers;
+  for (unsigned i = 0; i < num_threads; ++i) {
+    workers.push_back(thread(&TranslationPipeline::WorkerLoop, this, i));
+  }
+
+  while (true) {
+    unique_lock<mutex> lock(m);
+    cv.wait(lock, [this]() { return outputs.count(written_count) > 0 || (reading_done && written_count == read_count); });
+    if (outputs.count(written_count) == 0) {
+      break;
+    }
+    auto it = outputs.find(written_count);
+    KBestList<vector<WordId>> kbest = it->second;
+    outputs.erase(it);
+    lock.unlock();
+
+    write(kbest);
+
+    lock.lock();
+    written_count++;
+    cv.notify_all();
+  }
+
+  reader.join();
+  for (thread& worker : workers) {
+    worker.join();
+  }
+}
+
+void TranslationPipeline::ReaderLoop(Reader read) {
+  while (true) {
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [this]() { return read_count - written_count < max_in_flight; });
+    }
+
+    vector<WordId> source;
+    bool more = read(source);
+    KBestList<vector<WordId>> kbest(kbest_size);
+    bool cached = more && cache != nullptr && cache->Get(MakeKey(source), kbest);
+
+    lock_guard<mutex> lock(m);
+    if (!more) {
+      reading_done = true;
+      cv.notify_all();
+      return;
+    }
+    if (cached) {
+      outputs.insert(make_pair(read_count, kbest));
+    }
+    else {
+      inputs.push_back(make_pair(read_count, source));
+    }
+    read_count++;
+    cv.notify_all();
+  }
+}
+
+void TranslationPipeline::WorkerLoop(unsigned index) {
+  // Pin before anything is allocated, so the decoders' buffers land on the local node
+  if (index < placements.size() && !PinCurrentThread(placements[index])) {
+    cerr << "WARNING: Unable to pin translation worker " << index << " to CPU " << placements[index].cpu << endl;
+  }
+  InferenceDecoder decoder(models, false);
+  decoder.SetParams(max_length, kSOS, kEOS);
+  BatchDecoder batch_decoder(models);
+  batch_decoder.SetParams(max_length, kSOS, kEOS);
+  while (true) {
+    vector<unsigned> indices;
+    vector<vector<WordId>> sources;
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [this]() { return inputs.size() >= batch_sentences || reading_done; });
+      if (inputs.empty()) {
+        return;
+      }
+      while (!inputs.empty() && sources.size() < batch_sentences) {
+        indices.push_back(inputs.front().first);
+        sources.push_back(inputs.front().second);
+        inputs.pop_front();
+      }
+    }
+
+    vector<KBestList<vector<WordId>>> kbests;
+    if (sources.size() == 1) {
+      kbests.push_back(decoder.TranslateKBest(sources[0], kbest_size, beam_size));
+    }
+    else {
+      kbests = batch_decoder.TranslateKBest(sources, kbest_size, beam_size);
+    }
+    if (cache != nullptr) {
+      for (unsigned i = 0; i < sources.size(); ++i) {
+        cache->Put(MakeKey(sources[i]), kbests[i]);
+      }
+    }
+
+    lock_guard<mutex> lock(m);
+    for (unsigned i = 0; i < indices.size(); ++i) {
+      outputs.insert(make_pair(indices[i], kbests[i]));
+    }
+    cv.notify_all();
+  }
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "inference.h"
+#include "kbestlist.h"
+#include "translationcache.h"
+#include "placement.h"
+
+using namespace std;
+
+// Translates a stream of source sentences on several threads. One reader thread
+// pulls sentences from the input, a pool of workers (each with its own
+// InferenceDecoder over the shared, read-only models) translates them, and the
+// calling thread receives the results strictly in input order. If batch_sentences
+// is more than one, workers take that many sentences at a time off the queue and
+// decode them together with a BatchDecoder.
+class TranslationPipeline {
+public:
+  // Fills source with the next input sentence, or returns false at the end of the input
+  typedef function<bool(vector<WordId>& source)> Reader;
+  typedef function<void(const KBestList<vector<WordId>>& kbest)> Writer;
+
+  // At most max_in_flight sentences are read but not yet written at any time,
+  // which bounds the memory used by the input queue and the reorder buffer.
+  TranslationPipeline(const vector<InferenceModel*>& models, unsigned num_threads, unsigned max_in_flight, unsigned batch_sentences = 1);
+  void SetParams(unsigned max_length, WordId kSOS, WordId kEOS, unsigned kbest_size, unsigned beam_size);
+  // Sentences found in the cache skip the workers entirely. New translations are added to it.
+  void SetCache(TranslationCache* cache);
+  // Pins worker i to placements[i]
+  void SetPlacement(const vector<CpuPlacement>& placements);
+
+  void Run(Reader read, Writer write);
+
+private:
+  void ReaderLoop(Reader read);
+  void WorkerLoop(unsigned index);
+
+  vector<InferenceModel*> models;
+  unsigned num_threads;
+  unsigned max_in_flight;
+  unsigned batch_sentences;
+  unsigned max_length;
+  WordId kSOS;
+  WordId kEOS;
+  unsigned kbest_size;
+  unsigned beam_size;
+  TranslationCache* cache;
+  vector<CpuPlacement> placements;
+
+  TranslationKey MakeKey(const vector<WordId>& source) const;
+
+  mutex m;
+  condition_variable cv;
+  deque<pair<unsigned, vector<WordId>>> inputs; // Sentences waiting for a worker, with their line numbers
+  map<unsigned, KBestList<vector<WordId>>> outputs; // Reorder buffer of finished translations
+  unsigned read_count;
+  unsigned written_count;
+  bool reading_done;
+};
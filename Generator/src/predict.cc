@@ -1,21 +1,30 @@
 #include "cnn/cnn.h"
 #include "cnn/training.h"
 
-#include <boost/archive/text_iarchive.hpp>
-#include <boost/algorithm/string.hpp>
-#include <boost/algorithm/string/join.hpp>
+#include <boost/program_options.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <csignal>
 
 #include "bitext.h"
 #include "encdec.h"
+#include "attentional.h"
+#include "modelfile.h"
+#include "batch_decoder.h"
 #include "decoder.h"
+#include "ensemble.h"
+#include "inference.h"
+#include "pipeline.h"
+#include "translationcache.h"
 #include "utils.h"
+#include "tokenizer.h"
+#include "frozenvocab.h"
 
 using namespace cnn;
 using namespace std;
+namespace po = boost::program_options;
 
 bool ctrlc_pressed = false;
 void ctrlc_handler(int signal) {
@@ -27,94 +36,366 @@ void ctrlc_handler(int signal) {
   }
 }
 
-void trim(vector<string>& tokens, bool removeEmpty) {
+void LogTokens(const vector<StringPiece>& tokens) {
   for (unsigned i = 0; i < tokens.size(); ++i) {
-    boost::algorithm::trim(tokens[i]);
-    if (tokens[i].length() == 0 && removeEmpty) {
-      tokens.erase(tokens.begin() + i);
-      --i;
+    cerr << (i == 0 ? "" : " ") << tokens[i];
+  }
+  cerr << endl;
+}
+
+// Reads the next source sentence from in, and logs it (and its reference, if any) to stderr
+bool ReadSourceSentence(istream& in, const FrozenVocab& source_vocab, WordId ksSOS, WordId ksEOS, vector<WordId>& source) {
+  static thread_local string line;
+  static thread_local TokenBuffers buffers;
+  if (!getline(in, line)) {
+    return false;
+  }
+
+  Split(line, "|||", buffers.fields);
+  SplitWords(buffers.fields[0], buffers.words);
+
+  source.clear();
+  source.push_back(ksSOS);
+  for (StringPiece word : buffers.words) {
+    source.push_back(source_vocab.Convert(word));
+  }
+  source.push_back(ksEOS);
+
+  cerr << "Read source sentence: ";
+  LogTokens(buffers.words);
+  if (buffers.fields.size() > 1) {
+    SplitWords(buffers.fields[1], buffers.words);
+    cerr << "  Read reference: ";
+    LogTokens(buffers.words);
+  }
+  return true;
+}
+
+void WriteTranslation(double score, const vector<WordId>& hyp, const FrozenVocab& target_vocab) {
+  cout << score << "\t";
+  for (unsigned i = 0; i < hyp.size(); ++i) {
+    cout << (i == 0 ? "" : " ") << target_vocab.Convert(hyp[i]);
+  }
+  cout << endl;
+}
+
+void WriteKBest(const KBestList<vector<WordId>>& kbest, const FrozenVocab& target_vocab) {
+  for (auto& scored_hyp : kbest.hypothesis_list()) {
+    WriteTranslation(scored_hyp.first, scored_hyp.second, target_vocab);
+  }
+}
+
+// Force-decodes translation with model and writes its attention weights to out,
+// one line per output word, followed by a blank line
+void WriteAlignment(AttentionalModel& model, const vector<WordId>& source, const vector<WordId>& translation, AlignmentMatrix& alignment, ostream& out) {
+  ComputationGraph cg;
+  model.Align(source, translation, alignment, cg);
+  alignment.Write(out);
+  out << "\n";
+}
+
+void ReportCacheStatistics(const TranslationCache* cache, const vector<InferenceModel*>& inference_models) {
+  if (cache != nullptr) {
+    cerr << "Translation cache: " << cache->hits() << " hits, " << cache->misses() << " misses" << endl;
+  }
+  for (unsigned i = 0; i < inference_models.size(); ++i) {
+    const auto* encoder_cache = inference_models[i]->encoder_cache();
+    if (encoder_cache != nullptr) {
+      cerr << "Encoder cache for model " << i << ": " << encoder_cache->hits() << " hits, " << encoder_cache->misses() << " misses" << endl;
     }
   }
 }
 
 int main(int argc, char** argv) {
-  if (argc < 2) {
-    cerr << "Usage: cat source.txt | " << argv[0] << " model" << endl;
-    cerr << endl;
-    exit(1);
-  }
   signal (SIGINT, ctrlc_handler);
-  cnn::Initialize(argc, argv);
 
-  Model* cnn_model;
-  EncoderDecoderModel* generator;
-  Dict source_vocab;
-  Dict target_vocab;
+  po::options_description desc("description");
+  desc.add_options()
+  ("model", po::value<vector<string>>()->required()->multitoken(), "model file(s), as output by train or quantize_model. Multiple models are decoded as an ensemble.")
+  ("beam_size,b", po::value<unsigned>()->default_value(10), "Size of the beam used during search")
+  ("kbest_size,k", po::value<unsigned>()->default_value(3), "Number of translations to output per source sentence")
+  ("max_length", po::value<unsigned>()->default_value(100), "Maximum length of output translations")
+  ("class_beam", po::value<unsigned>()->default_value(0), "For a single class-factored model, only expand words from this many of the best classes. 0 scores every word.")
+  ("parallel_ensemble", "Run each model of the ensemble on its own thread")
+  ("threads,j", po::value<unsigned>()->default_value(1), "Translate this many sentences at once, each on its own thread. Output stays in input order.")
+  ("batch_sentences", po::value<unsigned>()->default_value(1), "Decode this many source sentences together as one batch on each thread")
+  ("cache_size", po::value<unsigned>()->default_value(0), "Remember the k-best lists of this many recently translated source sentences. 0 disables the cache.")
+  ("pin_threads", "With --threads, pin each translation thread to its own core, spread across NUMA nodes, and interleave the large weight matrices across the nodes")
+  ("quantize", "Quantize the weights of every model to int8 after loading it, as quantize_model does")
+  ("mmap", "Map models written by quantize_model read-only instead of reading them into memory, so that every predict process on the host shares one copy of their weights")
+  ("encoder_cache_size", po::value<unsigned>()->default_value(0), "Remember the encodings of this many recent source sentences, per model. Only used with --parallel_ensemble, --threads or --batch_sentences.")
+  ("samples", po::value<unsigned>()->default_value(0), "Instead of searching for the best translations, output this many translations of each source sentence drawn by ancestral sampling, in the order they were drawn. 0 disables sampling.")
+  ("temperature", po::value<float>()->default_value(1.0f), "With --samples, divide the log probabilities by this before sampling each word")
+  ("top_k", po::value<unsigned>()->default_value(0), "With --samples, only draw each word from this many of the most probable words. 0 keeps every word.")
+  ("top_p", po::value<float>()->default_value(1.0f), "With --samples, only draw each word from the smallest set of most probable words whose probability adds up to this (nucleus sampling)")
+  ("random_seed,r", po::value<unsigned>()->default_value(0), "Random seed for --samples. If this value is 0 a seed will be chosen randomly.")
+  ("alignments", po::value<string>(), "Write the attention weights of every output translation to this file, in the same order as the translations. Needs an attentional model, and for an ensemble uses the first model's attention.")
+  ("help", "Display this help message");
 
-  const string model_filename = argv[1];
-  ifstream model_file(model_filename);
-  if (!model_file.is_open()) {
-    cerr << "ERROR: Unable to open " << model_filename << endl;
-    exit(1);
+  po::positional_options_description positional_options;
+  positional_options.add("model", -1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << "Usage: cat source.txt | " << argv[0] << " model [model...]" << endl;
+    cerr << desc;
+    return 1;
   }
-  boost::archive::text_iarchive ia(model_file);
 
-  ia & source_vocab;
-  ia & target_vocab;
-  source_vocab.Freeze();
-  target_vocab.Freeze();
+  po::notify(vm);
 
-  cnn_model = new Model();
-  generator = new EncoderDecoderModel(*cnn_model, source_vocab.size(), target_vocab.size());
+  cnn::Initialize(argc, argv);
 
-  ia & *generator;
-  ia & *cnn_model;
+  FrozenVocab* source_vocab = nullptr;
+  FrozenVocab* target_vocab = nullptr;
+  vector<TranslationModel*> translation_models;
+  vector<Model*> cnn_models;
+  // Models read from quantize_model's files exist only as InferenceModels
+  vector<InferenceModel*> loaded_inference_models;
+  for (const string& model_filename : vm["model"].as<vector<string>>()) {
+    FrozenVocab* model_source_vocab = nullptr;
+    FrozenVocab* model_target_vocab = nullptr;
+    Model* cnn_model = nullptr;
+    TranslationModel* translation_model = nullptr;
+    InferenceModel* inference_model = nullptr;
+    if (IsInferenceModelFile(model_filename)) {
+      // These files carry ready-made lookup tables, which --mmap maps along with the weights
+      tie(model_source_vocab, model_target_vocab, inference_model) = ReadInferenceModelFile(model_filename, vm.count("mmap") > 0);
+      if (inference_model == nullptr) {
+        cerr << "ERROR: Unable to read " << model_filename << endl;
+        exit(1);
+      }
+    }
+    else {
+      if (vm.count("mmap")) {
+        cerr << "WARNING: --mmap only maps files written by quantize_model, so " << model_filename << " gets a private copy of its weights" << endl;
+      }
+      Dict* source_dict = nullptr;
+      Dict* target_dict = nullptr;
+      tie(source_dict, target_dict, cnn_model, translation_model) = LoadModel(model_filename);
+      // Unknown source words become UNK, instead of being rejected by the frozen Dict
+      model_source_vocab = new FrozenVocab(*source_dict, "UNK");
+      model_target_vocab = new FrozenVocab(*target_dict, "UNK");
+      delete source_dict;
+      delete target_dict;
+    }
+    if (source_vocab == nullptr) {
+      source_vocab = model_source_vocab;
+      target_vocab = model_target_vocab;
+    }
+    else if (source_vocab->size() != model_source_vocab->size() || target_vocab->size() != model_target_vocab->size()) {
+      cerr << "ERROR: The vocabulary of " << model_filename << " does not match that of the other models" << endl;
+      exit(1);
+    }
+    else {
+      delete model_source_vocab;
+      delete model_target_vocab;
+    }
+    translation_models.push_back(translation_model);
+    cnn_models.push_back(cnn_model);
+    loaded_inference_models.push_back(inference_model);
+  }
+  const bool quantize = vm.count("quantize") > 0;
+  const bool cnn_free = quantize || find(translation_models.begin(), translation_models.end(), nullptr) != translation_models.end();
+  // Only encoder-decoder models have cnn-free copies
+  bool attentional = false;
+  for (TranslationModel* translation_model : translation_models) {
+    if (translation_model != nullptr && dynamic_cast<EncoderDecoderModel*>(translation_model) == nullptr) {
+      attentional = true;
+    }
+  }
 
-  Decoder decoder({generator});
+  // Only used when cnn_free is false, in which case every model was loaded
+  Decoder decoder(translation_models);
 
-  WordId ksSOS = source_vocab.Convert("<s>");
-  WordId ksEOS = source_vocab.Convert("</s>");
-  WordId ktSOS = target_vocab.Convert("<s>");
-  WordId ktEOS = target_vocab.Convert("</s>");
+  WordId ksSOS = source_vocab->Convert(StringPiece("<s>"));
+  WordId ksEOS = source_vocab->Convert(StringPiece("</s>"));
+  WordId ktSOS = target_vocab->Convert(StringPiece("<s>"));
+  WordId ktEOS = target_vocab->Convert(StringPiece("</s>"));
+  const FrozenVocab& source_lookup = *source_vocab;
+  const FrozenVocab& target_lookup = *target_vocab;
 
-  unsigned beam_size = 10;
-  unsigned max_length = 100;
-  unsigned kbest_size = 3; 
+  const unsigned beam_size = vm["beam_size"].as<unsigned>();
+  const unsigned max_length = vm["max_length"].as<unsigned>();
+  const unsigned kbest_size = vm["kbest_size"].as<unsigned>();
   decoder.SetParams(max_length, ktSOS, ktEOS);
+  decoder.SetClassBeam(vm["class_beam"].as<unsigned>());
 
-  string line;
-  while(getline(cin, line)) {
-    vector<string> parts = tokenize(line, "|||");
-    trim(parts, false);
+  const unsigned num_threads = vm["threads"].as<unsigned>();
+  const unsigned batch_sentences = vm["batch_sentences"].as<unsigned>();
+  const bool use_pipeline = num_threads > 1 || batch_sentences > 1;
+  if (use_pipeline && vm.count("parallel_ensemble")) {
+    cerr << "Invalid parameters: --parallel_ensemble cannot be combined with --threads or --batch_sentences." << endl;
+    exit(1);
+  }
+  if (attentional && (use_pipeline || vm.count("parallel_ensemble") || cnn_free)) {
+    cerr << "Invalid parameters: Attentional models are only decoded by the default single-threaded decoder, and cannot be combined with --threads, --batch_sentences, --parallel_ensemble, --quantize or quantize_model's files." << endl;
+    exit(1);
+  }
 
-    vector<string> tokens = tokenize(parts[0], " ");
-    trim(tokens, true);
+  const unsigned num_samples = vm["samples"].as<unsigned>();
+  SamplingOptions sampling_options;
+  sampling_options.temperature = vm["temperature"].as<float>();
+  sampling_options.top_k = vm["top_k"].as<unsigned>();
+  sampling_options.top_p = vm["top_p"].as<float>();
+  if (num_samples > 0) {
+    if (use_pipeline || vm["cache_size"].as<unsigned>() > 0 || vm.count("parallel_ensemble")) {
+      cerr << "Invalid parameters: --samples cannot be combined with --threads, --batch_sentences, --cache_size or --parallel_ensemble." << endl;
+      exit(1);
+    }
+    if (!(sampling_options.temperature > 0.0f) || !(sampling_options.top_p > 0.0f && sampling_options.top_p <= 1.0f)) {
+      cerr << "Invalid parameters: --temperature must be positive and --top_p must be in (0, 1]." << endl;
+      exit(1);
+    }
+  }
 
-    vector<WordId> source(tokens.size());
-    for (unsigned i = 0; i < tokens.size(); ++i) {
-      source[i] = source_vocab.Convert(tokens[i]);
+  AttentionalModel* aligner = nullptr;
+  ofstream alignment_file;
+  AlignmentMatrix alignment;
+  if (vm.count("alignments")) {
+    aligner = dynamic_cast<AttentionalModel*>(translation_models[0]);
+    if (aligner == nullptr) {
+      cerr << "Invalid parameters: --alignments needs the first model to be an attentional model." << endl;
+      exit(1);
+    }
+    const string alignment_filename = vm["alignments"].as<string>();
+    alignment_file.open(alignment_filename);
+    if (!alignment_file.is_open()) {
+      cerr << "ERROR: Unable to open " << alignment_filename << endl;
+      exit(1);
     }
-    source.insert(source.begin(), ksSOS);
-    source.insert(source.end(), ksEOS);
+  }
 
-    cerr << "Read source sentence: " << boost::algorithm::join(tokens, " ") << endl;
-    if (parts.size() > 1) {
-      vector<string> reference = tokenize(parts[1], " ");
-      trim(reference, true);
-      cerr << "  Read reference: " << boost::algorithm::join(reference, " ") << endl;
+  // Everything except the default single-threaded path runs on cnn-free copies
+  // of the models, and so do quantized models, whatever the path. Sampling
+  // uses them too, so that all samples are stacked into one batch.
+  vector<InferenceModel*> inference_models;
+  const unsigned encoder_cache_size = vm["encoder_cache_size"].as<unsigned>();
+  if (use_pipeline || vm.count("parallel_ensemble") || cnn_free || (num_samples > 0 && !attentional)) {
+    for (unsigned i = 0; i < translation_models.size(); ++i) {
+      InferenceModel* inference_model = loaded_inference_models[i];
+      if (inference_model == nullptr) {
+        inference_model = new InferenceModel(*dynamic_cast<EncoderDecoderModel*>(translation_models[i]));
+      }
+      if (quantize) {
+        inference_model->Quantize();
+      }
+      // Like Decoder, the class beam only prunes a single model
+      if (translation_models.size() == 1) {
+        inference_model->SetClassBeam(vm["class_beam"].as<unsigned>());
+      }
+      if (encoder_cache_size > 0) {
+        inference_model->EnableEncoderCache(encoder_cache_size);
+      }
+      inference_models.push_back(inference_model);
+      // Nothing decodes with the cnn model once it has been copied, so do not
+      // keep a second set of weights around. decoder is never used on this path.
+      delete translation_models[i];
+      delete cnn_models[i];
+      translation_models[i] = nullptr;
+      cnn_models[i] = nullptr;
     }
+  }
 
-    ComputationGraph cg;
-    KBestList<vector<WordId> > kbest = decoder.TranslateKBest(source, kbest_size, beam_size, cg);
-    for (auto& scored_hyp : kbest.hypothesis_list()) {
-      double score = scored_hyp.first;
-      vector<WordId> hyp = scored_hyp.second;
-      vector<string> words(hyp.size());
-      for (unsigned i = 0; i < hyp.size(); ++i) {
-        words[i] = target_vocab.Convert(hyp[i]);
+  if (num_samples > 0) {
+    const unsigned random_seed = vm["random_seed"].as<unsigned>();
+    // Attentional models have no cnn-free copies, so they are sampled with cnn
+    BatchSampler* batch_sampler = nullptr;
+    if (inference_models.size() > 0) {
+      batch_sampler = new BatchSampler(inference_models);
+      batch_sampler->SetParams(max_length, ktSOS, ktEOS);
+      batch_sampler->SetOptions(sampling_options, random_seed);
+    }
+    else {
+      decoder.SetSamplingOptions(sampling_options, random_seed);
+    }
+
+    vector<WordId> source;
+    while (ReadSourceSentence(cin, source_lookup, ksSOS, ksEOS, source)) {
+      vector<pair<double, vector<WordId>>> samples;
+      if (batch_sampler != nullptr) {
+        samples = batch_sampler->SampleTranslations(source, num_samples);
+      }
+      else {
+        ComputationGraph cg;
+        samples = decoder.SampleTranslations(source, num_samples, cg);
+      }
+      for (auto& sample : samples) {
+        WriteTranslation(sample.first, sample.second, target_lookup);
+        if (aligner != nullptr) {
+          WriteAlignment(*aligner, source, sample.second, alignment, alignment_file);
+        }
+      }
+
+      if (ctrlc_pressed) {
+        break;
+      }
+    }
+
+    ReportCacheStatistics(nullptr, inference_models);
+    return 0;
+  }
+
+  TranslationCache* cache = nullptr;
+  if (vm["cache_size"].as<unsigned>() > 0) {
+    cache = new TranslationCache(vm["cache_size"].as<unsigned>());
+  }
+
+  if (use_pipeline) {
+    TranslationPipeline pipeline(inference_models, num_threads, 64 * num_threads * batch_sentences, batch_sentences);
+    pipeline.SetParams(max_length, ktSOS, ktEOS, kbest_size, beam_size);
+    pipeline.SetCache(cache);
+    if (vm.count("pin_threads")) {
+      vector<CpuPlacement> placements = PlanPlacement(num_threads);
+      ReportPlacement("translation worker", placements);
+      pipeline.SetPlacement(placements);
+      for (InferenceModel* inference_model : inference_models) {
+        if (inference_model->InterleaveWeights()) {
+          cerr << "Interleaved model weights across " << NumaNodeCount() << " NUMA nodes" << endl;
+        }
+      }
+    }
+    auto read = [&](vector<WordId>& source) {
+      return !ctrlc_pressed && ReadSourceSentence(cin, source_lookup, ksSOS, ksEOS, source);
+    };
+    auto write = [&](const KBestList<vector<WordId>>& kbest) {
+      WriteKBest(kbest, target_lookup);
+    };
+    pipeline.Run(read, write);
+    ReportCacheStatistics(cache, inference_models);
+    return 0;
+  }
+
+  InferenceDecoder* inference_decoder = nullptr;
+  if (vm.count("parallel_ensemble") || cnn_free) {
+    inference_decoder = new InferenceDecoder(inference_models, vm.count("parallel_ensemble") > 0);
+    inference_decoder->SetParams(max_length, ktSOS, ktEOS);
+  }
+
+  vector<WordId> source;
+  while (ReadSourceSentence(cin, source_lookup, ksSOS, ksEOS, source)) {
+    KBestList<vector<WordId> > kbest(kbest_size);
+    TranslationKey key = {source, kbest_size, beam_size, max_length};
+    if (cache != nullptr && cache->Get(key, kbest)) {
+      // Nothing left to do
+    }
+    else if (inference_decoder != nullptr) {
+      kbest = inference_decoder->TranslateKBest(source, kbest_size, beam_size);
+    }
+    else {
+      ComputationGraph cg;
+      kbest = decoder.TranslateKBest(source, kbest_size, beam_size, cg);
+    }
+    if (cache != nullptr) {
+      cache->Put(key, kbest);
+    }
+    WriteKBest(kbest, target_lookup);
+    if (aligner != nullptr) {
+      for (auto& scored_hyp : kbest.hypothesis_list()) {
+        WriteAlignment(*aligner, source, scored_hyp.second, alignment, alignment_file);
       }
-      string translation = boost::algorithm::join(words, " ");
-      cout << score << "\t" << translation << endl;
     }
 
     if (ctrlc_pressed) {
@@ -122,5 +403,6 @@ int main(int argc, char** argv) {
     }
   }
 
+  ReportCacheStatistics(cache, inference_models);
   return 0;
 }
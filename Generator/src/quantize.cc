@@ -0,0 +1,421 @@
+#include "quantize.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+int32_t DotInt8(const int8_t* a, const int8_t* b, unsigned size) {
+  unsigned i = 0;
+  int32_t sum = 0;
+#if defined(__AVX2__)
+  // maddubs multiplies unsigned bytes by signed bytes, so the sign of a is moved onto b
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 32 <= size; i += 32) {
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    __m256i products = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(products, ones));
+  }
+  __m128i acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  acc128 = _mm_hadd_epi32(acc128, acc128);
+  acc128 = _mm_hadd_epi32(acc128, acc128);
+  sum = _mm_cvtsi128_si32(acc128);
+#elif defined(__SSSE3__)
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= size; i += 16) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    __m128i products = _mm_maddubs_epi16(_mm_sign_epi8(va, va), _mm_sign_epi8(vb, va));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(products, ones));
+  }
+  acc = _mm_hadd_epi32(acc, acc);
+  acc = _mm_hadd_epi32(acc, acc);
+  sum = _mm_cvtsi128_si32(acc);
+#endif
+  for (; i < size; ++i) {
+    sum += (int32_t)a[i] * b[i];
+  }
+  return sum;
+}
+
+float QuantizeValues(const float* values, unsigned size, int8_t* quantized) {
+  float max_abs = 0.0f;
+  for (unsigned i = 0; i < size; ++i) {
+    max_abs = max(max_abs, fabs(values[i]));
+  }
+  if (max_abs == 0.0f) {
+    fill(quantized, quantized + size, 0);
+    return 0.0f;
+  }
+  const float scale = max_abs / 127.0f;
+  const float inverse_scale = 1.0f / scale;
+  for (unsigned i = 0; i < size; ++i) {
+    float q = nearbyint(values[i] * inverse_scale);
+    quantized[i] = (int8_t)max(-127.0f, min(127.0f, q));
+  }
+  return scale;
+}
+
+MappedFile::MappedFile(const string& filename) : mapped_data(nullptr), mapped_size(0) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      mapped_data = data;
+      mapped_size = st.st_size;
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (mapped_data != nullptr) {
+    munmap(mapped_data, mapped_size);
+  }
+}
+
+bool MappedFile::is_open() const {
+  return mapped_data != nullptr;
+}
+
+const char* MappedFile::data() const {
+  return static_cast<const char*>(mapped_data);
+}
+
+size_t MappedFile::size() const {
+  return mapped_size;
+}
+
+void WriteArray(ostream& out, const void* data, size_t bytes) {
+  static const char padding[kModelAlignment] = {0};
+  const size_t offset = out.tellp();
+  out.write(padding, (kModelAlignment - offset % kModelAlignment) % kModelAlignment);
+  out.write(static_cast<const char*>(data), bytes);
+}
+
+ModelReader::ModelReader(shared_ptr<const MappedFile> file, bool share) : file_(file), share_(share), offset(0) {}
+
+bool ModelReader::share() const {
+  return share_;
+}
+
+shared_ptr<const MappedFile> ModelReader::file() const {
+  return file_;
+}
+
+bool ModelReader::Read(void* out, size_t bytes) {
+  if (bytes > file_->size() - offset) {
+    return false;
+  }
+  memcpy(out, file_->data() + offset, bytes);
+  offset += bytes;
+  return true;
+}
+
+const char* ModelReader::ReadArray(size_t bytes) {
+  const size_t start = (offset + kModelAlignment - 1) / kModelAlignment * kModelAlignment;
+  if (start > file_->size() || bytes > file_->size() - start) {
+    return nullptr;
+  }
+  offset = start + bytes;
+  return file_->data() + start;
+}
+
+namespace {
+
+// Both classes share one layout: a header, then either the float matrix or the int8 values and their scales
+void WriteHeader(ostream& out, unsigned rows, unsigned cols, bool quantized) {
+  uint32_t header[3] = {rows, cols, quantized ? 1U : 0U};
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+}
+
+bool ReadHeader(ModelReader& in, unsigned& rows, unsigned& cols, bool& quantized) {
+  uint32_t header[3];
+  if (!in.Read(header, sizeof(header)) || header[2] > 1) {
+    return false;
+  }
+  rows = header[0];
+  cols = header[1];
+  quantized = header[2] == 1;
+  return true;
+}
+
+// Reads the arrays of either class. Shared arrays are left where they are, and
+// the others are copied into the given storage.
+bool ReadStorage(ModelReader& in, unsigned rows, unsigned cols, bool quantized, unsigned num_scales,
+    Eigen::MatrixXf& dense, vector<int8_t>& values, vector<float>& scales,
+    const float*& mapped_dense, const int8_t*& mapped_values, const float*& mapped_scales) {
+  dense.resize(0, 0);
+  values.clear();
+  scales.clear();
+  mapped_dense = nullptr;
+  mapped_values = nullptr;
+  mapped_scales = nullptr;
+
+  const size_t size = (size_t)rows * cols;
+  if (quantized) {
+    const char* v = in.ReadArray(size);
+    const char* s = (v == nullptr) ? nullptr : in.ReadArray(num_scales * sizeof(float));
+    if (s == nullptr) {
+      return false;
+    }
+    if (in.share()) {
+      mapped_values = reinterpret_cast<const int8_t*>(v);
+      mapped_scales = reinterpret_cast<const float*>(s);
+    }
+    else {
+      values.assign(v, v + size);
+      scales.assign(reinterpret_cast<const float*>(s), reinterpret_cast<const float*>(s) + num_scales);
+    }
+    return true;
+  }
+
+  const char* d = in.ReadArray(size * sizeof(float));
+  if (d == nullptr) {
+    return false;
+  }
+  if (in.share()) {
+    mapped_dense = reinterpret_cast<const float*>(d);
+  }
+  else {
+    dense = Eigen::Map<const Eigen::MatrixXf>(reinterpret_cast<const float*>(d), rows, cols);
+  }
+  return true;
+}
+
+} // namespace
+
+WeightMatrix::WeightMatrix() : rows_(0), cols_(0), mapped_dense(nullptr), mapped_values(nullptr), mapped_scales(nullptr), quantized_(false) {}
+
+WeightMatrix::WeightMatrix(const Eigen::MatrixXf& m) : rows_(m.rows()), cols_(m.cols()), dense(m),
+    mapped_dense(nullptr), mapped_values(nullptr), mapped_scales(nullptr), quantized_(false) {}
+
+void WeightMatrix::Quantize() {
+  if (quantized_) {
+    return;
+  }
+  Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> row_major = Eigen::Map<const Eigen::MatrixXf>(float_values(), rows_, cols_);
+  values.resize((size_t)rows_ * cols_);
+  scales.resize(rows_);
+  for (unsigned r = 0; r < rows_; ++r) {
+    scales[r] = QuantizeValues(row_major.data() + (size_t)r * cols_, cols_, &values[(size_t)r * cols_]);
+  }
+  dense.resize(0, 0);
+  mapped_dense = nullptr;
+  file.reset();
+  quantized_ = true;
+}
+
+bool WeightMatrix::quantized() const {
+  return quantized_;
+}
+
+bool WeightMatrix::mapped() const {
+  return file != nullptr;
+}
+
+unsigned WeightMatrix::rows() const {
+  return rows_;
+}
+
+unsigned WeightMatrix::cols() const {
+  return cols_;
+}
+
+const float* WeightMatrix::float_values() const {
+  return mapped_dense != nullptr ? mapped_dense : dense.data();
+}
+
+const int8_t* WeightMatrix::int8_values() const {
+  return mapped_values != nullptr ? mapped_values : values.data();
+}
+
+const float* WeightMatrix::row_scales() const {
+  return mapped_scales != nullptr ? mapped_scales : scales.data();
+}
+
+Eigen::VectorXf WeightMatrix::Multiply(const Eigen::VectorXf& x) const {
+  if (!quantized_) {
+    return Eigen::Map<const Eigen::MatrixXf, Eigen::Aligned>(float_values(), rows_, cols_) * x;
+  }
+  assert (x.size() == cols_);
+  const int8_t* w = int8_values();
+  const float* s = row_scales();
+  vector<int8_t> qx(cols_);
+  const float x_scale = QuantizeValues(x.data(), cols_, qx.data());
+  Eigen::VectorXf y(rows_);
+  for (unsigned r = 0; r < rows_; ++r) {
+    y(r) = DotInt8(w + (size_t)r * cols_, qx.data(), cols_) * (s[r] * x_scale);
+  }
+  return y;
+}
+
+Eigen::MatrixXf WeightMatrix::Multiply(const Eigen::MatrixXf& x) const {
+  if (!quantized_) {
+    return Eigen::Map<const Eigen::MatrixXf, Eigen::Aligned>(float_values(), rows_, cols_) * x;
+  }
+  assert (x.rows() == cols_);
+  const int8_t* w = int8_values();
+  const float* s = row_scales();
+  const unsigned batch_size = x.cols();
+  vector<int8_t> qx((size_t)cols_ * batch_size);
+  vector<float> x_scales(batch_size);
+  for (unsigned j = 0; j < batch_size; ++j) {
+    x_scales[j] = QuantizeValues(x.data() + (size_t)j * cols_, cols_, &qx[(size_t)j * cols_]);
+  }
+  // Each weight row stays in cache while it meets every column of the batch
+  Eigen::MatrixXf y(rows_, batch_size);
+  for (unsigned r = 0; r < rows_; ++r) {
+    const int8_t* row = w + (size_t)r * cols_;
+    for (unsigned j = 0; j < batch_size; ++j) {
+      y(r, j) = DotInt8(row, &qx[(size_t)j * cols_], cols_) * (s[r] * x_scales[j]);
+    }
+  }
+  return y;
+}
+
+const void* WeightMatrix::data() const {
+  return quantized_ ? (const void*)int8_values() : (const void*)float_values();
+}
+
+size_t WeightMatrix::bytes() const {
+  return (size_t)rows_ * cols_ * (quantized_ ? sizeof(int8_t) : sizeof(float));
+}
+
+const float* WeightMatrix::dense_data() const {
+  return quantized_ ? nullptr : float_values();
+}
+
+void WeightMatrix::Write(ostream& out) const {
+  WriteHeader(out, rows_, cols_, quantized_);
+  if (quantized_) {
+    WriteArray(out, int8_values(), (size_t)rows_ * cols_);
+    WriteArray(out, row_scales(), rows_ * sizeof(float));
+  }
+  else {
+    WriteArray(out, float_values(), (size_t)rows_ * cols_ * sizeof(float));
+  }
+}
+
+bool WeightMatrix::Read(ModelReader& in) {
+  file.reset();
+  if (!ReadHeader(in, rows_, cols_, quantized_) ||
+      !ReadStorage(in, rows_, cols_, quantized_, rows_, dense, values, scales, mapped_dense, mapped_values, mapped_scales)) {
+    return false;
+  }
+  if (in.share()) {
+    file = in.file();
+  }
+  return true;
+}
+
+EmbeddingTable::EmbeddingTable() : rows_(0), cols_(0), mapped_dense(nullptr), mapped_values(nullptr), mapped_scales(nullptr), quantized_(false) {}
+
+EmbeddingTable::EmbeddingTable(const Eigen::MatrixXf& m) : rows_(m.rows()), cols_(m.cols()), dense(m),
+    mapped_dense(nullptr), mapped_values(nullptr), mapped_scales(nullptr), quantized_(false) {}
+
+void EmbeddingTable::Quantize() {
+  if (quantized_) {
+    return;
+  }
+  const float* d = float_values();
+  vector<int8_t> quantized_values((size_t)rows_ * cols_);
+  scales.resize(cols_);
+  for (unsigned c = 0; c < cols_; ++c) {
+    scales[c] = QuantizeValues(d + (size_t)c * rows_, rows_, &quantized_values[(size_t)c * rows_]);
+  }
+  values.swap(quantized_values);
+  dense.resize(0, 0);
+  mapped_dense = nullptr;
+  file.reset();
+  quantized_ = true;
+}
+
+bool EmbeddingTable::quantized() const {
+  return quantized_;
+}
+
+bool EmbeddingTable::mapped() const {
+  return file != nullptr;
+}
+
+unsigned EmbeddingTable::rows() const {
+  return rows_;
+}
+
+unsigned EmbeddingTable::cols() const {
+  return cols_;
+}
+
+const float* EmbeddingTable::float_values() const {
+  return mapped_dense != nullptr ? mapped_dense : dense.data();
+}
+
+const int8_t* EmbeddingTable::int8_values() const {
+  return mapped_values != nullptr ? mapped_values : values.data();
+}
+
+const float* EmbeddingTable::column_scales() const {
+  return mapped_scales != nullptr ? mapped_scales : scales.data();
+}
+
+Eigen::VectorXf EmbeddingTable::Column(unsigned word) const {
+  assert (word < cols_);
+  if (!quantized_) {
+    return Eigen::Map<const Eigen::VectorXf>(float_values() + (size_t)word * rows_, rows_);
+  }
+  Eigen::VectorXf column(rows_);
+  const int8_t* q = int8_values() + (size_t)word * rows_;
+  const float scale = column_scales()[word];
+  for (unsigned i = 0; i < rows_; ++i) {
+    column(i) = q[i] * scale;
+  }
+  return column;
+}
+
+const void* EmbeddingTable::data() const {
+  return quantized_ ? (const void*)int8_values() : (const void*)float_values();
+}
+
+size_t EmbeddingTable::bytes() const {
+  return (size_t)rows_ * cols_ * (quantized_ ? sizeof(int8_t) : sizeof(float));
+}
+
+void EmbeddingTable::Write(ostream& out) const {
+  WriteHeader(out, rows_, cols_, quantized_);
+  if (quantized_) {
+    WriteArray(out, int8_values(), (size_t)rows_ * cols_);
+    WriteArray(out, column_scales(), cols_ * sizeof(float));
+  }
+  else {
+    WriteArray(out, float_values(), (size_t)rows_ * cols_ * sizeof(float));
+  }
+}
+
+bool EmbeddingTable::Read(ModelReader& in) {
+  file.reset();
+  if (!ReadHeader(in, rows_, cols_, quantized_) ||
+      !ReadStorage(in, rows_, cols_, quantized_, cols_, dense, values, scales, mapped_dense, mapped_values, mapped_scales)) {
+    return false;
+  }
+  if (in.share()) {
+    file = in.file();
+  }
+  return true;
+}
@@ -0,0 +1,208 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <Eigen/Eigen>
+
+using namespace std;
+
+// Symmetric int8 quantization for the cnn-free inference path. Weights keep
+// one float scale per row (per word, for embeddings), and the activations
+// they are multiplied with are quantized on the fly with one scale per column,
+// so every product is a plain int8 dot product accumulated in int32. Values
+// are kept within [-127, 127], which lets the AVX2 kernel use
+// _mm256_maddubs_epi16 without ever saturating.
+
+// The dot product of two int8 vectors of the given size
+int32_t DotInt8(const int8_t* a, const int8_t* b, unsigned size);
+
+// Quantizes size floats into quantized, and returns the scale that maps them back
+float QuantizeValues(const float* values, unsigned size, int8_t* quantized);
+
+// A whole file mapped read-only. Every process that maps the same file shares
+// the same physical pages through the page cache.
+class MappedFile {
+public:
+  explicit MappedFile(const string& filename);
+  MappedFile(const MappedFile&) = delete;
+  ~MappedFile();
+
+  bool is_open() const;
+  const char* data() const;
+  size_t size() const;
+
+private:
+  void* mapped_data;
+  size_t mapped_size;
+};
+
+// Model files align every array to kModelAlignment bytes from the start of the
+// file, so that a mapped file's arrays can be used where they lie.
+const size_t kModelAlignment = 64;
+
+// Pads out to the next aligned offset, then writes the array
+void WriteArray(ostream& out, const void* data, size_t bytes);
+
+// Reads a model from a mapped file. With share set, the large weight matrices
+// are used in place and keep the file mapped for as long as they exist.
+// Otherwise everything is copied into memory of its own.
+class ModelReader {
+public:
+  ModelReader(shared_ptr<const MappedFile> file, bool share);
+
+  bool share() const;
+  // The file, for whoever uses its arrays in place
+  shared_ptr<const MappedFile> file() const;
+
+  bool Read(void* out, size_t bytes);
+  // Returns the array that WriteArray wrote, or nullptr if the file ends first
+  const char* ReadArray(size_t bytes);
+
+private:
+  shared_ptr<const MappedFile> file_;
+  bool share_;
+  size_t offset;
+};
+
+// A weight matrix that is kept either in float or in int8 with one scale per row
+class WeightMatrix {
+public:
+  WeightMatrix();
+  explicit WeightMatrix(const Eigen::MatrixXf& m);
+
+  void Quantize();
+  bool quantized() const;
+  // Whether the weights are used in place in a mapped file
+  bool mapped() const;
+  unsigned rows() const;
+  unsigned cols() const;
+
+  Eigen::VectorXf Multiply(const Eigen::VectorXf& x) const;
+  // The same, for a batch of inputs stored as the columns of x
+  Eigen::MatrixXf Multiply(const Eigen::MatrixXf& x) const;
+
+  // The memory holding the weights, in whichever form they are stored
+  const void* data() const;
+  size_t bytes() const;
+  // The float weights, column-major, or nullptr once quantized
+  const float* dense_data() const;
+
+  void Write(ostream& out) const;
+  bool Read(ModelReader& in);
+
+private:
+  const float* float_values() const;
+  const int8_t* int8_values() const;
+  const float* row_scales() const;
+
+  unsigned rows_, cols_;
+  Eigen::MatrixXf dense;
+  vector<int8_t> values; // Row-major
+  vector<float> scales; // One per row
+  // Set instead of the three above when the weights are used in place in a mapped file
+  const float* mapped_dense;
+  const int8_t* mapped_values;
+  const float* mapped_scales;
+  shared_ptr<const MappedFile> file;
+  bool quantized_;
+};
+
+inline Eigen::VectorXf operator*(const WeightMatrix& w, const Eigen::VectorXf& x) {
+  return w.Multiply(x);
+}
+
+inline Eigen::MatrixXf operator*(const WeightMatrix& w, const Eigen::MatrixXf& x) {
+  return w.Multiply(x);
+}
+
+// An embedding table with one column per word, kept either in float or in
+// int8 with one scale per word. Quantized columns are expanded back to float
+// when they are looked up.
+class EmbeddingTable {
+public:
+  EmbeddingTable();
+  explicit EmbeddingTable(const Eigen::MatrixXf& m);
+
+  void Quantize();
+  bool quantized() const;
+  bool mapped() const;
+  unsigned rows() const; // The embedding dimension
+  unsigned cols() const; // The vocabulary size
+
+  Eigen::VectorXf Column(unsigned word) const;
+
+  const void* data() const;
+  size_t bytes() const;
+
+  void Write(ostream& out) const;
+  bool Read(ModelReader& in);
+
+private:
+  const float* float_values() const;
+  const int8_t* int8_values() const;
+  const float* column_scales() const;
+
+  unsigned rows_, cols_;
+  Eigen::MatrixXf dense;
+  vector<int8_t> values; // Column-major
+  vector<float> scales; // One per column
+  const float* mapped_dense;
+  const int8_t* mapped_values;
+  const float* mapped_scales;
+  shared_ptr<const MappedFile> file;
+  bool quantized_;
+};
+
+// Raw binary storage for the float parts of a model (biases, initial states),
+// which are small enough to always be copied
+template<class T>
+void WriteEigen(ostream& out, const T& m) {
+  uint64_t shape[2] = {(uint64_t)m.rows(), (uint64_t)m.cols()};
+  out.write(reinterpret_cast<const char*>(shape), sizeof(shape));
+  WriteArray(out, m.data(), m.size() * sizeof(float));
+}
+
+template<class T>
+bool ReadEigen(ModelReader& in, T& m) {
+  uint64_t shape[2];
+  if (!in.Read(shape, sizeof(shape))) {
+    return false;
+  }
+  if ((T::ColsAtCompileTime == 1 && shape[1] != 1) || shape[0] * shape[1] > (1ULL << 34)) {
+    return false;
+  }
+  const char* values = in.ReadArray(shape[0] * shape[1] * sizeof(float));
+  if (values == nullptr) {
+    return false;
+  }
+  m.resize(shape[0], shape[1]);
+  copy(values, values + m.size() * sizeof(float), reinterpret_cast<char*>(m.data()));
+  return true;
+}
+
+template<class T>
+void WriteEigenList(ostream& out, const vector<T>& list) {
+  uint64_t count = list.size();
+  out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  for (const T& m : list) {
+    WriteEigen(out, m);
+  }
+}
+
+template<class T>
+bool ReadEigenList(ModelReader& in, vector<T>& list) {
+  uint64_t count;
+  if (!in.Read(&count, sizeof(count)) || count > (1 << 20)) {
+    return false;
+  }
+  list.resize(count);
+  for (T& m : list) {
+    if (!ReadEigen(in, m)) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,71 @@
+#include "cnn/cnn.h"
+
+#include <boost/program_options.hpp>
+
+#include <iostream>
+
+#include "encdec.h"
+#include "modelfile.h"
+#include "inference.h"
+#include "frozenvocab.h"
+
+using namespace cnn;
+using namespace std;
+namespace po = boost::program_options;
+
+// Converts a model written by train into a stand-alone model file for predict,
+// with its weights quantized to int8 unless --keep_float is given. predict
+// --mmap can share either kind of file between processes.
+int main(int argc, char** argv) {
+  po::options_description desc("description");
+  desc.add_options()
+  ("model", po::value<string>()->required(), "Model file, as output by train")
+  ("output", po::value<string>()->required(), "Where to write the quantized model")
+  ("keep_float", "Keep the weights in float, so that decoding gives exactly the same results as the original model")
+  ("help", "Display this help message");
+
+  po::positional_options_description positional_options;
+  positional_options.add("model", 1);
+  positional_options.add("output", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << "Usage: " << argv[0] << " model output" << endl;
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  cnn::Initialize(argc, argv);
+
+  Dict* source_vocab = nullptr;
+  Dict* target_vocab = nullptr;
+  Model* cnn_model = nullptr;
+  TranslationModel* translation_model = nullptr;
+  tie(source_vocab, target_vocab, cnn_model, translation_model) = LoadModel(vm["model"].as<string>());
+  EncoderDecoderModel* generator = dynamic_cast<EncoderDecoderModel*>(translation_model);
+  if (generator == nullptr) {
+    cerr << "ERROR: Only encoder-decoder models can be converted. Attentional models are decoded with cnn." << endl;
+    return 1;
+  }
+
+  InferenceModel inference_model(*generator);
+  if (!vm.count("keep_float")) {
+    inference_model.Quantize();
+  }
+
+  // The lookup tables are built here once, so that predict can map them as they are
+  FrozenVocab source_lookup(*source_vocab, "UNK");
+  FrozenVocab target_lookup(*target_vocab, "UNK");
+
+  const string output_filename = vm["output"].as<string>();
+  if (!WriteInferenceModelFile(output_filename, source_lookup, target_lookup, inference_model)) {
+    cerr << "ERROR: Unable to write " << output_filename << endl;
+    return 1;
+  }
+  cerr << "Wrote the " << (inference_model.quantized() ? "quantized" : "float") << " model to " << output_filename << endl;
+  return 0;
+}
@@ -0,0 +1,60 @@
+#include <cassert>
+#include <cmath>
+#include <unordered_set>
+#include "sampler.h"
+
+UnigramSampler::UnigramSampler(const Bitext& bitext, float power, unsigned seed) : seed(seed), seeded_pid(0) {
+  vector<double> counts(bitext.target_vocab.size(), 0.0);
+  for (const Bitext::SentencePair& pair : bitext.sentences) {
+    for (WordId word : pair.target) {
+      counts[word] += pair.weight;
+    }
+  }
+
+  double total = 0.0;
+  for (unsigned i = 0; i < counts.size(); ++i) {
+    counts[i] = pow(counts[i], power);
+    total += counts[i];
+  }
+  assert (total > 0.0);
+
+  probabilities.resize(counts.size());
+  for (unsigned i = 0; i < counts.size(); ++i) {
+    probabilities[i] = counts[i] / total;
+  }
+  distribution = discrete_distribution<WordId>(counts.begin(), counts.end());
+}
+
+float UnigramSampler::Probability(WordId word) const {
+  return probabilities[word];
+}
+
+void UnigramSampler::BuildCandidates(const vector<WordId>& target, unsigned num_samples, vector<WordId>* candidates, vector<float>* log_correction) {
+  if (seeded_pid != getpid()) {
+    seeded_pid = getpid();
+    rng.seed(seed != 0 ? seed + seeded_pid : random_device()());
+  }
+
+  candidates->clear();
+  log_correction->clear();
+  unordered_set<WordId> seen;
+
+  // Words from the reference are always present, so their inclusion
+  // probability is one and they need no correction.
+  for (unsigned t = 1; t < target.size(); ++t) {
+    if (seen.insert(target[t]).second) {
+      candidates->push_back(target[t]);
+      log_correction->push_back(0.0f);
+    }
+  }
+
+  for (unsigned i = 0; i < num_samples; ++i) {
+    WordId word = distribution(rng);
+    if (seen.insert(word).second) {
+      // Probability that word shows up at least once in num_samples draws
+      float q = probabilities[word];
+      candidates->push_back(word);
+      log_correction->push_back(log1p(-pow(1.0f - q, (float)num_samples)));
+    }
+  }
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+#include <random>
+#include <unistd.h>
+#include "bitext.h"
+
+using namespace std;
+
+// Draws noise words from a (smoothed) unigram distribution over the target
+// vocabulary of a training bitext. Used to build the candidate sets for
+// sampled softmax training.
+class UnigramSampler {
+public:
+  UnigramSampler(const Bitext& bitext, float power = 0.75, unsigned seed = 0);
+
+  // Fills candidates with every word of target (except the leading <s>) plus
+  // num_samples noise words drawn with replacement, with duplicates removed.
+  // log_correction[i] is log P(candidates[i] is in the candidate set), which
+  // must be subtracted from that word's logit to keep the estimate unbiased.
+  void BuildCandidates(const vector<WordId>& target, unsigned num_samples, vector<WordId>* candidates, vector<float>* log_correction);
+
+  float Probability(WordId word) const;
+
+private:
+  vector<float> probabilities;
+  discrete_distribution<WordId> distribution;
+  mt19937 rng;
+  unsigned seed;
+  // cnn::mp forks its workers after the sampler is built, so each process
+  // reseeds itself the first time it draws. Otherwise every child would
+  // draw exactly the same noise words.
+  pid_t seeded_pid;
+};
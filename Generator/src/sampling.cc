@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+#include "sampling.h"
+
+WordSampler::WordSampler() {
+  SetOptions(SamplingOptions());
+}
+
+void WordSampler::SetOptions(const SamplingOptions& options, unsigned seed) {
+  assert (options.temperature > 0.0f);
+  this->options = options;
+  rng.seed(seed != 0 ? seed : random_device()());
+}
+
+WordId WordSampler::Sample(const float* log_probs, unsigned size) {
+  assert (size > 0);
+  candidates.resize(size);
+  iota(candidates.begin(), candidates.end(), 0);
+  auto more_probable = [&](unsigned a, unsigned b) {
+    return log_probs[a] > log_probs[b] || (log_probs[a] == log_probs[b] && a < b);
+  };
+
+  // Only the truncated distributions need the words in order, and only as far as they are kept
+  const bool nucleus = options.top_p < 1.0f;
+  unsigned keep = size;
+  if (options.top_k > 0 && options.top_k < size) {
+    keep = options.top_k;
+    if (nucleus) {
+      partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(), more_probable);
+    }
+    else {
+      nth_element(candidates.begin(), candidates.begin() + keep - 1, candidates.end(), more_probable);
+    }
+  }
+  else if (nucleus) {
+    sort(candidates.begin(), candidates.end(), more_probable);
+  }
+
+  float max_log_prob = log_probs[candidates[0]];
+  for (unsigned i = 1; i < keep; ++i) {
+    max_log_prob = max(max_log_prob, log_probs[candidates[i]]);
+  }
+  weights.resize(keep);
+  double total = 0.0;
+  for (unsigned i = 0; i < keep; ++i) {
+    weights[i] = exp((log_probs[candidates[i]] - max_log_prob) / options.temperature);
+    total += weights[i];
+  }
+
+  if (nucleus) {
+    double mass = 0.0;
+    unsigned i = 0;
+    while (i < keep && mass < options.top_p * total) {
+      mass += weights[i++];
+    }
+    keep = max(i, 1u);
+    total = mass > 0.0 ? mass : weights[0];
+  }
+
+  double r = uniform_real_distribution<double>(0.0, total)(rng);
+  unsigned last = 0;
+  for (unsigned i = 0; i < keep; ++i) {
+    if (weights[i] == 0.0) {
+      continue; // Includes words pruned by a class beam
+    }
+    r -= weights[i];
+    if (r < 0.0) {
+      return candidates[i];
+    }
+    last = i;
+  }
+  // Rounding can leave a sliver of r behind
+  return candidates[last];
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <random>
+#include <vector>
+#include "bitext.h"
+
+using namespace std;
+
+// How each word of a sampled translation is drawn from the model's distribution
+struct SamplingOptions {
+  // Divides the log probabilities before sampling. Below 1 sharpens the
+  // distribution, above 1 flattens it.
+  float temperature = 1.0f;
+  // Only draw from this many of the most probable words. 0 keeps every word.
+  unsigned top_k = 0;
+  // Only draw from the smallest set of most probable words whose (tempered)
+  // probability adds up to at least top_p. 1 keeps every word.
+  float top_p = 1.0f;
+};
+
+// Draws words for ancestral sampling. The same seed gives the same words for
+// the same sequence of distributions.
+class WordSampler {
+public:
+  WordSampler();
+  void SetOptions(const SamplingOptions& options, unsigned seed = 0);
+
+  // Draws a word from the size log probabilities, after applying the options
+  WordId Sample(const float* log_probs, unsigned size);
+
+private:
+  SamplingOptions options;
+  mt19937 rng;
+  // Scratch space, kept to save reallocating it for every word
+  vector<unsigned> candidates;
+  vector<double> weights;
+};
@@ -0,0 +1,58 @@
+#include <cassert>
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(unsigned num_threads) : outstanding(0), stopping(false) {
+  assert (num_threads > 0);
+  for (unsigned i = 0; i < num_threads; ++i) {
+    workers.push_back(thread(&ThreadPool::WorkerLoop, this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(m);
+    stopping = true;
+  }
+  work_available.notify_all();
+  for (thread& worker : workers) {
+    worker.join();
+  }
+}
+
+unsigned ThreadPool::size() const {
+  return workers.size();
+}
+
+void ThreadPool::Run(const vector<function<void()>>& jobs) {
+  unique_lock<mutex> lock(m);
+  for (const function<void()>& job : jobs) {
+    pending.push(job);
+  }
+  outstanding += jobs.size();
+  work_available.notify_all();
+  work_done.wait(lock, [this]() { return outstanding == 0; });
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    function<void()> job;
+    {
+      unique_lock<mutex> lock(m);
+      work_available.wait(lock, [this]() { return stopping || !pending.empty(); });
+      if (pending.empty()) {
+        return;
+      }
+      job = pending.front();
+      pending.pop();
+    }
+
+    job();
+
+    {
+      lock_guard<mutex> lock(m);
+      if (--outstanding == 0) {
+        work_done.notify_all();
+      }
+    }
+  }
+}
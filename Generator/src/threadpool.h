@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+// A fixed set of worker threads that execute batches of jobs. Run() only
+// returns once every job in the batch has finished, so each call also acts
+// as a barrier between the caller and the workers. Run() must not be called
+// from more than one thread at a time.
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned num_threads);
+  ~ThreadPool();
+
+  void Run(const vector<function<void()>>& jobs);
+  unsigned size() const;
+
+private:
+  void WorkerLoop();
+
+  vector<thread> workers;
+  queue<function<void()>> pending;
+  unsigned outstanding;
+  bool stopping;
+  mutex m;
+  condition_variable work_available;
+  condition_variable work_done;
+};
@@ -2,18 +2,25 @@
 #include "cnn/training.h"
 #include "cnn/mp.h"
 
-#include <boost/archive/text_iarchive.hpp>
-#include <boost/archive/text_oarchive.hpp>
 #include <boost/program_options.hpp>
 
 #include <iostream>
 #include <fstream>
 #include <csignal>
 #include <algorithm>
+#include <numeric>
+#include <random>
 
 #include "bitext.h"
+#include "corpusstream.h"
+#include "paramsync.h"
 #include "encdec.h"
+#include "attentional.h"
+#include "modelfile.h"
+#include "sampler.h"
+#include "wordclasses.h"
 #include "train.h"
+#include "hogwild.h"
 
 using namespace cnn;
 using namespace cnn::mp;
@@ -29,6 +36,7 @@ void ctrlc_handler(int signal) {
   else {
     cerr << "Ctrl-c pressed!" << endl;
     ctrlc_pressed = true;
+    cnn::mp::stop_requested = true;
   }
 }
 
@@ -64,28 +72,39 @@ public:
   }
 };
 
-void Serialize(Bitext& bitext, EncoderDecoderModel& generator, Model& model) {
+void Serialize(Bitext& bitext, TranslationModel& translation_model, Model& model) {
   int r = ftruncate(fileno(stdout), 0);
   fseek(stdout, 0, SEEK_SET); 
 
-  boost::archive::text_oarchive oa(cout);
-  oa & bitext.source_vocab;
-  oa & bitext.target_vocab;
-  oa << generator;
-  oa << model;
+  WriteModel(cout, bitext.source_vocab, bitext.target_vocab, translation_model, model);
 }
 
 template<class D>
 class Learner : public ILearner<D, SufficientStats> {
 public:
-  explicit Learner(Bitext* bitext, EncoderDecoderModel& generator, Model& model) : bitext(bitext), generator(generator), model(model) {}
+  // The sampled softmax is only supported by encoder-decoder models
+  explicit Learner(Bitext* bitext, TranslationModel& translation_model, Model& model, UnigramSampler* sampler = NULL, unsigned num_samples = 0) :
+    bitext(bitext), translation_model(translation_model), model(model), sampler(sampler), num_samples(num_samples) {
+    assert (sampler == NULL || dynamic_cast<EncoderDecoderModel*>(&translation_model) != NULL);
+  }
   ~Learner() {}
   SufficientStats LearnFromDatum(const D& datum, bool learn) {
     ComputationGraph cg;
-    vector<WordId> source = get<0>(datum);
-    vector<WordId> target = get<1>(datum);
-    float weight = get<2>(datum);
-    Expression loss_expr = generator.BuildGraph(source, target, cg) * weight;
+    vector<WordId> source = datum.source.ToVector();
+    vector<WordId> target = datum.target.ToVector();
+    float weight = datum.weight;
+    // The sampled objective is only used for training. Dev losses are always
+    // computed with the full softmax, so they remain true perplexities.
+    // Either way the weighted loss is the last node, which forward() and
+    // backward() start from.
+    if (learn && sampler != NULL) {
+      sampler->BuildCandidates(target, num_samples, &candidates, &log_correction);
+      EncoderDecoderModel& generator = static_cast<EncoderDecoderModel&>(translation_model);
+      generator.BuildSampledGraph(source, target, candidates, log_correction, cg) * weight;
+    }
+    else {
+      translation_model.BuildGraph(source, target, cg) * weight;
+    }
     SufficientStats loss(as_scalar(cg.forward()), (target.size() - 1) * weight, 1);
     if (learn) {
       cg.backward();
@@ -93,6 +112,50 @@ public:
     return loss;
   }
 
+  void SaveModel() {
+    cerr << "Saving model..." << endl;
+    Serialize(*bitext, translation_model, model);
+    cerr << "Done saving model." << endl;
+  }
+private:
+  Bitext* bitext;
+  TranslationModel& translation_model;
+  Model& model;
+  UnigramSampler* sampler;
+  unsigned num_samples;
+  vector<WordId> candidates;
+  vector<float> log_correction;
+};
+
+typedef vector<Bitext::SentencePair> SentencePairBatch;
+
+// Trains on whole minibatches, each run through the network as a single batched graph
+class BatchLearner : public ILearner<SentencePairBatch, SufficientStats> {
+public:
+  explicit BatchLearner(Bitext* bitext, EncoderDecoderModel& generator, Model& model) :
+    bitext(bitext), generator(generator), model(model) {}
+  ~BatchLearner() {}
+  SufficientStats LearnFromDatum(const SentencePairBatch& batch, bool learn) {
+    ComputationGraph cg;
+    sources.resize(batch.size());
+    targets.resize(batch.size());
+    weights.resize(batch.size());
+    float word_count = 0.0f;
+    for (unsigned i = 0; i < batch.size(); ++i) {
+      sources[i] = batch[i].source.ToVector();
+      targets[i] = batch[i].target.ToVector();
+      weights[i] = batch[i].weight;
+      word_count += (targets[i].size() - 1) * weights[i];
+    }
+    generator.BuildBatchGraph(sources, targets, weights, cg);
+    // The graph averages over the batch, but perplexities need the total loss
+    SufficientStats loss(as_scalar(cg.forward()) * batch.size(), word_count, batch.size());
+    if (learn) {
+      cg.backward();
+    }
+    return loss;
+  }
+
   void SaveModel() {
     cerr << "Saving model..." << endl;
     Serialize(*bitext, generator, model);
@@ -102,37 +165,94 @@ private:
   Bitext* bitext;
   EncoderDecoderModel& generator;
   Model& model;
+  vector<vector<WordId>> sources;
+  vector<vector<WordId>> targets;
+  vector<float> weights;
 };
 
-template <class RNG>
-void shuffle(Bitext& bitext, RNG& g) {
-  vector<unsigned> indices(bitext.size(), 0);
-  for (unsigned i = 0; i < bitext.size(); ++i) {
-    indices[i] = i;
+// Source lengths are bucketed into ranges this many words wide
+const unsigned kSourceBucketWidth = 4;
+
+// Groups sentence pairs into minibatches of up to batch_size pairs whose source
+// lengths fall into the same bucket. Within a bucket, pairs are sorted by target
+// length, so that batches need as little padding as possible.
+vector<SentencePairBatch> BuildMinibatches(const Bitext& bitext, unsigned batch_size) {
+  auto bucket = [](const Bitext::SentencePair& pair) { return pair.source.size() / kSourceBucketWidth; };
+  vector<unsigned> order(bitext.size());
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    const Bitext::SentencePair& x = bitext.sentences[a];
+    const Bitext::SentencePair& y = bitext.sentences[b];
+    return make_pair(bucket(x), x.target.size()) < make_pair(bucket(y), y.target.size());
+  });
+
+  vector<SentencePairBatch> batches;
+  for (unsigned i = 0; i < order.size(); ++i) {
+    const Bitext::SentencePair& pair = bitext.sentences[order[i]];
+    if (batches.size() == 0 || batches.back().size() == batch_size || bucket(batches.back()[0]) != bucket(pair)) {
+      batches.push_back(SentencePairBatch());
+    }
+    batches.back().push_back(pair);
   }
-  shuffle(indices.begin(), indices.end(), g);
-  vector<vector<WordId> > source(bitext.size());
-  vector<vector<WordId> > target(bitext.size());
-  vector<float> weights(bitext.size());
-  for (unsigned i = 0; i < bitext.size(); ++i) {
-    unsigned j = indices[i];
-    source[j] = get<0>(bitext.sentences[i]);
-    target[j] = get<1>(bitext.sentences[i]);
-    weights[j] = get<2>(bitext.sentences[i]);
+  return batches;
+}
+
+// Relative training cost of a datum, used to balance work between Hogwild
+// workers. The encoders run over the source and the decoder over the target.
+float EstimateCost(const Bitext::SentencePair& pair) {
+  return pair.source.size() + pair.target.size();
+}
+
+float EstimateCost(const SentencePairBatch& batch) {
+  unsigned max_source_length = 0;
+  unsigned max_target_length = 0;
+  for (const Bitext::SentencePair& pair : batch) {
+    max_source_length = max(max_source_length, (unsigned)pair.source.size());
+    max_target_length = max(max_target_length, (unsigned)pair.target.size());
   }
+  return batch.size() * (max_source_length + max_target_length);
+}
 
-  for (unsigned i = 0; i < bitext.size(); ++i) {
-    bitext.sentences[i] = make_tuple(source[i], target[i], weights[i]);
+// Trains with cnn's multi-process trainer, or with Hogwild workers that share one
+// model. With a parameter server or pinned workers, the Hogwild workers are always used.
+template <class D>
+void RunParallel(bool hogwild, unsigned num_children, ILearner<D, SufficientStats>* learner, Trainer* sgd, const vector<D>& train_data,
+    const vector<D>& dev_data, unsigned num_iterations, unsigned dev_frequency, unsigned report_frequency, const HogwildOptions<D>& options) {
+  if (hogwild || options.synchronize || options.pin_workers) {
+    RunHogwild<D, SufficientStats>(num_children, learner, sgd, train_data, dev_data, num_iterations, dev_frequency, report_frequency, options);
+  }
+  else {
+    RunMultiProcess<D>(num_children, learner, sgd, train_data, dev_data, num_iterations, dev_frequency, report_frequency);
   }
 }
 
+// Hogwild settings shared by every kind of datum
+template <class D>
+HogwildOptions<D> MakeHogwildOptions(unsigned random_seed, ParameterClient* client, unsigned sync_period, bool pin_workers) {
+  HogwildOptions<D> options;
+  options.random_seed = random_seed;
+  options.cost = [](const D& datum) { return EstimateCost(datum); };
+  if (client != nullptr) {
+    options.synchronize = [client]() { client->Synchronize(); };
+    options.sync_period = sync_period;
+  }
+  options.pin_workers = pin_workers;
+  return options;
+}
+
+template <class RNG>
+void shuffle(Bitext& bitext, RNG& g) {
+  // Sentence pairs are just views, so this only moves pointers around
+  shuffle(bitext.sentences.begin(), bitext.sentences.end(), g);
+}
+
 pair<cnn::real, unsigned> ComputeLoss(Bitext& bitext, EncoderDecoderModel& generator) {
   cnn::real loss = 0.0;
   unsigned word_count = 0;
   for (unsigned i = 0; i < bitext.size(); ++i) {
-    vector<WordId> source_sentence = get<0>(bitext.sentences[i]);
-    vector<WordId> target_sentence = get<1>(bitext.sentences[i]);
-    float weight = get<2>(bitext.sentences[i]);
+    vector<WordId> source_sentence = bitext.sentences[i].source.ToVector();
+    vector<WordId> target_sentence = bitext.sentences[i].target.ToVector();
+    float weight = bitext.sentences[i].weight;
     word_count += target_sentence.size() - 1; // Minus one for <s>
     ComputationGraph cg;
     generator.BuildGraph(source_sentence, target_sentence, cg);
@@ -145,6 +265,71 @@ pair<cnn::real, unsigned> ComputeLoss(Bitext& bitext, EncoderDecoderModel& gener
   return make_pair(loss, word_count);
 }
 
+// Adds the words of every shard to bitext's vocabularies, keeping only one shard in memory at a time
+unsigned ReadShardVocabularies(const vector<string>& shard_filenames, Bitext& bitext, unsigned load_threads) {
+  unsigned sentence_count = 0;
+  for (const string& filename : shard_filenames) {
+    Bitext shard;
+    shard.source_vocab = bitext.source_vocab;
+    shard.target_vocab = bitext.target_vocab;
+    if (!ReadCorpus(filename, shard, true, load_threads)) {
+      cerr << "ERROR: Unable to read " << filename << endl;
+      exit(1);
+    }
+    bitext.source_vocab = shard.source_vocab;
+    bitext.target_vocab = shard.target_vocab;
+    sentence_count += shard.size();
+  }
+  return sentence_count;
+}
+
+// Single-process equivalent of RunMultiProcess for corpora that are streamed from disk
+void RunStreaming(CorpusStream& stream, Learner<Bitext::SentencePair>& learner, Trainer* sgd, const Bitext& dev_bitext,
+    unsigned num_iterations, unsigned dev_frequency, unsigned report_frequency) {
+  SufficientStats best_dev_stats;
+  bool have_dev_stats = false;
+  auto evaluate_dev = [&](const string& label) {
+    SufficientStats dev_stats;
+    for (const Bitext::SentencePair& pair : dev_bitext.sentences) {
+      dev_stats += learner.LearnFromDatum(pair, false);
+    }
+    bool new_best = !have_dev_stats || dev_stats < best_dev_stats;
+    cerr << "**" << label << " dev perp: " << dev_stats << (new_best ? " (New best!)" : "") << endl;
+    if (new_best) {
+      best_dev_stats = dev_stats;
+      have_dev_stats = true;
+      learner.SaveModel();
+    }
+  };
+
+  for (unsigned iteration = 0; iteration < num_iterations && !ctrlc_pressed; ++iteration) {
+    stream.StartEpoch();
+    SufficientStats epoch_stats;
+    SufficientStats report_stats;
+    unsigned sentence_count = 0;
+    Bitext::SentencePair pair;
+    while (!ctrlc_pressed && stream.Next(pair)) {
+      SufficientStats stats = learner.LearnFromDatum(pair, true);
+      sgd->update(1.0);
+      epoch_stats += stats;
+      report_stats += stats;
+      sentence_count++;
+      if (sentence_count % report_frequency == 0) {
+        cerr << "--" << iteration << "." << sentence_count << " perp=" << report_stats << endl;
+        report_stats = SufficientStats();
+      }
+      if (sentence_count % dev_frequency == 0) {
+        evaluate_dev(to_string(iteration) + "." + to_string(sentence_count));
+      }
+    }
+    sgd->update_epoch();
+    cerr << "##" << iteration + 1 << " perp=" << epoch_stats << endl;
+    if (!ctrlc_pressed) {
+      evaluate_dev(to_string(iteration + 1));
+    }
+  }
+}
+
 int main(int argc, char** argv) {
   if (argc < 2) {
     cerr << "Usage: " << argv[0] << " corpus.txt" << endl;
@@ -155,13 +340,31 @@ int main(int argc, char** argv) {
 
   po::options_description desc("description");
   desc.add_options()
-  ("train_bitext", po::value<string>()->required(), "Training bitext in source ||| target format")
-  ("dev_bitext", po::value<string>()->required(), "Dev bitext, used for early stopping")
+  ("train_bitext", po::value<string>()->required(), "Training bitext in source ||| target format, or compiled with compile_corpus")
+  ("dev_bitext", po::value<string>()->required(), "Dev bitext, used for early stopping. May also be compiled.")
   ("num_iterations,i", po::value<unsigned>()->default_value(UINT_MAX), "Number of epochs to train for")
-  ("batch_size,b", po::value<unsigned>()->default_value(1), "Size of minibatches")
+  ("batch_size,b", po::value<unsigned>()->default_value(1), "Size of minibatches. Above 1, pairs are bucketed by length and each minibatch is trained as one batched graph, with one update of the minibatch's mean gradient.")
   ("random_seed,r", po::value<unsigned>()->default_value(0), "Random seed. If this value is 0 a seed will be chosen randomly.")
   ("cores,j", po::value<unsigned>()->default_value(1), "Number of CPU cores to use for training")
+  ("pin_workers", "Pin each training worker to its own core, spread across NUMA nodes, and interleave the parameters across the nodes. Implies --hogwild.")
+  ("hogwild", "Train with --cores asynchronous workers that share one model, instead of cnn's multi-process trainer. Work is balanced by sentence length, and idle workers steal from busy ones.")
   ("feed", "Feed output hidden state back into LSTM at every time step")
+  ("attentional", "Train an attentional model instead of an encoder-decoder model")
+  ("sampled_softmax", po::value<unsigned>()->default_value(0), "Train with a sampled softmax using this many noise words per sentence. 0 uses the full softmax.")
+  ("noise_power", po::value<double>()->default_value(0.75), "Exponent applied to unigram counts to form the sampled softmax noise distribution")
+  ("frequency_classes", po::value<unsigned>(), "Use a class-factored softmax with this many frequency-binned word classes")
+  ("brown_clusters", po::value<string>(), "Use a class-factored softmax with word classes from this Brown clustering paths file")
+  ("load_threads", po::value<unsigned>()->default_value(0), "Number of threads used to parse text corpora. 0 uses one per core.")
+  ("dedup", "Merge identical sentence pairs in the training corpus into one pair, weighted by the number of copies")
+  ("dedup_temperature", po::value<double>()->default_value(1.0), "With --dedup, each merged weight is raised to the power 1 / this")
+  ("max_weight", po::value<double>()->default_value(0.0), "With --dedup, cap merged weights at this value. 0 means no cap.")
+  ("stream", "Treat train_bitext as a list of corpus shards, one filename per line, and stream them from disk instead of loading the whole corpus")
+  ("shuffle_buffer", po::value<unsigned>()->default_value(100000), "Number of sentence pairs shuffled together when streaming")
+  ("param_server", po::value<string>(), "Train as one node of a distributed run, sharing parameters through the param_server at this host:port or Unix socket path")
+  ("num_nodes", po::value<unsigned>()->default_value(1), "With --param_server, the number of training nodes. Each node trains on its own 1/num_nodes of the corpus.")
+  ("node_index", po::value<unsigned>()->default_value(0), "With --param_server, which slice of the corpus this node trains on, from 0 to num_nodes - 1")
+  ("sync_period", po::value<unsigned>()->default_value(100), "With --param_server, exchange parameters after this many training sentences (minibatches with --batch_size)")
+  ("top_k", po::value<double>()->default_value(1.0), "With --param_server, send only this fraction of the changed embedding rows at each exchange, largest change first. The rest is sent later.")
   // Optimizer configuration
   ("sgd", "Use SGD for optimization")
   ("momentum", po::value<double>(), "Use SGD with this momentum value")
@@ -178,6 +381,7 @@ int main(int argc, char** argv) {
   ("regularization", po::value<double>()->default_value(0.0), "L2 Regularization strength")
   ("eta_decay", po::value<double>()->default_value(0.05), "Learning rate decay rate (SGD only)")
   ("no_clipping", "Disable clipping of gradients")
+  ("lazy_sparse", "Only update the embedding rows that were used since the last update. Rows catch up on decay when next used. (Adagrad, RMSProp, and Adam only)")
   ("model", po::value<string>(), "Reload this model and continue learning")
   // End optimizer configuration
   ("help", "Display this help message");
@@ -199,44 +403,165 @@ int main(int argc, char** argv) {
   const string train_bitext_filename = vm["train_bitext"].as<string>();
   const string dev_bitext_filename = vm["dev_bitext"].as<string>();
   const unsigned num_iterations = vm["num_iterations"].as<unsigned>();
-  const unsigned random_seed = vm["random_seed"].as<unsigned>();
+  // Resolved once, so that cnn, the samplers, the shuffles and the Hogwild workers all use the same seed
+  unsigned random_seed = vm["random_seed"].as<unsigned>();
+  if (random_seed == 0) {
+    random_seed = random_device()();
+  }
   const unsigned batch_size = vm["batch_size"].as<unsigned>();
   const unsigned num_children = vm["cores"].as<unsigned>();
   const unsigned feed = vm.count("feed") > 0;
+  const bool attentional = vm.count("attentional") > 0;
+  const unsigned num_samples = vm["sampled_softmax"].as<unsigned>();
+  const bool streaming = vm.count("stream") > 0;
+  const bool hogwild = vm.count("hogwild") > 0;
+  const bool pin_workers = vm.count("pin_workers") > 0;
+  const unsigned load_threads = vm["load_threads"].as<unsigned>();
+  const unsigned num_nodes = vm["num_nodes"].as<unsigned>();
+  const unsigned node_index = vm["node_index"].as<unsigned>();
+  if (!(vm["dedup_temperature"].as<double>() > 0.0) || !(vm["max_weight"].as<double>() >= 0.0)) {
+    cerr << "Invalid parameters: --dedup_temperature must be positive and --max_weight must not be negative." << endl;
+    exit(1);
+  }
+  if (node_index >= num_nodes) {
+    cerr << "Invalid parameters: --node_index must be less than --num_nodes." << endl;
+    exit(1);
+  }
+  // Without a parameter server, a node would quietly train on its slice alone
+  if (!vm.count("param_server") && (num_nodes > 1 || node_index > 0)) {
+    cerr << "Invalid parameters: --num_nodes and --node_index need --param_server." << endl;
+    exit(1);
+  }
+  if (vm.count("param_server") && vm["sync_period"].as<unsigned>() == 0) {
+    cerr << "Invalid parameters: --sync_period must be positive." << endl;
+    exit(1);
+  }
+
+  vector<string> shard_filenames;
+  if (streaming) {
+    if (num_children > 1) {
+      cerr << "Invalid parameters: --stream only supports training with a single core." << endl;
+      exit(1);
+    }
+    if (vm.count("dedup")) {
+      cerr << "Invalid parameters: --dedup needs the whole corpus in memory. Deduplicate shards with compile_corpus --dedup instead." << endl;
+      exit(1);
+    }
+    if (num_samples > 0 || vm.count("frequency_classes")) {
+      cerr << "Invalid parameters: --sampled_softmax and --frequency_classes need word counts from the whole corpus, and cannot be combined with --stream." << endl;
+      exit(1);
+    }
+    if (batch_size > 1) {
+      cerr << "Invalid parameters: --batch_size cannot be combined with --stream." << endl;
+      exit(1);
+    }
+    if (vm.count("param_server")) {
+      cerr << "Invalid parameters: --param_server cannot be combined with --stream." << endl;
+      exit(1);
+    }
+    if (hogwild || pin_workers) {
+      cerr << "Invalid parameters: --hogwild and --pin_workers cannot be combined with --stream." << endl;
+      exit(1);
+    }
+    shard_filenames = ReadShardList(train_bitext_filename);
+    if (shard_filenames.size() == 0) {
+      cerr << "ERROR: No shards listed in " << train_bitext_filename << endl;
+      exit(1);
+    }
+  }
 
   cnn::Initialize(argc, argv, random_seed, true);
   std::mt19937 rndeng(42);
   Model* cnn_model = new Model();
-  EncoderDecoderModel* generator = new EncoderDecoderModel();
+  TranslationModel* translation_model = nullptr;
 
   Bitext train_bitext;
   if (vm.count("model")) {
-    const string model_filename = vm["model"].as<string>();
-    ifstream model_file(model_filename);
-    if (!model_file.is_open()) {
-      cerr << "ERROR: Unable to open " << model_filename << endl;
-      exit(1);
-    }
-    boost::archive::text_iarchive ia(model_file);
-
-    ia & train_bitext.source_vocab;
-    ia & train_bitext.target_vocab;
-    train_bitext.source_vocab.Freeze();
-    train_bitext.target_vocab.Freeze();
-
-    ia & *generator;
-    generator->InitializeParameters(*cnn_model, train_bitext.source_vocab.size(), train_bitext.target_vocab.size(), true);
-    ia & *cnn_model;
+    Dict* source_vocab = nullptr;
+    Dict* target_vocab = nullptr;
+    tie(source_vocab, target_vocab, cnn_model, translation_model) = LoadModel(vm["model"].as<string>(), true);
+    train_bitext.source_vocab = *source_vocab;
+    train_bitext.target_vocab = *target_vocab;
   }
 
-  ReadCorpus(train_bitext_filename, train_bitext, true);
-  cerr << "Read " << train_bitext.size() << " lines from " << train_bitext_filename << endl;
+  if (streaming) {
+    if (!vm.count("model")) {
+      unsigned sentence_count = ReadShardVocabularies(shard_filenames, train_bitext, load_threads);
+      cerr << "Found " << sentence_count << " lines in " << shard_filenames.size() << " shards" << endl;
+    }
+  }
+  else {
+    ReadCorpus(train_bitext_filename, train_bitext, true, load_threads);
+    cerr << "Read " << train_bitext.size() << " lines from " << train_bitext_filename << endl;
+    if (vm.count("dedup")) {
+      unsigned removed = DeduplicateBitext(train_bitext, vm["dedup_temperature"].as<double>(), vm["max_weight"].as<double>());
+      cerr << "Merged " << removed << " duplicate sentence pairs, leaving " << train_bitext.size() << endl;
+    }
+    // Every node reads the whole corpus, so that all nodes build the same vocabularies
+    if (num_nodes > 1) {
+      vector<Bitext::SentencePair> slice;
+      for (unsigned i = node_index; i < train_bitext.size(); i += num_nodes) {
+        slice.push_back(train_bitext.sentences[i]);
+      }
+      train_bitext.sentences.swap(slice);
+      cerr << "Node " << node_index << " of " << num_nodes << " trains on " << train_bitext.size() << " sentence pairs" << endl;
+    }
+  }
   cerr << "Vocab size: " << train_bitext.source_vocab.size() << "/" << train_bitext.target_vocab.size() << endl; 
   if (!vm.count("model")) {
-    generator = new EncoderDecoderModel(*cnn_model, train_bitext.source_vocab.size(), train_bitext.target_vocab.size(), true, feed);
+    WordClasses* word_classes = NULL;
+    if (vm.count("frequency_classes") && vm.count("brown_clusters")) {
+      cerr << "Invalid parameters: Please specify only one source of word classes." << endl;
+      exit(1);
+    }
+    else if (vm.count("frequency_classes")) {
+      word_classes = new WordClasses();
+      BuildFrequencyClasses(train_bitext, vm["frequency_classes"].as<unsigned>(), *word_classes);
+    }
+    else if (vm.count("brown_clusters")) {
+      const string clusters_filename = vm["brown_clusters"].as<string>();
+      word_classes = new WordClasses();
+      if (!ReadBrownClusters(clusters_filename, train_bitext.target_vocab, *word_classes)) {
+        cerr << "ERROR: Unable to open " << clusters_filename << endl;
+        exit(1);
+      }
+    }
+    if (word_classes != NULL) {
+      cerr << "Using a class-factored softmax with " << word_classes->num_classes() << " word classes" << endl;
+      if (num_samples > 0) {
+        cerr << "Invalid parameters: The sampled softmax cannot be combined with a class-factored softmax." << endl;
+        exit(1);
+      }
+    }
+    if (attentional) {
+      if (feed || word_classes != NULL) {
+        cerr << "Invalid parameters: Attentional models support neither --feed nor a class-factored softmax." << endl;
+        exit(1);
+      }
+      translation_model = new AttentionalModel(*cnn_model, train_bitext.source_vocab.size(), train_bitext.target_vocab.size());
+    }
+    else {
+      translation_model = new EncoderDecoderModel(*cnn_model, train_bitext.source_vocab.size(), train_bitext.target_vocab.size(), true, feed, word_classes);
+    }
+  }
+  // Null for attentional models, which only support the basic training loop
+  EncoderDecoderModel* generator = dynamic_cast<EncoderDecoderModel*>(translation_model);
+  if (generator == nullptr && num_samples > 0) {
+    cerr << "Invalid parameters: Attentional models do not support the sampled softmax." << endl;
+    exit(1);
   }
 
   Trainer* sgd = CreateTrainer(*cnn_model, vm);
+  if (pin_workers && InterleaveParameters(*cnn_model)) {
+    cerr << "Interleaved the parameters across " << NumaNodeCount() << " NUMA nodes" << endl;
+  }
+  ParameterClient* client = nullptr;
+  const unsigned sync_period = vm["sync_period"].as<unsigned>();
+  if (vm.count("param_server")) {
+    client = new ParameterClient(*cnn_model, vm["param_server"].as<string>(), vm["top_k"].as<double>());
+    client->Initialize();
+    cerr << "Connected to the parameter server at " << vm["param_server"].as<string>() << endl;
+  }
   Bitext dev_bitext; 
   // TODO: The vocabulary objects really need to be tied. This is a really ghetto way of doing it
   dev_bitext.source_vocab = train_bitext.source_vocab;
@@ -250,7 +575,7 @@ int main(int argc, char** argv) {
   dev_bitext.target_vocab.Freeze();
   dev_bitext.target_vocab.SetUnk("UNK");
 
-  ReadCorpus(dev_bitext_filename, dev_bitext, true);
+  ReadCorpus(dev_bitext_filename, dev_bitext, true, load_threads);
   // Make sure the vocabulary sizes didn't change. If the dev set contains any words not in the training set, that's a problem!
   assert (initial_source_vocab_size == dev_bitext.source_vocab.size());
   assert (initial_target_vocab_size == dev_bitext.target_vocab.size());
@@ -259,8 +584,36 @@ int main(int argc, char** argv) {
 
   unsigned dev_frequency = 10000;
   unsigned report_frequency = 50;
-  Learner<Bitext::SentencePair> learner(&train_bitext, *generator, *cnn_model);
-  RunMultiProcess<Bitext::SentencePair>(num_children, &learner, sgd, train_bitext.sentences, dev_bitext.sentences, num_iterations, dev_frequency, report_frequency);
+  UnigramSampler* sampler = NULL;
+  if (num_samples > 0) {
+    sampler = new UnigramSampler(train_bitext, vm["noise_power"].as<double>(), random_seed);
+    cerr << "Using sampled softmax with " << num_samples << " noise samples per sentence" << endl;
+  }
+
+  if (batch_size > 1) {
+    if (generator == nullptr || num_samples > 0 || generator->IsClassFactored()) {
+      cerr << "Invalid parameters: Batched training only supports encoder-decoder models with the full softmax." << endl;
+      exit(1);
+    }
+    vector<SentencePairBatch> train_batches = BuildMinibatches(train_bitext, batch_size);
+    vector<SentencePairBatch> dev_batches = BuildMinibatches(dev_bitext, batch_size);
+    cerr << "Bucketed " << train_bitext.size() << " sentence pairs into " << train_batches.size() << " minibatches" << endl;
+    // The trainers count minibatches, so keep reporting every so many sentence pairs
+    dev_frequency = max(dev_frequency / batch_size, 1U);
+    report_frequency = max(report_frequency / batch_size, 1U);
+    BatchLearner learner(&train_bitext, *generator, *cnn_model);
+    RunParallel<SentencePairBatch>(hogwild, num_children, &learner, sgd, train_batches, dev_batches, num_iterations, dev_frequency, report_frequency, MakeHogwildOptions<SentencePairBatch>(random_seed, client, sync_period, pin_workers));
+    return 0;
+  }
+
+  Learner<Bitext::SentencePair> learner(&train_bitext, *translation_model, *cnn_model, sampler, num_samples);
+  if (streaming) {
+    CorpusStream stream(shard_filenames, train_bitext.source_vocab, train_bitext.target_vocab, vm["shuffle_buffer"].as<unsigned>(), random_seed);
+    RunStreaming(stream, learner, sgd, dev_bitext, num_iterations, dev_frequency, report_frequency);
+  }
+  else {
+    RunParallel<Bitext::SentencePair>(hogwild, num_children, &learner, sgd, train_bitext.sentences, dev_bitext.sentences, num_iterations, dev_frequency, report_frequency, MakeHogwildOptions<Bitext::SentencePair>(random_seed, client, sync_period, pin_workers));
+  }
 
   /*cerr << "Training model...\n";
   unsigned minibatch_count = 0;
@@ -275,9 +628,9 @@ int main(int argc, char** argv) {
     double tloss = 0.0;
     for (unsigned i = 0; i < train_bitext.size(); ++i) {
       //cerr << "Reading sentence pair #" << i << endl;
-      vector<WordId>& source_sentence = get<0>(train_bitext.sentences[i]);
-      vector<WordId>& target_sentence = get<1>(train_bitext.sentences[i]);
-      float weight = get<2>(train_bitext.sentences[i]);
+      vector<WordId> source_sentence = train_bitext.sentences[i].source.ToVector();
+      vector<WordId> target_sentence = train_bitext.sentences[i].target.ToVector();
+      float weight = train_bitext.sentences[i].weight;
       word_count += target_sentence.size() - 1; // Minus one for <s>
       tword_count += target_sentence.size() - 1; // Minus one for <s>
       ComputationGraph cg;
@@ -1,4 +1,5 @@
 #include "cnn/mp.h"
+#include "lazytrainer.h"
 using namespace cnn;
 using namespace std;
 namespace po = boost::program_options;
@@ -7,11 +8,16 @@ Trainer* CreateTrainer(Model& model, const po::variables_map& vm) {
   double regularization_strength = vm["regularization"].as<double>();
   double eta_decay = vm["eta_decay"].as<double>();
   bool clipping_enabled = (vm.count("no_clipping") == 0);
+  bool lazy = (vm.count("lazy_sparse") > 0);
   unsigned learner_count = vm.count("sgd") + vm.count("momentum") + vm.count("adagrad") + vm.count("adadelta") + vm.count("rmsprop") + vm.count("adam");
   if (learner_count > 1) {
     cerr << "Invalid parameters: Please specify only one learner type.";
     exit(1);
   }
+  if (lazy && !(vm.count("adagrad") || vm.count("rmsprop") || vm.count("adam"))) {
+    cerr << "Invalid parameters: --lazy_sparse only works with Adagrad, RMSProp and Adam.";
+    exit(1);
+  }
 
   Trainer* trainer = NULL;
   if (vm.count("momentum")) {
@@ -22,7 +28,12 @@ Trainer* CreateTrainer(Model& model, const po::variables_map& vm) {
   else if (vm.count("adagrad")) {
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.1;
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-20;
-    trainer = new AdagradTrainer(&model, regularization_strength, learning_rate, eps);
+    if (lazy) {
+      trainer = new LazyAdagradTrainer(&model, regularization_strength, learning_rate, eps);
+    }
+    else {
+      trainer = new AdagradTrainer(&model, regularization_strength, learning_rate, eps);
+    }
   }
   else if (vm.count("adadelta")) {
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-6;
@@ -33,14 +44,24 @@ Trainer* CreateTrainer(Model& model, const po::variables_map& vm) {
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.1;
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-20;
     double rho = (vm.count("rho")) ? vm["rho"].as<double>() : 0.95;
-    trainer = new RmsPropTrainer(&model, regularization_strength, learning_rate, eps, rho);
+    if (lazy) {
+      trainer = new LazyRmsPropTrainer(&model, regularization_strength, learning_rate, eps, rho);
+    }
+    else {
+      trainer = new RmsPropTrainer(&model, regularization_strength, learning_rate, eps, rho);
+    }
   }
   else if (vm.count("adam")) {
     double alpha = (vm.count("alpha")) ? vm["alpha"].as<double>() : 0.001;
     double beta1 = (vm.count("beta1")) ? vm["beta1"].as<double>() : 0.9;
     double beta2 = (vm.count("beta2")) ? vm["beta2"].as<double>() : 0.999;
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-8;
-    trainer = new AdamTrainer(&model, regularization_strength, alpha, beta1, beta2, eps);
+    if (lazy) {
+      trainer = new LazyAdamTrainer(&model, regularization_strength, alpha, beta1, beta2, eps);
+    }
+    else {
+      trainer = new AdamTrainer(&model, regularization_strength, alpha, beta1, beta2, eps);
+    }
   }
   else { /* sgd */
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.1;
@@ -0,0 +1,32 @@
+#pragma once
+#include <vector>
+#include "bitext.h"
+#include "kbestlist.h"
+#include "lrucache.h"
+
+using namespace std;
+
+// Everything that determines the k-best list produced for a source sentence
+struct TranslationKey {
+  vector<WordId> source;
+  unsigned kbest_size;
+  unsigned beam_size;
+  unsigned max_length;
+
+  bool operator==(const TranslationKey& other) const {
+    return source == other.source && kbest_size == other.kbest_size && beam_size == other.beam_size && max_length == other.max_length;
+  }
+};
+
+struct TranslationKeyHash {
+  size_t operator()(const TranslationKey& key) const {
+    size_t seed = WordIdSequenceHash()(key.source);
+    boost::hash_combine(seed, key.kbest_size);
+    boost::hash_combine(seed, key.beam_size);
+    boost::hash_combine(seed, key.max_length);
+    return seed;
+  }
+};
+
+// Caches complete k-best lists, since the same source phrases come up over and over
+typedef LRUCache<TranslationKey, KBestList<vector<WordId>>, TranslationKeyHash> TranslationCache;
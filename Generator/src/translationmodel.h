@@ -0,0 +1,43 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include "cnn/cnn.h"
+#include "cnn/expr.h"
+#include "cnn/rnn.h"
+#include "bitext.h"
+
+using namespace std;
+using namespace cnn;
+using namespace cnn::expr;
+
+// What StartDecoding builds from the source sentence, shared by every
+// hypothesis decoded from it. Each model derives the parts it needs.
+struct SourceState {
+  virtual ~SourceState() {}
+};
+
+// Where a partial translation is in a model's output network. Each model only
+// uses the fields it needs.
+struct DecoderState {
+  Expression output_state;
+  Expression context; // Attentional models only
+  RNNPointer rnn_pointer;
+  WordId prev_word;
+  shared_ptr<const SourceState> source;
+};
+
+// The interface train and the beam search decoder need from a model.
+// StartDecoding builds everything that depends only on the source sentence,
+// once, and every hypothesis in the beam then steps from its own DecoderState.
+class TranslationModel {
+public:
+  virtual ~TranslationModel() {}
+  // The training loss of target given source
+  virtual Expression BuildGraph(const vector<WordId>& source, const vector<WordId>& target, ComputationGraph& cg) = 0;
+  virtual DecoderState StartDecoding(const vector<WordId>& source, WordId kSOS, ComputationGraph& cg) = 0;
+  virtual DecoderState AddOutputWord(const DecoderState& state, WordId word, ComputationGraph& cg) = 0;
+  // Log probabilities of the next word. If class_beam > 0 and the model supports it, only
+  // some words are scored and word_ids receives the word of each row. Otherwise word_ids
+  // is left empty and row j is the score of word j.
+  virtual Expression ComputeLogOutputDistribution(const DecoderState& state, unsigned class_beam, vector<WordId>* word_ids, ComputationGraph& cg) = 0;
+};
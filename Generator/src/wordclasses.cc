@@ -0,0 +1,101 @@
+#include <fstream>
+#include <map>
+#include <algorithm>
+#include <cassert>
+#include "wordclasses.h"
+#include "utils.h"
+#include "tokenizer.h"
+
+unsigned WordClasses::num_classes() const {
+  return class_words.size();
+}
+
+unsigned WordClasses::vocab_size() const {
+  return word_class.size();
+}
+
+void WordClasses::AddWord(WordId word, unsigned c) {
+  if (word_class.size() <= (unsigned)word) {
+    word_class.resize(word + 1);
+    index_in_class.resize(word + 1);
+  }
+  if (class_words.size() <= c) {
+    class_words.resize(c + 1);
+  }
+  word_class[word] = c;
+  index_in_class[word] = class_words[c].size();
+  class_words[c].push_back(word);
+}
+
+void BuildFrequencyClasses(const Bitext& bitext, unsigned num_classes, WordClasses& classes) {
+  const unsigned vocab_size = bitext.target_vocab.size();
+  assert (num_classes > 0 && num_classes <= vocab_size);
+
+  vector<double> counts(vocab_size, 0.0);
+  double total = 0.0;
+  for (const Bitext::SentencePair& pair : bitext.sentences) {
+    for (WordId word : pair.target) {
+      counts[word] += pair.weight;
+      total += pair.weight;
+    }
+  }
+
+  vector<WordId> words(vocab_size);
+  for (unsigned i = 0; i < vocab_size; ++i) {
+    words[i] = i;
+  }
+  stable_sort(words.begin(), words.end(), [&](WordId a, WordId b) { return counts[a] > counts[b]; });
+
+  classes = WordClasses();
+  double cumulative = 0.0;
+  unsigned c = 0;
+  for (unsigned i = 0; i < vocab_size; ++i) {
+    WordId word = words[i];
+    classes.AddWord(word, c);
+    cumulative += counts[word];
+    // Move on to the next class once this one has its share of the mass,
+    // but never leave the remaining classes with no words.
+    unsigned words_left = vocab_size - i - 1;
+    bool full = cumulative >= total * (c + 1) / num_classes;
+    if (c + 1 < num_classes && (full || words_left <= num_classes - c - 1)) {
+      ++c;
+    }
+  }
+}
+
+bool ReadBrownClusters(const string& filename, Dict& target_vocab, WordClasses& classes) {
+  ifstream f(filename);
+  if (!f.is_open()) {
+    return false;
+  }
+
+  map<string, unsigned> cluster_ids;
+  vector<int> assignment(target_vocab.size(), -1);
+  TokenBuffers buffers;
+  for (string line; getline(f, line);) {
+    vector<StringPiece>& parts = buffers.fields;
+    Split(line, "\t", parts);
+    if (parts.size() < 2) {
+      continue;
+    }
+    const string bits = parts[0].to_string();
+    const string& word = buffers.Word(parts[1]);
+    if (!target_vocab.Contains(word)) {
+      continue;
+    }
+    if (cluster_ids.find(bits) == cluster_ids.end()) {
+      unsigned id = cluster_ids.size();
+      cluster_ids[bits] = id;
+    }
+    assignment[target_vocab.Convert(word)] = cluster_ids[bits];
+  }
+
+  // Cluster ids are only handed out to words in the vocabulary, so no class
+  // ends up empty. The extra class only exists if some word was uncovered.
+  classes = WordClasses();
+  const unsigned unclustered = cluster_ids.size();
+  for (unsigned i = 0; i < assignment.size(); ++i) {
+    classes.AddWord(i, assignment[i] >= 0 ? assignment[i] : unclustered);
+  }
+  return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <boost/serialization/access.hpp>
+#include <boost/serialization/vector.hpp>
+#include "bitext.h"
+
+using namespace std;
+
+// A partition of the target vocabulary into classes, used by the
+// class-factored softmax: p(w | h) = p(class(w) | h) * p(w | class(w), h)
+struct WordClasses {
+  vector<unsigned> word_class; // The class each word belongs to
+  vector<unsigned> index_in_class; // The position of each word inside its class
+  vector<vector<WordId>> class_words; // The members of each class
+
+  unsigned num_classes() const;
+  unsigned vocab_size() const;
+  void AddWord(WordId word, unsigned c);
+
+private:
+  friend class boost::serialization::access;
+  template<class Archive> void serialize(Archive& ar, const unsigned int) {
+    ar & word_class;
+    ar & index_in_class;
+    ar & class_words;
+  }
+};
+
+// Bins the target vocabulary into num_classes classes of roughly equal unigram
+// probability mass, so that frequent words end up in small classes.
+void BuildFrequencyClasses(const Bitext& bitext, unsigned num_classes, WordClasses& classes);
+
+// Reads a Brown clustering "paths" file (bitstring \t word \t count). Target
+// words that do not appear in the file are put into one extra class.
+bool ReadBrownClusters(const string& filename, Dict& target_vocab, WordClasses& classes);
@@ -0,0 +1,151 @@
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include "bitext.h"
+#include "check.h"
+
+using namespace std;
+
+string Words(Dict& vocab, const WordIdSpan& sentence) {
+  string words;
+  for (WordId w : sentence) {
+    words += (words.empty() ? "" : " ") + vocab.Convert(w);
+  }
+  return words;
+}
+
+// The corpus as text, independent of how the words happen to be numbered
+string Describe(Bitext& bitext) {
+  ostringstream out;
+  for (const Bitext::SentencePair& pair : bitext.sentences) {
+    out << pair.weight << " ||| " << Words(bitext.source_vocab, pair.source) << " ||| "
+        << Words(bitext.target_vocab, pair.target) << "\n";
+  }
+  return out.str();
+}
+
+void WriteText(const string& filename, unsigned num_lines) {
+  ofstream out(filename);
+  for (unsigned i = 0; i < num_lines; ++i) {
+    if (i % 3 == 0) {
+      out << (i % 4 + 1) * 0.5 << " ||| ";
+    }
+    out << "a b" << i % 7 << " c ||| x y" << i % 5 << "\n";
+  }
+}
+
+// However the text is split between threads, the result is the same
+void TestThreads() {
+  TempFile text;
+  WriteText(text.name(), 200);
+  Bitext single;
+  CHECK(ReadCorpus(text.name(), single, true, 1));
+  CHECK(single.size() == 200);
+  CHECK(single.sentences[0].weight == 0.5f && single.sentences[1].weight == 1.0f);
+  CHECK(Words(single.source_vocab, single.sentences[8].source) == "<s> a b1 c </s>");
+  for (unsigned threads : {2, 3, 7}) {
+    Bitext parallel;
+    CHECK(ReadCorpus(text.name(), parallel, true, threads));
+    CHECK(Describe(parallel) == Describe(single));
+    // Including the ids, which number the words in order of appearance
+    for (unsigned i = 0; i < single.size(); ++i) {
+      CHECK(parallel.sentences[i].source.ToVector() == single.sentences[i].source.ToVector());
+      CHECK(parallel.sentences[i].target.ToVector() == single.sentences[i].target.ToVector());
+    }
+  }
+}
+
+void TestCompiledRoundTrip(bool add_bos_eos) {
+  TempFile text, compiled;
+  WriteText(text.name(), 100);
+  Bitext original;
+  CHECK(ReadCorpus(text.name(), original, add_bos_eos));
+  CHECK(WriteCompiledCorpus(compiled.name(), original, add_bos_eos));
+  CHECK(IsCompiledCorpus(compiled.name()));
+  CHECK(!IsCompiledCorpus(text.name()));
+
+  Bitext read;
+  CHECK(ReadCorpus(compiled.name(), read, add_bos_eos));
+  CHECK(read.size() == original.size());
+  CHECK(read.source_vocab.size() == original.source_vocab.size());
+  CHECK(Describe(read) == Describe(original));
+
+  // Into an existing vocabulary, as for a dev set, the words are renumbered
+  Bitext dev;
+  dev.source_vocab.Convert("first");
+  dev.target_vocab.Convert("first");
+  CHECK(ReadCorpus(compiled.name(), dev, add_bos_eos));
+  CHECK(Describe(dev) == Describe(original));
+
+  // The boundary markers are part of the format
+  Bitext mismatched;
+  CHECK(!ReadCorpus(compiled.name(), mismatched, !add_bos_eos));
+}
+
+// Damaged files are rejected, never read past their end
+void TestCorrupt() {
+  TempFile text, compiled, damaged;
+  WriteText(text.name(), 50);
+  Bitext original;
+  CHECK(ReadCorpus(text.name(), original, true));
+  CHECK(WriteCompiledCorpus(compiled.name(), original, true));
+  ifstream in(compiled.name(), ios::binary);
+  const string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+  for (size_t length : {(size_t)20, (size_t)100, contents.size() / 2, contents.size() - 1}) {
+    {
+      ofstream out(damaged.name(), ios::binary);
+      out.write(contents.data(), length);
+    }
+    Bitext read;
+    CHECK(!ReadCorpus(damaged.name(), read, true));
+  }
+
+  // The header's weights_offset, after the magic, flags and three counts,
+  // pointing far past the end of the file
+  string corrupt = contents;
+  corrupt[40 + 7] = 0x7f;
+  {
+    ofstream out(damaged.name(), ios::binary);
+    out.write(corrupt.data(), corrupt.size());
+  }
+  Bitext read;
+  CHECK(!ReadCorpus(damaged.name(), read, true));
+}
+
+void TestDeduplicate() {
+  TempFile text;
+  {
+    ofstream out(text.name());
+    out << "a ||| x\n";
+    out << "2 ||| a ||| x\n";
+    out << "a ||| y\n";
+    out << "b ||| x\n";
+    out << "0.5 ||| a ||| x\n";
+    out << "b ||| x\n";
+  }
+  {
+    Bitext bitext;
+    CHECK(ReadCorpus(text.name(), bitext, false));
+    CHECK(DeduplicateBitext(bitext) == 3);
+    CHECK(Describe(bitext) == "3.5 ||| a ||| x\n1 ||| a ||| y\n2 ||| b ||| x\n");
+  }
+  {
+    Bitext bitext;
+    CHECK(ReadCorpus(text.name(), bitext, false));
+    CHECK(DeduplicateBitext(bitext, 2.0f, 1.5f) == 3);
+    CHECK(bitext.size() == 3);
+    CHECK_NEAR(bitext.sentences[0].weight, 1.5f, 1e-6);
+    CHECK_NEAR(bitext.sentences[1].weight, 1.0f, 1e-6);
+    CHECK_NEAR(bitext.sentences[2].weight, sqrt(2.0f), 1e-6);
+  }
+}
+
+int main() {
+  TestThreads();
+  TestCompiledRoundTrip(true);
+  TestCompiledRoundTrip(false);
+  TestCorrupt();
+  TestDeduplicate();
+  return TestResult("bitext_test");
+}
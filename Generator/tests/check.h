@@ -0,0 +1,62 @@
+#pragma once
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+// Just enough of a test framework for the unit tests: failed checks are
+// reported with their location, and TestResult gives the exit status.
+
+inline unsigned& CheckFailures() {
+  static unsigned failures = 0;
+  return failures;
+}
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+      CheckFailures()++; \
+    } \
+  } while (false)
+
+#define CHECK_NEAR(a, b, tolerance) \
+  do { \
+    const double check_a = (a), check_b = (b); \
+    if (!(std::fabs(check_a - check_b) <= (tolerance))) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_NEAR(" #a ", " #b ") failed: " \
+          << check_a << " vs " << check_b << std::endl; \
+      CheckFailures()++; \
+    } \
+  } while (false)
+
+inline int TestResult(const char* name) {
+  if (CheckFailures() > 0) {
+    std::cerr << name << ": " << CheckFailures() << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cerr << name << ": OK" << std::endl;
+  return 0;
+}
+
+// A uniquely named scratch file, removed when the test is done with it
+class TempFile {
+public:
+  TempFile() {
+    char pattern[] = "/tmp/generator_test.XXXXXX";
+    int fd = mkstemp(pattern);
+    if (fd != -1) {
+      close(fd);
+    }
+    name_ = pattern;
+  }
+  ~TempFile() { unlink(name_.c_str()); }
+  TempFile(const TempFile&) = delete;
+  TempFile& operator=(const TempFile&) = delete;
+
+  const std::string& name() const { return name_; }
+
+private:
+  std::string name_;
+};
@@ -0,0 +1,87 @@
+#include <random>
+#include <vector>
+#include "fixedkernels.h"
+#include "check.h"
+
+using namespace std;
+
+mt19937 rng(1234);
+
+Eigen::MatrixXf RandomMatrix(unsigned rows, unsigned cols) {
+  // Small values keep the gates away from saturation, where errors would hide
+  normal_distribution<float> normal(0.0f, 0.1f);
+  Eigen::MatrixXf m(rows, cols);
+  for (unsigned i = 0; i < m.size(); ++i) {
+    m.data()[i] = normal(rng);
+  }
+  return m;
+}
+
+Eigen::ArrayXf Sigmoid(const Eigen::VectorXf& x) {
+  return (1.0f + (-x.array()).exp()).inverse();
+}
+
+// Runs a few steps of the kernel for these sizes next to the plain Eigen
+// equations of InferenceLSTM and checks that they stay in agreement
+void TestLSTMCell(unsigned input_dim, unsigned hidden_dim) {
+  LSTMCellKernel kernel = FindLSTMCellKernel(input_dim, hidden_dim);
+  CHECK(kernel != nullptr);
+  if (kernel == nullptr) {
+    return;
+  }
+  Eigen::MatrixXf x2i = RandomMatrix(hidden_dim, input_dim), x2o = RandomMatrix(hidden_dim, input_dim),
+      x2c = RandomMatrix(hidden_dim, input_dim);
+  Eigen::MatrixXf h2i = RandomMatrix(hidden_dim, hidden_dim), h2o = RandomMatrix(hidden_dim, hidden_dim),
+      h2c = RandomMatrix(hidden_dim, hidden_dim);
+  Eigen::MatrixXf c2i = RandomMatrix(hidden_dim, hidden_dim), c2o = RandomMatrix(hidden_dim, hidden_dim);
+  Eigen::VectorXf bi = RandomMatrix(hidden_dim, 1), bo = RandomMatrix(hidden_dim, 1), bc = RandomMatrix(hidden_dim, 1);
+  LSTMLayerWeights w = {x2i.data(), h2i.data(), c2i.data(), x2o.data(), h2o.data(), c2o.data(), x2c.data(), h2c.data(),
+      bi.data(), bo.data(), bc.data()};
+
+  Eigen::VectorXf c = RandomMatrix(hidden_dim, 1), h = RandomMatrix(hidden_dim, 1);
+  Eigen::VectorXf kernel_c = c, kernel_h = h;
+  for (unsigned step = 0; step < 3; ++step) {
+    Eigen::VectorXf x = RandomMatrix(input_dim, 1) * 10.0f;
+    Eigen::ArrayXf i = Sigmoid(bi + x2i * x + h2i * h + c2i * c);
+    Eigen::VectorXf write = bc + x2c * x + h2c * h;
+    Eigen::VectorXf new_c = (i * write.array().tanh() + (1.0f - i) * c.array()).matrix();
+    Eigen::ArrayXf o = Sigmoid(bo + x2o * x + h2o * h + c2o * new_c);
+    c = new_c;
+    h = (o * c.array().tanh()).matrix();
+
+    kernel(w, x.data(), kernel_c.data(), kernel_h.data());
+    CHECK((kernel_c - c).cwiseAbs().maxCoeff() < 1e-5);
+    CHECK((kernel_h - h).cwiseAbs().maxCoeff() < 1e-5);
+  }
+}
+
+void TestMLP() {
+  const unsigned input_dim = 256, hidden_dim = 64, output_dim = 1001;
+  MLPKernel kernel = FindMLPKernel(input_dim, hidden_dim);
+  CHECK(kernel != nullptr);
+  if (kernel == nullptr) {
+    return;
+  }
+  Eigen::MatrixXf w1 = RandomMatrix(hidden_dim, input_dim), w2 = RandomMatrix(output_dim, hidden_dim);
+  Eigen::VectorXf b1 = RandomMatrix(hidden_dim, 1), b2 = RandomMatrix(output_dim, 1);
+  Eigen::VectorXf x = RandomMatrix(input_dim, 1) * 10.0f;
+  Eigen::VectorXf hidden(hidden_dim), out(output_dim);
+  kernel(w1.data(), b1.data(), w2.data(), b2.data(), output_dim, x.data(), hidden.data(), out.data());
+
+  Eigen::VectorXf expected_hidden = (b1 + w1 * x).array().tanh().matrix();
+  CHECK((hidden - expected_hidden).cwiseAbs().maxCoeff() < 1e-5);
+  CHECK((out - (b2 + w2 * expected_hidden)).cwiseAbs().maxCoeff() < 1e-5);
+}
+
+int main() {
+  TestLSTMCell(32, 128);
+  TestLSTMCell(128, 128);
+  TestLSTMCell(32, 256);
+  TestLSTMCell(288, 256);
+  TestLSTMCell(256, 256);
+  CHECK(FindLSTMCellKernel(33, 128) == nullptr);
+  CHECK(FindLSTMCellKernel(32, 129) == nullptr);
+  TestMLP();
+  CHECK(FindMLPKernel(256, 65) == nullptr);
+  return TestResult("fixedkernels_test");
+}
@@ -0,0 +1,99 @@
+#include <fstream>
+#include "frozenvocab.h"
+#include "check.h"
+
+using namespace std;
+
+void MakeDict(Dict& dict, unsigned num_words) {
+  dict.Convert("UNK");
+  for (unsigned i = 0; i < num_words; ++i) {
+    dict.Convert("w" + to_string(i * 7));
+  }
+  // Words that differ only in a byte or two, and one that is empty
+  dict.Convert("a");
+  dict.Convert("b");
+  dict.Convert("ab");
+  dict.Convert("ba");
+  dict.Convert("");
+  dict.Freeze();
+}
+
+// Every word maps to its own id and back, and anything else maps to UNK
+void CheckVocab(const FrozenVocab& vocab, const Dict& dict) {
+  CHECK(vocab.size() == dict.size());
+  unsigned wrong = 0;
+  for (unsigned i = 0; i < dict.size(); ++i) {
+    const string& word = dict.Convert(i);
+    if (vocab.Convert(StringPiece(word)) != (WordId)i || vocab.Convert((WordId)i) != StringPiece(word)) {
+      ++wrong;
+    }
+  }
+  CHECK(wrong == 0);
+  // MakeDict adds UNK first
+  CHECK(vocab.Convert(StringPiece("not a word")) == 0);
+  CHECK(vocab.Convert(StringPiece("w1")) == 0);
+  CHECK(vocab.Convert(StringPiece("aa")) == 0);
+}
+
+void TestLookups() {
+  for (unsigned num_words : {0, 1, 10, 5000}) {
+    Dict dict;
+    MakeDict(dict, num_words);
+    FrozenVocab vocab(dict, "UNK");
+    CheckVocab(vocab, dict);
+  }
+}
+
+void TestRoundTrip(bool share) {
+  Dict dict;
+  MakeDict(dict, 5000);
+  FrozenVocab vocab(dict, "UNK");
+  TempFile file;
+  {
+    ofstream out(file.name(), ios::binary);
+    out.write("12345", 5);
+    vocab.Write(out);
+    vocab.Write(out);
+  }
+
+  unique_ptr<FrozenVocab> first, second;
+  {
+    shared_ptr<const MappedFile> mapped = make_shared<MappedFile>(file.name());
+    ModelReader in(mapped, share);
+    char magic[5];
+    CHECK(in.Read(magic, 5));
+    first.reset(FrozenVocab::Read(in));
+    second.reset(FrozenVocab::Read(in));
+  }
+  // The vocabularies must keep working once the reader is gone
+  CHECK(first != nullptr && second != nullptr);
+  if (first != nullptr && second != nullptr) {
+    CheckVocab(*first, dict);
+    CheckVocab(*second, dict);
+  }
+}
+
+void TestTruncated() {
+  Dict dict;
+  MakeDict(dict, 100);
+  FrozenVocab vocab(dict, "UNK");
+  TempFile file;
+  {
+    ofstream out(file.name(), ios::binary);
+    vocab.Write(out);
+  }
+  truncate(file.name().c_str(), 200);
+  for (bool share : {false, true}) {
+    ModelReader in(make_shared<MappedFile>(file.name()), share);
+    unique_ptr<FrozenVocab> read(FrozenVocab::Read(in));
+    CHECK(read == nullptr);
+  }
+}
+
+int main() {
+  TestLookups();
+  TestRoundTrip(false);
+  TestRoundTrip(true);
+  TestTruncated();
+  return TestResult("frozenvocab_test");
+}
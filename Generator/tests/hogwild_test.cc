@@ -0,0 +1,69 @@
+#include <thread>
+#include <vector>
+#include "hogwild.h"
+#include "check.h"
+
+using namespace std;
+
+void TestSingleThread() {
+  WorkDeque deque;
+  deque.Reset(3, 7);
+  CHECK(deque.size() == 4);
+  unsigned index;
+  CHECK(deque.PopFront(&index) && index == 3);
+  CHECK(deque.PopBack(&index) && index == 6);
+  CHECK(deque.PopFront(&index) && index == 4);
+  CHECK(deque.size() == 1);
+  CHECK(deque.PopBack(&index) && index == 5);
+  CHECK(deque.size() == 0);
+  CHECK(!deque.PopFront(&index));
+  CHECK(!deque.PopBack(&index));
+
+  deque.Reset(5, 5);
+  CHECK(deque.size() == 0 && !deque.PopFront(&index));
+}
+
+// Owners and thieves racing on the same deques still hand out every index
+// exactly once
+void TestStealing() {
+  const unsigned num_workers = 4, per_worker = 100000;
+  vector<WorkDeque> deques(num_workers);
+  for (unsigned i = 0; i < num_workers; ++i) {
+    deques[i].Reset(i * per_worker, (i + 1) * per_worker);
+  }
+  vector<atomic<unsigned>> taken(num_workers * per_worker);
+  for (atomic<unsigned>& t : taken) {
+    t = 0;
+  }
+
+  vector<thread> workers;
+  for (unsigned i = 0; i < num_workers; ++i) {
+    workers.push_back(thread([&, i]() {
+      unsigned index;
+      // Worker 0 only steals, so the others' deques are always contended
+      while (i != 0 && deques[i].PopFront(&index)) {
+        taken[index]++;
+      }
+      for (unsigned victim = 0; victim < num_workers; ++victim) {
+        while (deques[victim].PopBack(&index)) {
+          taken[index]++;
+        }
+      }
+    }));
+  }
+  for (thread& worker : workers) {
+    worker.join();
+  }
+
+  unsigned wrong = 0;
+  for (const atomic<unsigned>& t : taken) {
+    wrong += (t != 1);
+  }
+  CHECK(wrong == 0);
+}
+
+int main() {
+  TestSingleThread();
+  TestStealing();
+  return TestResult("hogwild_test");
+}
@@ -0,0 +1,193 @@
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include "cnn/cnn.h"
+#include "encdec.h"
+#include "frozenvocab.h"
+#include "inference.h"
+#include "check.h"
+
+using namespace std;
+using namespace cnn;
+
+const unsigned kSourceVocabSize = 20;
+const unsigned kTargetVocabSize = 30;
+
+const vector<vector<WordId>> kSources = {{1, 2, 3}, {4}, {5, 6, 7, 8, 9, 10}, {1, 2, 3}, {19, 0}};
+
+float MaxDifference(const Eigen::MatrixXf& a, const Eigen::MatrixXf& b) {
+  CHECK(a.rows() == b.rows() && a.cols() == b.cols());
+  return (a.rows() == b.rows() && a.cols() == b.cols()) ? (a - b).cwiseAbs().maxCoeff() : 1.0f;
+}
+
+// Decodes a few steps of every source with both models and checks that they
+// give exactly the same distributions
+void CheckSameOutput(const InferenceModel& a, const InferenceModel& b) {
+  for (const vector<WordId>& source : kSources) {
+    InferenceState state_a = a.Encode(source);
+    InferenceState state_b = b.Encode(source);
+    for (WordId word : {1, 7, 29}) {
+      Eigen::VectorXf dist_a, dist_b;
+      a.ComputeLogDistribution(state_a, dist_a);
+      b.ComputeLogDistribution(state_b, dist_b);
+      CHECK(dist_a.size() == kTargetVocabSize);
+      CHECK(MaxDifference(dist_a, dist_b) == 0.0f);
+      state_a = a.AddOutputWord(state_a, word);
+      state_b = b.AddOutputWord(state_b, word);
+    }
+  }
+}
+
+void WriteModel(const string& filename, const InferenceModel& model) {
+  ofstream out(filename, ios::binary);
+  model.Write(out);
+}
+
+InferenceModel* ReadModel(const string& filename, bool share) {
+  ModelReader in(make_shared<MappedFile>(filename), share);
+  return InferenceModel::Read(in);
+}
+
+// A written model reads back, copied or in place, into one that computes exactly the same
+void TestRoundTrip(const WordClasses* classes) {
+  // Covers models with feed, and class-factored ones without
+  Model cnn_model;
+  EncoderDecoderModel translation_model(cnn_model, kSourceVocabSize, kTargetVocabSize, false, classes == nullptr, classes);
+  InferenceModel model(translation_model);
+  for (bool quantized : {false, true}) {
+    if (quantized) {
+      model.Quantize();
+    }
+    TempFile file;
+    WriteModel(file.name(), model);
+    for (bool share : {false, true}) {
+      unique_ptr<InferenceModel> read(ReadModel(file.name(), share));
+      CHECK(read != nullptr);
+      if (read != nullptr) {
+        CheckSameOutput(model, *read);
+      }
+    }
+  }
+}
+
+// The whole GENINFR2 file, vocabularies included
+void TestModelFile() {
+  Dict source_dict, target_dict;
+  source_dict.Convert("UNK");
+  target_dict.Convert("UNK");
+  for (unsigned i = 1; i < kSourceVocabSize; ++i) {
+    source_dict.Convert("s" + to_string(i));
+  }
+  for (unsigned i = 1; i < kTargetVocabSize; ++i) {
+    target_dict.Convert("t" + to_string(i));
+  }
+  FrozenVocab source_vocab(source_dict, "UNK"), target_vocab(target_dict, "UNK");
+  Model cnn_model;
+  EncoderDecoderModel translation_model(cnn_model, kSourceVocabSize, kTargetVocabSize);
+  InferenceModel model(translation_model);
+
+  TempFile file;
+  CHECK(WriteInferenceModelFile(file.name(), source_vocab, target_vocab, model));
+  CHECK(IsInferenceModelFile(file.name()));
+  for (bool share : {false, true}) {
+    FrozenVocab* read_source;
+    FrozenVocab* read_target;
+    InferenceModel* read_model;
+    tie(read_source, read_target, read_model) = ReadInferenceModelFile(file.name(), share);
+    CHECK(read_source != nullptr && read_target != nullptr && read_model != nullptr);
+    if (read_source != nullptr && read_target != nullptr && read_model != nullptr) {
+      CHECK(read_source->Convert(StringPiece("s7")) == 7);
+      CHECK(read_target->Convert((WordId)12) == StringPiece("t12"));
+      CHECK(read_target->Convert(StringPiece("nope")) == 0);
+      CheckSameOutput(model, *read_model);
+    }
+    delete read_source;
+    delete read_target;
+    delete read_model;
+  }
+}
+
+// A header that disagrees with the shapes that follow, or a file that ends
+// early, gives nullptr rather than a model that reads out of bounds
+void TestCorrupt() {
+  Model cnn_model;
+  EncoderDecoderModel translation_model(cnn_model, kSourceVocabSize, kTargetVocabSize);
+  InferenceModel model(translation_model);
+  TempFile file, damaged;
+  WriteModel(file.name(), model);
+  ifstream in(file.name(), ios::binary);
+  const string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+  // The header is feed, class_factored, lstm_layer_count and output_hidden_dim
+  for (unsigned field : {2, 3}) {
+    string corrupt = contents;
+    uint32_t value;
+    memcpy(&value, &corrupt[4 * field], sizeof(value));
+    value += 1;
+    memcpy(&corrupt[4 * field], &value, sizeof(value));
+    {
+      ofstream out(damaged.name(), ios::binary);
+      out.write(corrupt.data(), corrupt.size());
+    }
+    for (bool share : {false, true}) {
+      unique_ptr<InferenceModel> read(ReadModel(damaged.name(), share));
+      CHECK(read == nullptr);
+    }
+  }
+
+  for (size_t length : {(size_t)10, contents.size() / 2, contents.size() - 1}) {
+    {
+      ofstream out(damaged.name(), ios::binary);
+      out.write(contents.data(), length);
+    }
+    for (bool share : {false, true}) {
+      unique_ptr<InferenceModel> read(ReadModel(damaged.name(), share));
+      CHECK(read == nullptr);
+    }
+  }
+}
+
+// Batches that are partly or entirely in the encoder cache are encoded the
+// same as without it, and the same as one sentence at a time
+void TestEncoderCache() {
+  Model cnn_model;
+  EncoderDecoderModel translation_model(cnn_model, kSourceVocabSize, kTargetVocabSize);
+  InferenceModel cached(translation_model);
+  InferenceModel uncached(translation_model);
+  cached.EnableEncoderCache(100);
+
+  cached.Encode(kSources[1]);
+  for (unsigned pass = 0; pass < 2; ++pass) {
+    InferenceBatchState a = cached.EncodeBatch(kSources);
+    InferenceBatchState b = uncached.EncodeBatch(kSources);
+    CHECK(a.c.size() == b.c.size() && a.h.size() == b.h.size());
+    for (unsigned layer = 0; layer < a.c.size() && layer < b.c.size(); ++layer) {
+      CHECK(MaxDifference(a.c[layer], b.c[layer]) < 1e-5);
+      CHECK(MaxDifference(a.h[layer], b.h[layer]) < 1e-5);
+    }
+    for (unsigned j = 0; j < kSources.size(); ++j) {
+      InferenceState single = uncached.Encode(kSources[j]);
+      InferenceState column = a.Column(j);
+      for (unsigned layer = 0; layer < single.c.size(); ++layer) {
+        CHECK(MaxDifference(column.c[layer], single.c[layer]) < 1e-5);
+        CHECK(MaxDifference(column.h[layer], single.h[layer]) < 1e-5);
+      }
+    }
+  }
+  CHECK(uncached.encoder_cache() == nullptr);
+  CHECK(cached.encoder_cache() != nullptr);
+}
+
+int main(int argc, char** argv) {
+  cnn::Initialize(argc, argv);
+  TestRoundTrip(nullptr);
+  WordClasses classes;
+  for (WordId word = 0; word < (WordId)kTargetVocabSize; ++word) {
+    classes.AddWord(word, word % 3);
+  }
+  TestRoundTrip(&classes);
+  TestModelFile();
+  TestCorrupt();
+  TestEncoderCache();
+  return TestResult("inference_test");
+}
@@ -0,0 +1,79 @@
+#include <cstring>
+#include <vector>
+#include "cnn/cnn.h"
+#include "lazytrainer.h"
+#include "check.h"
+
+using namespace std;
+using namespace cnn;
+
+const unsigned kDim = 4;
+const unsigned kSteps = 9;
+
+void SetGradient(Parameters* p, const vector<float>& g) {
+  memcpy(p->g.v, g.data(), kDim * sizeof(float));
+}
+
+void SetGradient(LookupParameters* p, unsigned row, const vector<float>& g) {
+  memcpy(p->grads[row].v, g.data(), kDim * sizeof(float));
+  p->non_zero_grads.insert(row);
+}
+
+// The lazy updates of embedding rows are checked against the trainer's own
+// dense updates of ordinary parameters. A row that gets a gradient at every
+// step must end up where a dense parameter with the same gradients does. A
+// row that only gets one every other step must end up where a dense parameter
+// with zero gradients in between does, unless the optimizer has momentum,
+// whose movement during the missed steps is skipped by design. A row that
+// never gets a gradient is never touched.
+template<class T>
+void TestTrainer(const char* name, bool compare_missed) {
+  Model model;
+  Parameters* always = model.add_parameters({kDim});
+  Parameters* sometimes = model.add_parameters({kDim});
+  LookupParameters* rows = model.add_lookup_parameters(3, {kDim});
+  for (unsigned row = 0; row < 3; ++row) {
+    memcpy(rows->values[row].v, always->values.v, kDim * sizeof(float));
+  }
+  memcpy(sometimes->values.v, always->values.v, kDim * sizeof(float));
+  const vector<float> initial(always->values.v, always->values.v + kDim);
+
+  T trainer(&model, 1e-3);
+  trainer.clipping_enabled = false;
+  const vector<float> zero(kDim, 0.0f);
+  for (unsigned step = 0; step < kSteps; ++step) {
+    vector<float> g(kDim);
+    for (unsigned i = 0; i < kDim; ++i) {
+      g[i] = 0.1f * (float)((step * 7 + i * 3) % 11) - 0.5f;
+    }
+    SetGradient(always, g);
+    SetGradient(rows, 0, g);
+    // Both are updated at the last step, so the row has caught up at the end
+    SetGradient(sometimes, step % 2 == 0 ? g : zero);
+    if (step % 2 == 0) {
+      SetGradient(rows, 1, g);
+    }
+    trainer.update(1.0);
+  }
+
+  for (unsigned i = 0; i < kDim; ++i) {
+    CHECK_NEAR(rows->values[0].v[i], always->values.v[i], 1e-5);
+    if (compare_missed) {
+      CHECK_NEAR(rows->values[1].v[i], sometimes->values.v[i], 1e-5);
+    }
+    CHECK(rows->values[2].v[i] == initial[i]);
+    CHECK(always->values.v[i] != initial[i]);
+  }
+  CHECK(rows->non_zero_grads.empty());
+  if (CheckFailures() > 0) {
+    cerr << name << " disagrees with its dense updates" << endl;
+  }
+}
+
+int main(int argc, char** argv) {
+  cnn::Initialize(argc, argv);
+  TestTrainer<LazyAdagradTrainer>("LazyAdagradTrainer", true);
+  TestTrainer<LazyRmsPropTrainer>("LazyRmsPropTrainer", true);
+  TestTrainer<LazyAdamTrainer>("LazyAdamTrainer", false);
+  return TestResult("lazytrainer_test");
+}
@@ -0,0 +1,203 @@
+#include <cstdint>
+#include <fstream>
+#include <random>
+#include <vector>
+#include "quantize.h"
+#include "check.h"
+
+using namespace std;
+
+mt19937 rng(1234);
+
+Eigen::MatrixXf RandomMatrix(unsigned rows, unsigned cols) {
+  normal_distribution<float> normal(0.0f, 1.0f);
+  Eigen::MatrixXf m(rows, cols);
+  for (unsigned i = 0; i < m.size(); ++i) {
+    m.data()[i] = normal(rng);
+  }
+  return m;
+}
+
+// The SIMD dot products must give exactly the plain loop's result, including
+// for sizes that leave a tail and for the extreme values
+void TestDotInt8() {
+  uniform_int_distribution<int> value(-127, 127);
+  for (unsigned size : {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 1000}) {
+    vector<int8_t> a(size), b(size);
+    for (unsigned i = 0; i < size; ++i) {
+      a[i] = value(rng);
+      b[i] = value(rng);
+    }
+    int64_t expected = 0;
+    for (unsigned i = 0; i < size; ++i) {
+      expected += (int32_t)a[i] * b[i];
+    }
+    CHECK(DotInt8(a.data(), b.data(), size) == expected);
+
+    for (int8_t x : {-127, 127}) {
+      for (int8_t y : {-127, 127}) {
+        vector<int8_t> xs(size, x), ys(size, y);
+        CHECK(DotInt8(xs.data(), ys.data(), size) == (int64_t)size * x * y);
+      }
+    }
+  }
+}
+
+void TestQuantizeValues() {
+  Eigen::MatrixXf values = RandomMatrix(1000, 1);
+  vector<int8_t> quantized(values.size());
+  const float scale = QuantizeValues(values.data(), values.size(), quantized.data());
+  CHECK_NEAR(scale, values.array().abs().maxCoeff() / 127.0f, 1e-7);
+  bool reached_limit = false;
+  for (unsigned i = 0; i < values.size(); ++i) {
+    CHECK(quantized[i] >= -127 && quantized[i] <= 127);
+    CHECK_NEAR(quantized[i] * scale, values(i), scale * 0.5f * 1.0001f);
+    reached_limit = reached_limit || quantized[i] == 127 || quantized[i] == -127;
+  }
+  CHECK(reached_limit);
+
+  vector<float> zeros(10, 0.0f);
+  vector<int8_t> quantized_zeros(10, 1);
+  CHECK(QuantizeValues(zeros.data(), zeros.size(), quantized_zeros.data()) == 0.0f);
+  for (int8_t q : quantized_zeros) {
+    CHECK(q == 0);
+  }
+}
+
+// Rounding both the weights and the input by at most half a step each bounds the error of every output
+void TestQuantizedMultiply() {
+  const unsigned rows = 37, cols = 70;
+  Eigen::MatrixXf m = RandomMatrix(rows, cols);
+  Eigen::MatrixXf x = RandomMatrix(cols, 5);
+  WeightMatrix w(m);
+  Eigen::VectorXf exact = m * x.col(0);
+  Eigen::VectorXf dense = w * Eigen::VectorXf(x.col(0));
+  for (unsigned r = 0; r < rows; ++r) {
+    CHECK_NEAR(dense(r), exact(r), 1e-4);
+  }
+
+  w.Quantize();
+  CHECK(w.quantized());
+  CHECK(w.dense_data() == nullptr);
+  CHECK(w.bytes() == rows * cols);
+  Eigen::MatrixXf batched = w * x;
+  for (unsigned j = 0; j < x.cols(); ++j) {
+    const Eigen::VectorXf column = x.col(j);
+    const Eigen::VectorXf single = w * column;
+    const float x_scale = column.array().abs().maxCoeff() / 127.0f;
+    for (unsigned r = 0; r < rows; ++r) {
+      const float w_scale = m.row(r).array().abs().maxCoeff() / 127.0f;
+      const float bound = 0.5f * w_scale * column.array().abs().sum() + 0.5f * x_scale * m.row(r).array().abs().sum() +
+          0.25f * cols * w_scale * x_scale;
+      CHECK_NEAR(single(r), m.row(r).dot(column), bound + 1e-4);
+      // The batched product quantizes each column exactly as the single one does
+      CHECK(batched(r, j) == single(r));
+    }
+  }
+}
+
+void TestQuantizedEmbeddings() {
+  Eigen::MatrixXf m = RandomMatrix(32, 50);
+  EmbeddingTable table(m);
+  CHECK(table.rows() == 32 && table.cols() == 50);
+  CHECK((table.Column(7) - m.col(7)).norm() == 0.0f);
+  table.Quantize();
+  CHECK(table.quantized());
+  for (unsigned word = 0; word < m.cols(); ++word) {
+    const float scale = m.col(word).array().abs().maxCoeff() / 127.0f;
+    Eigen::VectorXf column = table.Column(word);
+    for (unsigned i = 0; i < m.rows(); ++i) {
+      CHECK_NEAR(column(i), m(i, word), scale * 0.5f * 1.0001f);
+    }
+  }
+}
+
+// Everything written comes back unchanged, whether copied or used in place,
+// and arrays used in place are aligned
+void TestRoundTrip(bool quantized, bool share) {
+  Eigen::MatrixXf m = RandomMatrix(20, 33);
+  Eigen::MatrixXf e = RandomMatrix(16, 40);
+  Eigen::VectorXf b = RandomMatrix(20, 1);
+  vector<Eigen::VectorXf> list = {RandomMatrix(3, 1), RandomMatrix(5, 1)};
+  WeightMatrix w(m);
+  EmbeddingTable table(e);
+  if (quantized) {
+    w.Quantize();
+    table.Quantize();
+  }
+
+  TempFile file;
+  {
+    ofstream out(file.name(), ios::binary);
+    out.write("x", 1); // Leaves everything after it unaligned unless padded
+    w.Write(out);
+    table.Write(out);
+    WriteEigen(out, b);
+    WriteEigenList(out, list);
+  }
+
+  WeightMatrix w2;
+  EmbeddingTable table2;
+  Eigen::VectorXf b2;
+  vector<Eigen::VectorXf> list2;
+  {
+    shared_ptr<const MappedFile> mapped = make_shared<MappedFile>(file.name());
+    CHECK(mapped->is_open());
+    ModelReader in(mapped, share);
+    char x;
+    CHECK(in.Read(&x, 1) && x == 'x');
+    CHECK(w2.Read(in));
+    CHECK(table2.Read(in));
+    CHECK(ReadEigen(in, b2));
+    CHECK(ReadEigenList(in, list2));
+    char past_end;
+    CHECK(!in.Read(&past_end, 1));
+  }
+  // The matrices keep the file mapped for as long as they use it in place
+  CHECK(w2.mapped() == share && table2.mapped() == share);
+  if (share) {
+    CHECK((uintptr_t)w2.data() % kModelAlignment == 0);
+    CHECK((uintptr_t)table2.data() % kModelAlignment == 0);
+  }
+  CHECK(w2.quantized() == quantized && table2.quantized() == quantized);
+  CHECK(w2.rows() == w.rows() && w2.cols() == w.cols());
+  CHECK(table2.rows() == table.rows() && table2.cols() == table.cols());
+
+  Eigen::MatrixXf x = RandomMatrix(m.cols(), 3);
+  CHECK((w2 * x - w * x).norm() == 0.0f);
+  for (unsigned word = 0; word < e.cols(); ++word) {
+    CHECK((table2.Column(word) - table.Column(word)).norm() == 0.0f);
+  }
+  CHECK(b2 == b);
+  CHECK(list2.size() == list.size() && list2[0] == list[0] && list2[1] == list[1]);
+}
+
+// A file that ends early is rejected rather than read past its end
+void TestTruncated() {
+  WeightMatrix w(RandomMatrix(10, 10));
+  TempFile file;
+  {
+    ofstream out(file.name(), ios::binary);
+    w.Write(out);
+  }
+  truncate(file.name().c_str(), 100);
+  for (bool share : {false, true}) {
+    ModelReader in(make_shared<MappedFile>(file.name()), share);
+    WeightMatrix w2;
+    CHECK(!w2.Read(in));
+  }
+}
+
+int main() {
+  TestDotInt8();
+  TestQuantizeValues();
+  TestQuantizedMultiply();
+  TestQuantizedEmbeddings();
+  for (bool quantized : {false, true}) {
+    for (bool share : {false, true}) {
+      TestRoundTrip(quantized, share);
+    }
+  }
+  TestTruncated();
+  return TestResult("quantize_test");
+}
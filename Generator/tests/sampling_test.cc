@@ -0,0 +1,100 @@
+#include <cmath>
+#include <vector>
+#include "sampling.h"
+#include "check.h"
+
+using namespace std;
+
+const unsigned kDraws = 20000;
+
+// Probabilities 0.4, 0.3, 0.2, 0.1, out of order
+const vector<float> kLogProbs = {log(0.2f), log(0.4f), log(0.1f), log(0.3f)};
+
+vector<double> Frequencies(const SamplingOptions& options, unsigned seed = 1) {
+  WordSampler sampler;
+  sampler.SetOptions(options, seed);
+  vector<double> counts(kLogProbs.size(), 0.0);
+  for (unsigned i = 0; i < kDraws; ++i) {
+    WordId word = sampler.Sample(kLogProbs.data(), kLogProbs.size());
+    CHECK(word >= 0 && (unsigned)word < kLogProbs.size());
+    counts[word] += 1.0 / kDraws;
+  }
+  return counts;
+}
+
+// The binomial standard deviation of a frequency is at most 0.0036 at this
+// many draws, so these tolerances are about five of them
+void TestDefault() {
+  vector<double> frequencies = Frequencies(SamplingOptions());
+  for (unsigned i = 0; i < kLogProbs.size(); ++i) {
+    CHECK_NEAR(frequencies[i], exp(kLogProbs[i]), 0.02);
+  }
+}
+
+void TestTopK() {
+  SamplingOptions options;
+  options.top_k = 1;
+  CHECK_NEAR(Frequencies(options)[1], 1.0, 1e-9);
+
+  // The two best words, renormalized
+  options.top_k = 2;
+  vector<double> frequencies = Frequencies(options);
+  CHECK(frequencies[0] == 0.0 && frequencies[2] == 0.0);
+  CHECK_NEAR(frequencies[1], 4.0 / 7.0, 0.02);
+  CHECK_NEAR(frequencies[3], 3.0 / 7.0, 0.02);
+
+  // More than there are words keeps every word
+  options.top_k = 10;
+  CHECK_NEAR(Frequencies(options)[2], 0.1, 0.02);
+}
+
+void TestTopP() {
+  SamplingOptions options;
+  options.top_p = 0.1f;
+  CHECK_NEAR(Frequencies(options)[1], 1.0, 1e-9);
+
+  // 0.4 + 0.3 reaches 0.65, so the third best word is left out
+  options.top_p = 0.65f;
+  vector<double> frequencies = Frequencies(options);
+  CHECK(frequencies[0] == 0.0 && frequencies[2] == 0.0);
+  CHECK_NEAR(frequencies[1], 4.0 / 7.0, 0.02);
+}
+
+void TestTemperature() {
+  SamplingOptions options;
+  options.temperature = 0.01f;
+  CHECK_NEAR(Frequencies(options)[1], 1.0, 1e-9);
+
+  // At temperature 2 the weights are the square roots of the probabilities
+  options.temperature = 2.0f;
+  vector<double> frequencies = Frequencies(options);
+  const double total = sqrt(0.1) + sqrt(0.2) + sqrt(0.3) + sqrt(0.4);
+  for (unsigned i = 0; i < kLogProbs.size(); ++i) {
+    CHECK_NEAR(frequencies[i], sqrt(exp(kLogProbs[i])) / total, 0.02);
+  }
+}
+
+void TestSeed() {
+  SamplingOptions options;
+  WordSampler a, b, c;
+  a.SetOptions(options, 7);
+  b.SetOptions(options, 7);
+  c.SetOptions(options, 8);
+  unsigned same = 0, different = 0;
+  for (unsigned i = 0; i < 1000; ++i) {
+    WordId word = a.Sample(kLogProbs.data(), kLogProbs.size());
+    same += word == b.Sample(kLogProbs.data(), kLogProbs.size());
+    different += word != c.Sample(kLogProbs.data(), kLogProbs.size());
+  }
+  CHECK(same == 1000);
+  CHECK(different > 0);
+}
+
+int main() {
+  TestDefault();
+  TestTopK();
+  TestTopP();
+  TestTemperature();
+  TestSeed();
+  return TestResult("sampling_test");
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/serialization/access.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+// Stands in for cnn's Dict in the tests that are built without cnn. It has the
+// same interface and behaviour, so the code under test compiles unchanged.
+namespace cnn {
+
+class Dict {
+public:
+  Dict() : frozen(false), map_unk(false), unk_id(-1) {}
+
+  unsigned size() const { return words_.size(); }
+  bool Contains(const std::string& word) { return d_.find(word) != d_.end(); }
+  void Freeze() { frozen = true; }
+  bool is_frozen() { return frozen; }
+
+  int Convert(const std::string& word) {
+    auto it = d_.find(word);
+    if (it != d_.end()) {
+      return it->second;
+    }
+    if (frozen) {
+      if (map_unk) {
+        return unk_id;
+      }
+      throw std::runtime_error("Unknown word encountered in frozen dictionary: " + word);
+    }
+    words_.push_back(word);
+    return d_[word] = words_.size() - 1;
+  }
+
+  const std::string& Convert(const int& id) const {
+    assert (id >= 0 && id < (int)words_.size());
+    return words_[id];
+  }
+
+  void SetUnk(const std::string& word) {
+    if (!frozen) {
+      throw std::runtime_error("Please call SetUnk() only after dictionary is frozen");
+    }
+    if (map_unk) {
+      throw std::runtime_error("Set UNK more than one time");
+    }
+    frozen = false;
+    unk_id = Convert(word);
+    frozen = true;
+    map_unk = true;
+  }
+
+  void clear() {
+    words_.clear();
+    d_.clear();
+  }
+
+private:
+  bool frozen;
+  bool map_unk;
+  int unk_id;
+  std::vector<std::string> words_;
+  std::unordered_map<std::string, int> d_;
+
+  friend class boost::serialization::access;
+  template<class Archive> void save(Archive& ar, const unsigned int) const {
+    ar & frozen;
+    ar & map_unk;
+    ar & unk_id;
+    ar & words_;
+  }
+  template<class Archive> void load(Archive& ar, const unsigned int) {
+    ar & frozen;
+    ar & map_unk;
+    ar & unk_id;
+    ar & words_;
+    d_.clear();
+    for (unsigned i = 0; i < words_.size(); ++i) {
+      d_[words_[i]] = i;
+    }
+  }
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+
+} // namespace cnn
@@ -0,0 +1,390 @@
+#pragma once
+#include "cnn/cnn.h"
+#include "cnn/training.h"
+#include "cnn/mp.h"
+#include "placement.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+// Asynchronous Hogwild training. The workers share the parameters of one Model
+// and update them without any locking. Training data is scheduled by estimated
+// cost: each segment is split into one deque per worker so that every worker
+// gets about the same amount of work, and a worker that runs out steals from
+// the back of the fullest remaining deque. Long sentences therefore don't leave
+// the other workers waiting at the next synchronization point.
+//
+// cnn allows only one ComputationGraph per process, so the workers are forked
+// processes rather than threads. They are forked once, before the first epoch,
+// which means the corpus and everything else built before training is shared
+// copy-on-write instead of being copied to each worker. The parameters are only
+// shared if cnn was initialized with shared_parameters = true.
+//
+// The stats type S has the same requirements as in cnn::mp: it is default
+// constructible, supports += and <, can be printed, and is trivially copyable,
+// because it is accumulated in shared memory.
+
+// A fixed range of the shared work queue. The owner takes work from the front
+// and thieves take it from the back. Both ends are packed into one word, so each
+// take is a single compare-and-swap.
+class WorkDeque {
+public:
+  void Reset(unsigned begin, unsigned end) {
+    range = Pack(begin, end);
+  }
+
+  bool PopFront(unsigned* index) {
+    uint64_t r = range.load();
+    while (Front(r) < Back(r)) {
+      if (range.compare_exchange_weak(r, Pack(Front(r) + 1, Back(r)))) {
+        *index = Front(r);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool PopBack(unsigned* index) {
+    uint64_t r = range.load();
+    while (Front(r) < Back(r)) {
+      if (range.compare_exchange_weak(r, Pack(Front(r), Back(r) - 1))) {
+        *index = Back(r) - 1;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  unsigned size() const {
+    uint64_t r = range.load();
+    return Front(r) < Back(r) ? Back(r) - Front(r) : 0;
+  }
+
+private:
+  static uint64_t Pack(unsigned front, unsigned back) { return ((uint64_t)front << 32) | back; }
+  static unsigned Front(uint64_t r) { return (unsigned)(r >> 32); }
+  static unsigned Back(uint64_t r) { return (unsigned)r; }
+  std::atomic<uint64_t> range;
+};
+
+// Per-worker counters, used to report how evenly the work was spread
+struct WorkerUsage {
+  double busy_seconds;
+  unsigned processed;
+  unsigned stolen;
+};
+
+template <class D>
+struct HogwildOptions {
+  HogwildOptions() : random_seed(0), sync_period(0), pin_workers(false) {}
+
+  // Seeds the shuffle of the training data. 0 picks a seed at random.
+  unsigned random_seed;
+  // Estimates the relative training time of a datum, e.g. from its length.
+  // Without it every datum costs the same.
+  std::function<float(const D&)> cost;
+  // If given, called every sync_period data while the workers are paused, e.g.
+  // to exchange parameters with other training nodes
+  std::function<void()> synchronize;
+  unsigned sync_period;
+  // Pins each worker to its own core, with its memory on the core's NUMA node
+  bool pin_workers;
+};
+
+// Interleaves the memory holding the values of every parameter of a cnn model.
+// cnn allocates parameters one after another from a single pool, so this
+// covers the range from the first to the last of them.
+inline bool InterleaveParameters(const cnn::Model& model) {
+  uintptr_t begin = UINTPTR_MAX;
+  uintptr_t end = 0;
+  auto extend = [&](const cnn::Tensor& t) {
+    begin = std::min(begin, (uintptr_t)t.v);
+    end = std::max(end, (uintptr_t)(t.v + t.d.size()));
+  };
+  for (cnn::Parameters* p : model.parameters_list()) {
+    extend(p->values);
+  }
+  for (cnn::LookupParameters* p : model.lookup_parameters_list()) {
+    for (const cnn::Tensor& row : p->values) {
+      extend(row);
+    }
+  }
+  return begin < end && InterleaveMemory((const void*)begin, end - begin);
+}
+
+template <class S>
+struct HogwildControl {
+  pthread_barrier_t barrier; // Workers and the parent meet here between phases
+  pthread_mutex_t lock; // Guards the stats and the progress reports below
+  std::atomic<unsigned> next_dev;
+  unsigned iteration;
+  unsigned processed; // Training data finished so far in this iteration
+  bool end_of_epoch;
+  bool evaluate_dev;
+  bool stop;
+  S report_stats;
+  S epoch_stats;
+  S dev_stats;
+};
+
+template <class T>
+T* MapShared(size_t count) {
+  void* memory = mmap(nullptr, sizeof(T) * std::max(count, (size_t)1), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    std::cerr << "ERROR: Unable to allocate shared memory for training" << std::endl;
+    exit(1);
+  }
+  return static_cast<T*>(memory);
+}
+
+// Takes the next datum from the worker's own deque, or steals one from the
+// deque with the most work left
+inline bool NextWorkItem(WorkDeque* deques, unsigned num_workers, unsigned worker, unsigned* index, bool* stolen) {
+  *stolen = false;
+  if (deques[worker].PopFront(index)) {
+    return true;
+  }
+  while (true) {
+    unsigned victim = worker;
+    unsigned victim_size = 0;
+    for (unsigned w = 0; w < num_workers; ++w) {
+      unsigned size = deques[w].size();
+      if (size > victim_size) {
+        victim = w;
+        victim_size = size;
+      }
+    }
+    if (victim_size == 0) {
+      return false;
+    }
+    if (deques[victim].PopBack(index)) {
+      *stolen = true;
+      return true;
+    }
+  }
+}
+
+// Splits queue[begin, end) into one contiguous range per worker, balancing the
+// estimated cost of each range. Data keep their shuffled order within a range.
+inline void AssignWork(const unsigned* order, unsigned begin, unsigned end, const std::vector<float>& costs,
+    unsigned num_workers, unsigned* queue, WorkDeque* deques) {
+  typedef std::pair<float, unsigned> Load;
+  std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+  for (unsigned w = 0; w < num_workers; ++w) {
+    loads.push(std::make_pair(0.0f, w));
+  }
+  std::vector<std::vector<unsigned>> assigned(num_workers);
+  for (unsigned i = begin; i < end; ++i) {
+    Load load = loads.top();
+    loads.pop();
+    assigned[load.second].push_back(order[i]);
+    loads.push(std::make_pair(load.first + costs[order[i]], load.second));
+  }
+
+  unsigned position = begin;
+  for (unsigned w = 0; w < num_workers; ++w) {
+    deques[w].Reset(position, position + assigned[w].size());
+    position = std::copy(assigned[w].begin(), assigned[w].end(), queue + position) - queue;
+  }
+}
+
+template <class D, class S>
+void RunHogwildWorker(HogwildControl<S>* control, const unsigned* queue, WorkDeque* deques, WorkerUsage* usage, unsigned num_workers, unsigned worker,
+    cnn::mp::ILearner<D, S>* learner, cnn::Trainer* trainer, const std::vector<D>& train_data, const std::vector<D>& dev_data, unsigned report_frequency) {
+  typedef std::chrono::steady_clock Clock;
+  while (true) {
+    pthread_barrier_wait(&control->barrier);
+    if (control->stop) {
+      break;
+    }
+
+    unsigned i;
+    bool stolen;
+    while (!cnn::mp::stop_requested && NextWorkItem(deques, num_workers, worker, &i, &stolen)) {
+      Clock::time_point start = Clock::now();
+      S stats = learner->LearnFromDatum(train_data[queue[i]], true);
+      trainer->update(1.0);
+      usage[worker].busy_seconds += std::chrono::duration<double>(Clock::now() - start).count();
+      usage[worker].processed++;
+      usage[worker].stolen += stolen ? 1 : 0;
+
+      pthread_mutex_lock(&control->lock);
+      control->epoch_stats += stats;
+      control->report_stats += stats;
+      if (++control->processed % report_frequency == 0) {
+        float fractional_iteration = (float)control->iteration + (float)control->processed / train_data.size();
+        std::cerr << "--" << fractional_iteration << " perp=" << control->report_stats << std::endl;
+        control->report_stats = S();
+      }
+      pthread_mutex_unlock(&control->lock);
+    }
+    pthread_barrier_wait(&control->barrier);
+
+    if (control->end_of_epoch) {
+      trainer->update_epoch();
+    }
+    while (control->evaluate_dev && !cnn::mp::stop_requested && (i = control->next_dev++) < dev_data.size()) {
+      S stats = learner->LearnFromDatum(dev_data[i], false);
+      pthread_mutex_lock(&control->lock);
+      control->dev_stats += stats;
+      pthread_mutex_unlock(&control->lock);
+    }
+    pthread_barrier_wait(&control->barrier);
+  }
+}
+
+// Prints each worker's share of the training time since the last report
+inline void ReportUtilization(WorkerUsage* usage, unsigned num_workers, double wall_seconds) {
+  std::ios::fmtflags flags = std::cerr.flags();
+  std::streamsize precision = std::cerr.precision();
+  std::cerr << "Worker utilization:";
+  for (unsigned w = 0; w < num_workers; ++w) {
+    double utilization = (wall_seconds > 0.0) ? 100.0 * usage[w].busy_seconds / wall_seconds : 0.0;
+    std::cerr << " " << std::fixed << std::setprecision(1) << utilization << "% (" << usage[w].processed << " done, " << usage[w].stolen << " stolen)";
+    usage[w] = WorkerUsage();
+  }
+  std::cerr << std::endl;
+  std::cerr.flags(flags);
+  std::cerr.precision(precision);
+}
+
+// Same contract as cnn::mp::RunMultiProcess. Training data is visited in a new
+// random order each iteration. Every dev_frequency data, and at the end of each
+// iteration, the workers pause, evaluate the dev set together, and the model is
+// saved if the dev stats improved.
+template <class D, class S>
+void RunHogwild(unsigned num_workers, cnn::mp::ILearner<D, S>* learner, cnn::Trainer* trainer, const std::vector<D>& train_data,
+    const std::vector<D>& dev_data, unsigned num_iterations, unsigned dev_frequency, unsigned report_frequency,
+    const HogwildOptions<D>& options = HogwildOptions<D>()) {
+  assert (num_workers > 0 && dev_frequency > 0);
+  assert (!options.synchronize || options.sync_period > 0);
+  const unsigned segment_size = options.synchronize ? std::min(options.sync_period, dev_frequency) : dev_frequency;
+  HogwildControl<S>* control = new (MapShared<HogwildControl<S>>(1)) HogwildControl<S>();
+  WorkDeque* deques = MapShared<WorkDeque>(num_workers);
+  WorkerUsage* usage = MapShared<WorkerUsage>(num_workers);
+  unsigned* queue = MapShared<unsigned>(train_data.size());
+  std::vector<unsigned> order(train_data.size());
+  std::vector<float> costs(train_data.size(), 1.0f);
+  for (unsigned i = 0; i < train_data.size(); ++i) {
+    order[i] = i;
+    if (options.cost) {
+      costs[i] = options.cost(train_data[i]);
+    }
+  }
+
+  pthread_barrierattr_t barrier_attributes;
+  pthread_barrierattr_init(&barrier_attributes);
+  pthread_barrierattr_setpshared(&barrier_attributes, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(&control->barrier, &barrier_attributes, num_workers + 1);
+  pthread_mutexattr_t mutex_attributes;
+  pthread_mutexattr_init(&mutex_attributes);
+  pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&control->lock, &mutex_attributes);
+
+  std::vector<CpuPlacement> placements;
+  if (options.pin_workers) {
+    placements = PlanPlacement(num_workers);
+    ReportPlacement("training worker", placements);
+  }
+
+  std::vector<pid_t> workers;
+  for (unsigned w = 0; w < num_workers; ++w) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      std::cerr << "ERROR: Unable to fork training worker " << w << std::endl;
+      exit(1);
+    }
+    if (pid == 0) {
+      if (w < placements.size() && !PinCurrentThread(placements[w])) {
+        std::cerr << "WARNING: Unable to pin training worker " << w << " to CPU " << placements[w].cpu << std::endl;
+      }
+      RunHogwildWorker(control, queue, deques, usage, num_workers, w, learner, trainer, train_data, dev_data, report_frequency);
+      _exit(0);
+    }
+    workers.push_back(pid);
+  }
+
+  typedef std::chrono::steady_clock Clock;
+  std::mt19937 rng(options.random_seed != 0 ? options.random_seed : std::random_device()());
+  S best_dev_stats;
+  bool have_dev_stats = false;
+  for (unsigned iteration = 0; iteration < num_iterations && !cnn::mp::stop_requested; ++iteration) {
+    std::shuffle(order.begin(), order.end(), rng);
+    double train_seconds = 0.0;
+    control->iteration = iteration;
+    control->processed = 0;
+    control->epoch_stats = S();
+    control->report_stats = S();
+
+    unsigned next_dev_point = dev_frequency;
+    for (unsigned begin = 0; begin < train_data.size() && !cnn::mp::stop_requested; begin += segment_size) {
+      unsigned end = std::min((unsigned)train_data.size(), begin + segment_size);
+      AssignWork(order.data(), begin, end, costs, num_workers, queue, deques);
+      control->end_of_epoch = (end == train_data.size());
+      control->evaluate_dev = control->end_of_epoch || end >= next_dev_point;
+      while (next_dev_point <= end) {
+        next_dev_point += dev_frequency;
+      }
+      control->next_dev = 0;
+      control->dev_stats = S();
+
+      Clock::time_point start = Clock::now();
+      pthread_barrier_wait(&control->barrier); // Train on this segment
+      pthread_barrier_wait(&control->barrier); // Evaluate the dev set
+      train_seconds += std::chrono::duration<double>(Clock::now() - start).count();
+      pthread_barrier_wait(&control->barrier);
+
+      if (control->end_of_epoch) {
+        std::cerr << "##" << iteration + 1 << " perp=" << control->epoch_stats << std::endl;
+        ReportUtilization(usage, num_workers, train_seconds);
+      }
+      if (cnn::mp::stop_requested) {
+        break;
+      }
+      if (control->evaluate_dev) {
+        std::string label = control->end_of_epoch ? std::to_string(iteration + 1) : std::to_string(iteration) + "." + std::to_string(control->processed);
+        S dev_stats = control->dev_stats;
+        bool new_best = !have_dev_stats || dev_stats < best_dev_stats;
+        std::cerr << "**" << label << " dev perp: " << dev_stats << (new_best ? " (New best!)" : "") << std::endl;
+        if (new_best) {
+          best_dev_stats = dev_stats;
+          have_dev_stats = true;
+          learner->SaveModel();
+        }
+      }
+      // Only after saving, so that a checkpoint holds exactly the parameters that were scored
+      if (options.synchronize) {
+        options.synchronize();
+      }
+    }
+  }
+
+  control->stop = true;
+  pthread_barrier_wait(&control->barrier);
+  for (pid_t pid : workers) {
+    waitpid(pid, nullptr, 0);
+  }
+
+  pthread_barrier_destroy(&control->barrier);
+  pthread_mutex_destroy(&control->lock);
+  munmap(queue, sizeof(unsigned) * std::max(train_data.size(), (size_t)1));
+  munmap(usage, sizeof(WorkerUsage) * num_workers);
+  munmap(deques, sizeof(WorkDeque) * num_workers);
+  munmap(control, sizeof(HogwildControl<S>));
+}
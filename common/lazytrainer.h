@@ -0,0 +1,152 @@
+#pragma once
+#include "cnn/model.h"
+#include "cnn/training.h"
+
+#include <cmath>
+#include <vector>
+
+// Optimizers that only touch the embedding rows that received a gradient in the
+// current update, so their cost follows the minibatch rather than the
+// vocabulary size. A row that sat out some updates catches up when it is next
+// seen: the L2 decay and the decay of its moment estimates over the missed
+// updates are applied at once. Like other lazy optimizers, the momentum-driven
+// movement a row would have made during missed updates is skipped. Dense
+// parameters are updated every time.
+class LazySparseTrainer : public cnn::Trainer {
+public:
+  LazySparseTrainer(cnn::Model* model, cnn::real lambda, cnn::real eta0, unsigned state_size) :
+    Trainer(model, lambda, eta0), state_size(state_size), step(0) {}
+
+  void update(cnn::real scale) override {
+    const float gscale = clip_gradients() * scale;
+    if (dense_state.empty() && sparse_state.empty()) {
+      AllocateState();
+    }
+    step++;
+
+    const std::vector<cnn::Parameters*>& params = model->parameters_list();
+    for (unsigned k = 0; k < params.size(); ++k) {
+      cnn::Parameters* p = params[k];
+      Decay(p->values.v, p->values.d.size(), 1);
+      Update(p->values.v, p->g.v, p->values.d.size(), dense_state[k].data(), 0, gscale);
+      p->clear();
+    }
+
+    const std::vector<cnn::LookupParameters*>& lookup_params = model->lookup_parameters_list();
+    for (unsigned k = 0; k < lookup_params.size(); ++k) {
+      cnn::LookupParameters* p = lookup_params[k];
+      for (unsigned row : p->non_zero_grads) {
+        const unsigned size = p->values[row].d.size();
+        const unsigned missed = step - 1 - last_update[k][row];
+        Decay(p->values[row].v, size, missed + 1);
+        Update(p->values[row].v, p->grads[row].v, size, &sparse_state[k][row * size * state_size], missed, gscale);
+        last_update[k][row] = step;
+      }
+      p->clear();
+    }
+    updates++;
+  }
+
+protected:
+  // Applies one update to size values, given their gradients and state_size
+  // floats of optimizer state per value. missed is the number of earlier
+  // updates that these values sat out.
+  virtual void Update(float* values, const float* grads, unsigned size, float* state, unsigned missed, float gscale) = 0;
+
+  const unsigned state_size;
+  unsigned step;
+
+private:
+  void AllocateState() {
+    for (cnn::Parameters* p : model->parameters_list()) {
+      dense_state.push_back(std::vector<float>(p->values.d.size() * state_size, 0.0f));
+    }
+    for (cnn::LookupParameters* p : model->lookup_parameters_list()) {
+      const unsigned row_size = p->values.empty() ? 0 : p->values[0].d.size();
+      sparse_state.push_back(std::vector<float>(p->values.size() * row_size * state_size, 0.0f));
+      last_update.push_back(std::vector<unsigned>(p->values.size(), 0));
+    }
+  }
+
+  // L2 regularization, applied as weight decay over the given number of updates
+  void Decay(float* values, unsigned size, unsigned updates) const {
+    if (lambda <= 0.0f) {
+      return;
+    }
+    const float factor = pow(1.0f - eta * lambda, (float)updates);
+    for (unsigned i = 0; i < size; ++i) {
+      values[i] *= factor;
+    }
+  }
+
+  std::vector<std::vector<float>> dense_state;
+  std::vector<std::vector<float>> sparse_state;
+  std::vector<std::vector<unsigned>> last_update;
+};
+
+class LazyAdagradTrainer : public LazySparseTrainer {
+public:
+  LazyAdagradTrainer(cnn::Model* model, cnn::real lambda = 1e-6, cnn::real eta0 = 0.1, cnn::real eps = 1e-20) :
+    LazySparseTrainer(model, lambda, eta0, 1), epsilon(eps) {}
+
+protected:
+  // Zero gradients leave the squared gradient sums alone, so there is nothing to catch up on
+  void Update(float* values, const float* grads, unsigned size, float* state, unsigned missed, float gscale) override {
+    for (unsigned i = 0; i < size; ++i) {
+      const float g = grads[i] * gscale;
+      state[i] += g * g;
+      values[i] -= eta * g / sqrt(state[i] + epsilon);
+    }
+  }
+
+private:
+  cnn::real epsilon;
+};
+
+class LazyRmsPropTrainer : public LazySparseTrainer {
+public:
+  LazyRmsPropTrainer(cnn::Model* model, cnn::real lambda = 1e-6, cnn::real eta0 = 0.1, cnn::real eps = 1e-20, cnn::real rho = 0.95) :
+    LazySparseTrainer(model, lambda, eta0, 1), epsilon(eps), rho(rho) {}
+
+protected:
+  void Update(float* values, const float* grads, unsigned size, float* state, unsigned missed, float gscale) override {
+    const float catch_up = pow(rho, (float)missed);
+    for (unsigned i = 0; i < size; ++i) {
+      const float g = grads[i] * gscale;
+      state[i] = rho * catch_up * state[i] + (1.0f - rho) * g * g;
+      values[i] -= eta * g / sqrt(state[i] + epsilon);
+    }
+  }
+
+private:
+  cnn::real epsilon;
+  cnn::real rho;
+};
+
+class LazyAdamTrainer : public LazySparseTrainer {
+public:
+  LazyAdamTrainer(cnn::Model* model, float lambda = 1e-6, float alpha = 0.001, float beta1 = 0.9, float beta2 = 0.999, float eps = 1e-8) :
+    LazySparseTrainer(model, lambda, alpha, 2), beta1(beta1), beta2(beta2), epsilon(eps) {}
+
+protected:
+  // state holds the first moments of all values, then their second moments
+  void Update(float* values, const float* grads, unsigned size, float* state, unsigned missed, float gscale) override {
+    float* m = state;
+    float* v = state + size;
+    const float m_catch_up = pow(beta1, (float)missed);
+    const float v_catch_up = pow(beta2, (float)missed);
+    const float m_correction = 1.0f - pow(beta1, (float)step);
+    const float v_correction = 1.0f - pow(beta2, (float)step);
+    for (unsigned i = 0; i < size; ++i) {
+      const float g = grads[i] * gscale;
+      m[i] = beta1 * m_catch_up * m[i] + (1.0f - beta1) * g;
+      v[i] = beta2 * v_catch_up * v[i] + (1.0f - beta2) * g * g;
+      values[i] -= eta * (m[i] / m_correction) / (sqrt(v[i] / v_correction) + epsilon);
+    }
+  }
+
+private:
+  float beta1;
+  float beta2;
+  float epsilon;
+};
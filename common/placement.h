@@ -0,0 +1,175 @@
+#pragma once
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// CPU and NUMA placement of worker threads and processes, so that throughput
+// does not depend on where the scheduler happens to put things. Workers are
+// spread round-robin across NUMA nodes, each is pinned to one core, and its own
+// allocations prefer its local node. Memory that every worker reads, like the
+// model parameters, is interleaved across the nodes instead.
+//
+// This uses the raw Linux system calls, so it needs no libnuma. On machines
+// with a single NUMA node the memory policies are skipped.
+
+struct CpuPlacement {
+  unsigned cpu;
+  int node;
+};
+
+namespace placement {
+
+// From linux/mempolicy.h
+const int kMpolPreferred = 1;
+const int kMpolInterleave = 3;
+const unsigned kMpolMfMove = 1 << 1;
+const unsigned long kMaxNodes = 8 * sizeof(unsigned long);
+
+// Parses a kernel CPU list like "0-15,32-47"
+inline std::vector<unsigned> ParseCpuList(const std::string& list) {
+  std::vector<unsigned> cpus;
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string range = list.substr(start, end - start);
+    size_t dash = range.find('-');
+    if (!range.empty()) {
+      unsigned first = std::stoul(range.substr(0, dash));
+      unsigned last = (dash == std::string::npos) ? first : std::stoul(range.substr(dash + 1));
+      for (unsigned cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    }
+    start = end + 1;
+  }
+  return cpus;
+}
+
+// Maps each CPU to its NUMA node. CPUs missing from the map are on node 0.
+inline std::map<unsigned, int> ReadCpuNodes() {
+  std::map<unsigned, int> cpu_nodes;
+  DIR* dir = opendir("/sys/devices/system/node");
+  if (dir == nullptr) {
+    return cpu_nodes;
+  }
+  while (dirent* entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos) {
+      continue;
+    }
+    int node = std::stoi(name.substr(4));
+    std::ifstream cpulist("/sys/devices/system/node/" + name + "/cpulist");
+    std::string list;
+    if (std::getline(cpulist, list)) {
+      for (unsigned cpu : ParseCpuList(list)) {
+        cpu_nodes[cpu] = node;
+      }
+    }
+  }
+  closedir(dir);
+  return cpu_nodes;
+}
+
+} // namespace placement
+
+inline unsigned NumaNodeCount() {
+  std::map<unsigned, int> cpu_nodes = placement::ReadCpuNodes();
+  std::vector<int> nodes;
+  for (const auto& cpu_node : cpu_nodes) {
+    nodes.push_back(cpu_node.second);
+  }
+  std::sort(nodes.begin(), nodes.end());
+  return std::max((unsigned)(std::unique(nodes.begin(), nodes.end()) - nodes.begin()), 1U);
+}
+
+// Chooses a core for each of num_workers workers among the CPUs this process
+// may run on. Consecutive workers go to different NUMA nodes. If there are
+// more workers than cores, cores are reused.
+inline std::vector<CpuPlacement> PlanPlacement(unsigned num_workers) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  std::map<unsigned, int> cpu_nodes = placement::ReadCpuNodes();
+
+  std::map<int, std::vector<unsigned>> node_cpus;
+  for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      node_cpus[cpu_nodes.count(cpu) ? cpu_nodes[cpu] : 0].push_back(cpu);
+    }
+  }
+
+  std::vector<CpuPlacement> placements;
+  if (node_cpus.empty()) {
+    return placements;
+  }
+  std::vector<int> nodes;
+  for (const auto& node : node_cpus) {
+    nodes.push_back(node.first);
+  }
+  for (unsigned w = 0; w < num_workers; ++w) {
+    int node = nodes[w % nodes.size()];
+    const std::vector<unsigned>& cpus = node_cpus[node];
+    placements.push_back({cpus[(w / nodes.size()) % cpus.size()], node});
+  }
+  return placements;
+}
+
+// Pins the calling thread to its core, and makes its future allocations
+// prefer the core's NUMA node. Returns false if the pinning failed.
+inline bool PinCurrentThread(const CpuPlacement& placement) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(placement.cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    return false;
+  }
+  if (NumaNodeCount() > 1 && placement.node >= 0 && (unsigned long)placement.node < placement::kMaxNodes) {
+    unsigned long node_mask = 1UL << placement.node;
+    syscall(SYS_set_mempolicy, placement::kMpolPreferred, &node_mask, placement::kMaxNodes);
+  }
+  return true;
+}
+
+// Spreads the pages of [address, address + size) evenly over every NUMA node,
+// moving pages that were already touched. Only the pages that lie wholly
+// inside the range are moved, so the allocations that share its first and
+// last pages stay where they are. Returns false if nothing was done.
+inline bool InterleaveMemory(const void* address, size_t size) {
+  std::map<unsigned, int> cpu_nodes = placement::ReadCpuNodes();
+  unsigned long node_mask = 0;
+  for (const auto& cpu_node : cpu_nodes) {
+    if (cpu_node.second >= 0 && (unsigned long)cpu_node.second < placement::kMaxNodes) {
+      node_mask |= 1UL << cpu_node.second;
+    }
+  }
+  if (size == 0 || __builtin_popcountl(node_mask) < 2) {
+    return false;
+  }
+  const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = ((uintptr_t)address + page_size - 1) & ~(page_size - 1);
+  uintptr_t end = ((uintptr_t)address + size) & ~(page_size - 1);
+  if (begin >= end) {
+    return false;
+  }
+  return syscall(SYS_mbind, begin, end - begin, placement::kMpolInterleave, &node_mask, placement::kMaxNodes, placement::kMpolMfMove) == 0;
+}
+
+inline void ReportPlacement(const std::string& worker_name, const std::vector<CpuPlacement>& placements) {
+  for (unsigned w = 0; w < placements.size(); ++w) {
+    std::cerr << "Pinned " << worker_name << " " << w << " to CPU " << placements[w].cpu << " (NUMA node " << placements[w].node << ")" << std::endl;
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cstdlib>
+#include <boost/utility/string_ref.hpp>
+
+using namespace std;
+
+// Text parsing shared by the Generator and the Classifier. Tokens are
+// StringPieces pointing into the caller's line, and are written into
+// caller-owned vectors, so a buffer that is reused from line to line stops
+// allocating after the first few lines.
+typedef boost::string_ref StringPiece;
+
+// Splits input at every occurrence of delimiter, keeping empty tokens, so
+// "a||b" split on "|" gives "a", "", "b". At most max_times splits are made.
+inline void Split(StringPiece input, StringPiece delimiter, vector<StringPiece>& tokens, size_t max_times = string::npos) {
+  tokens.clear();
+  size_t next = 0;
+  while (tokens.size() < max_times && (next = input.find(delimiter)) != StringPiece::npos) {
+    tokens.push_back(input.substr(0, next));
+    input = input.substr(next + delimiter.size());
+  }
+  tokens.push_back(input);
+}
+
+// Splits input on runs of whitespace (spaces and tabs). Never produces empty tokens.
+inline void SplitWords(StringPiece input, vector<StringPiece>& tokens) {
+  tokens.clear();
+  size_t i = 0;
+  while (i < input.size()) {
+    while (i < input.size() && isspace((unsigned char)input[i])) {
+      ++i;
+    }
+    size_t start = i;
+    while (i < input.size() && !isspace((unsigned char)input[i])) {
+      ++i;
+    }
+    if (i > start) {
+      tokens.push_back(input.substr(start, i - start));
+    }
+  }
+}
+
+inline StringPiece Strip(StringPiece input) {
+  size_t start = 0;
+  size_t end = input.size();
+  while (start < end && isspace((unsigned char)input[start])) {
+    ++start;
+  }
+  while (end > start && isspace((unsigned char)input[end - 1])) {
+    --end;
+  }
+  return input.substr(start, end - start);
+}
+
+// Reusable scratch space for parsing one line at a time. word is for the
+// lookups and conversions that need a null-terminated std::string.
+struct TokenBuffers {
+  vector<StringPiece> fields;
+  vector<StringPiece> words;
+  string word;
+
+  const string& Word(StringPiece piece) {
+    word.assign(piece.data(), piece.size());
+    return word;
+  }
+};
+
+inline int ParseInt(StringPiece piece, TokenBuffers& buffers) {
+  return atoi(buffers.Word(piece).c_str());
+}
+
+inline double ParseDouble(StringPiece piece, TokenBuffers& buffers) {
+  return atof(buffers.Word(piece).c_str());
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <vector>
+#include "cnn/dict.h"
+
+// Maps ids in from onto ids in to, adding words to "to" unless it is frozen.
+// Returns true if every id maps onto itself. Merging chunk-local vocabularies
+// in chunk order this way hands out ids in order of first occurrence.
+template <typename Id>
+bool BuildVocabMap(const cnn::Dict& from, cnn::Dict& to, std::vector<Id>& id_map) {
+  bool identity = true;
+  id_map.resize(from.size());
+  for (unsigned i = 0; i < from.size(); ++i) {
+    id_map[i] = to.Convert(from.Convert(i));
+    identity = identity && id_map[i] == (Id)i;
+  }
+  return identity;
+}